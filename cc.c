@@ -0,0 +1,180 @@
+#include <math.h>
+#include <string.h>
+#include "cc.h"
+
+#define CC_MAX_CWND (1U << 30)
+#define CC_ABC_SEGS 2      /* appropriate byte counting limit, L in RFC 3465 */
+
+#define CUBIC_C    0.4
+#define CUBIC_BETA 0.7
+
+static inline unsigned int umin(unsigned int a, unsigned int b) { return a < b ? a : b; }
+static inline unsigned int umax(unsigned int a, unsigned int b) { return a > b ? a : b; }
+
+/*
+ * NewReno (RFC 5681, RFC 6582): halve on loss, one MSS per window of
+ * acknowledged data in congestion avoidance.
+ */
+static void renoInit(stcp_cc *cc) {
+    cc->bytes_acked = 0;
+}
+
+static unsigned int renoSsthresh(stcp_cc *cc, unsigned int in_flight) {
+    cc->bytes_acked = 0;
+    return umax(in_flight / 2, 2 * cc->mss);
+}
+
+static void renoCongAvoid(stcp_cc *cc, unsigned int acked, unsigned long now) {
+    cc->bytes_acked += acked;
+    if (cc->bytes_acked >= cc->cwnd) {
+        cc->bytes_acked -= cc->cwnd;
+        cc->cwnd += cc->mss;
+    }
+}
+
+const stcp_cc_ops ccNewReno = { "newreno", renoInit, renoSsthresh, renoCongAvoid };
+
+/*
+ * CUBIC (RFC 8312): after a loss the window follows a cubic function of
+ * the time since the loss, centred on the window at which it happened, so
+ * growth is independent of RTT and quick to reclaim a large window.
+ */
+static void cubicInit(stcp_cc *cc) {
+    cc->w_max = 0;
+    cc->w_est = 0;
+    cc->k = 0;
+    cc->origin = 0;
+    cc->ack_cnt = 0;
+    cc->epoch_start = 0;
+}
+
+static unsigned int cubicSsthresh(stcp_cc *cc, unsigned int in_flight) {
+    double cwnd = (double)cc->cwnd / cc->mss;
+
+    cc->epoch_start = 0;
+    /* Fast convergence: release bandwidth to newer flows */
+    if (cwnd < cc->w_max)
+        cc->w_max = cwnd * (1 + CUBIC_BETA) / 2;
+    else
+        cc->w_max = cwnd;
+    return umax((unsigned int)(cc->cwnd * CUBIC_BETA), 2 * cc->mss);
+}
+
+static void cubicCongAvoid(stcp_cc *cc, unsigned int acked, unsigned long now) {
+    double cwnd = (double)cc->cwnd / cc->mss;
+    double segs = (double)acked / cc->mss;
+
+    if (cc->epoch_start == 0) {
+        cc->epoch_start = now;
+        cc->ack_cnt = 0;
+        cc->w_est = cwnd;
+        if (cwnd < cc->w_max) {
+            cc->k = cbrt((cc->w_max - cwnd) / CUBIC_C);
+            cc->origin = cc->w_max;
+        } else {
+            cc->k = 0;
+            cc->origin = cwnd;
+        }
+    }
+
+    double t = (double)(now - cc->epoch_start + cc->min_rtt) / 1e6;
+    double target = cc->origin + CUBIC_C * (t - cc->k) * (t - cc->k) * (t - cc->k);
+
+    /* Never grow more slowly than Reno would in the same period */
+    cc->w_est += 3 * (1 - CUBIC_BETA) / (1 + CUBIC_BETA) * segs / cwnd;
+    if (cc->w_est > target)
+        target = cc->w_est;
+    if (target > 1.5 * cwnd)
+        target = 1.5 * cwnd;
+
+    if (target > cwnd)
+        cc->ack_cnt += segs * (target - cwnd) / cwnd;
+    if (cc->ack_cnt >= 1) {
+        unsigned int inc = (unsigned int)cc->ack_cnt;
+        cc->ack_cnt -= inc;
+        cc->cwnd = umin(cc->cwnd + inc * cc->mss, CC_MAX_CWND);
+    }
+}
+
+const stcp_cc_ops ccCubic = { "cubic", cubicInit, cubicSsthresh, cubicCongAvoid };
+
+static const stcp_cc_ops *ccAlgorithms[] = { &ccNewReno, &ccCubic, NULL };
+
+/*
+ * Set up cc with the algorithm called "name" (NewReno if name is NULL).
+ * Returns 0 on success or -1 if there is no such algorithm, in which case
+ * cc is left initialised with NewReno.
+ */
+int ccInit(stcp_cc *cc, const char *name, unsigned int mss) {
+    int found = name == NULL;
+
+    memset(cc, 0, sizeof(*cc));
+    cc->ops = &ccNewReno;
+    for (int i = 0; name != NULL && ccAlgorithms[i]; i++) {
+        if (!strcmp(ccAlgorithms[i]->name, name)) {
+            cc->ops = ccAlgorithms[i];
+            found = 1;
+        }
+    }
+    cc->mss = mss;
+    /* Initial window from RFC 3390 */
+    cc->cwnd = umin(4 * mss, umax(2 * mss, 4380));
+    cc->ssthresh = CC_MAX_CWND;
+    cc->ops->init(cc);
+    return found ? 0 : -1;
+}
+
+/*
+ * "acked" bytes of new data were cumulatively acknowledged.  rtt is the
+ * sample taken from this ACK in microseconds, or 0 if there was none.
+ * A receiver that delays its ACKs acknowledges two or more segments at
+ * once, so slow start counts the bytes acknowledged (RFC 3465) rather
+ * than the ACKs, up to CC_ABC_SEGS segments per ACK to limit bursts.
+ * Congestion avoidance counts bytes already.
+ */
+void ccOnAck(stcp_cc *cc, unsigned int acked, long rtt, unsigned long now) {
+    if (rtt > 0 && (cc->min_rtt == 0 || rtt < cc->min_rtt))
+        cc->min_rtt = rtt;
+    if (cc->in_recovery)
+        return;
+    if (cc->cwnd < cc->ssthresh)
+        cc->cwnd = umin(cc->cwnd + umin(acked, CC_ABC_SEGS * cc->mss), CC_MAX_CWND);
+    else
+        cc->ops->cong_avoid(cc, acked, now);
+}
+
+/*
+ * Third duplicate ACK: reduce the window and enter fast recovery, which
+ * lasts until everything up to "recover" has been acknowledged.
+ */
+void ccOnCongestion(stcp_cc *cc, unsigned int in_flight, unsigned int recover) {
+    if (cc->in_recovery)
+        return;
+    cc->ssthresh = cc->ops->ssthresh(cc, in_flight);
+    cc->cwnd = cc->ssthresh + 3 * cc->mss;
+    cc->in_recovery = 1;
+    cc->recover = recover;
+}
+
+/* Each further duplicate ACK means another segment has left the network */
+void ccOnDupAck(stcp_cc *cc) {
+    if (cc->in_recovery)
+        cc->cwnd = umin(cc->cwnd + cc->mss, CC_MAX_CWND);
+}
+
+/* An ACK below recover: deflate by the amount acknowledged (RFC 6582) */
+void ccOnPartialAck(stcp_cc *cc, unsigned int acked) {
+    cc->cwnd = (cc->cwnd > acked ? cc->cwnd - acked : 0) + cc->mss;
+}
+
+void ccExitRecovery(stcp_cc *cc) {
+    cc->cwnd = cc->ssthresh;
+    cc->in_recovery = 0;
+}
+
+/* Retransmission timeout: collapse to one segment and slow start again */
+void ccOnTimeout(stcp_cc *cc, unsigned int in_flight) {
+    cc->ssthresh = cc->ops->ssthresh(cc, in_flight);
+    cc->cwnd = cc->mss;
+    cc->in_recovery = 0;
+}
@@ -0,0 +1,57 @@
+#ifndef __CC_H__
+#define __CC_H__
+
+/*
+ * Congestion control for the STCP sender.
+ *
+ * The generic part (slow start, fast recovery bookkeeping, RTO collapse)
+ * lives in cc.c; an algorithm only supplies the window reduction on a
+ * loss event and the congestion avoidance growth function through a
+ * stcp_cc_ops table.  Algorithms are looked up by name at run time, see
+ * ccInit().  All window quantities are in bytes.
+ */
+
+typedef struct stcp_cc stcp_cc;
+
+typedef struct stcp_cc_ops {
+    const char *name;
+    void (*init)(stcp_cc *cc);
+    /* Return the new ssthresh for a loss event with in_flight bytes outstanding */
+    unsigned int (*ssthresh)(stcp_cc *cc, unsigned int in_flight);
+    /* Grow cwnd (which is >= ssthresh) for "acked" newly acknowledged bytes */
+    void (*cong_avoid)(stcp_cc *cc, unsigned int acked, unsigned long now);
+} stcp_cc_ops;
+
+struct stcp_cc {
+    const stcp_cc_ops *ops;
+    unsigned int mss;
+    unsigned int cwnd;
+    unsigned int ssthresh;
+    int in_recovery;            /* in fast recovery until ack passes recover */
+    unsigned int recover;
+    long min_rtt;               /* microseconds, 0 until the first sample */
+
+    /* NewReno: bytes acked since the last congestion avoidance increment */
+    unsigned int bytes_acked;
+
+    /* CUBIC, in segments and microseconds (RFC 8312) */
+    double w_max;
+    double w_est;
+    double k;
+    double origin;
+    double ack_cnt;
+    unsigned long epoch_start;
+};
+
+extern const stcp_cc_ops ccNewReno;
+extern const stcp_cc_ops ccCubic;
+
+extern int ccInit(stcp_cc *cc, const char *name, unsigned int mss);
+extern void ccOnAck(stcp_cc *cc, unsigned int acked, long rtt, unsigned long now);
+extern void ccOnCongestion(stcp_cc *cc, unsigned int in_flight, unsigned int recover);
+extern void ccOnDupAck(stcp_cc *cc);
+extern void ccOnPartialAck(stcp_cc *cc, unsigned int acked);
+extern void ccExitRecovery(stcp_cc *cc);
+extern void ccOnTimeout(stcp_cc *cc, unsigned int in_flight);
+
+#endif
@@ -0,0 +1,213 @@
+/*
+ * Internet checksum kernels, see cksum.h.
+ *
+ * The one's complement sum of 16-bit words only depends on the total
+ * modulo 0xffff, and 2^16 = 1 modulo 0xffff, so the vector kernels may add
+ * the data as 32-bit words into 64-bit accumulators (which cannot
+ * overflow for any buffer that fits in an int) and fold once at the end.
+ * For the same reason running sums from different kernels can be mixed.
+ */
+
+#include <string.h>
+#include "cksum.h"
+
+#if defined(__GNUC__) && (defined(__x86_64__) || defined(__i386__))
+#include <immintrin.h>
+#define CKSUM_HAVE_X86 1
+#endif
+
+/* Add the 16-bit words of len bytes, and a left-over byte, to sum */
+static unsigned long long addScalar(unsigned long long sum, const void *data, int len) {
+    const unsigned char *p = data;
+    while (len > 1) {
+        unsigned short word;
+        memcpy(&word, p, 2);
+        sum += word;
+        p += 2;
+        len -= 2;
+    }
+    /*  Add left-over byte, if any */
+    if (len > 0)
+        sum += *p;
+    return sum;
+}
+
+static unsigned long long copyScalar(unsigned long long sum, void *dst, const void *src, int len) {
+    unsigned char *d = dst;
+    const unsigned char *s = src;
+    while (len > 1) {
+        unsigned short word;
+        memcpy(&word, s, 2);
+        memcpy(d, &word, 2);
+        sum += word;
+        s += 2;
+        d += 2;
+        len -= 2;
+    }
+    if (len > 0) {
+        *d = *s;
+        sum += *s;
+    }
+    return sum;
+}
+
+#ifdef CKSUM_HAVE_X86
+
+/* Add the four 32-bit words of v to the two 64-bit lanes of acc0 and acc1 */
+#define SSE2_ACCUMULATE(v) do { \
+        acc0 = _mm_add_epi64(acc0, _mm_unpacklo_epi32(v, zero)); \
+        acc1 = _mm_add_epi64(acc1, _mm_unpackhi_epi32(v, zero)); \
+    } while (0)
+
+__attribute__((target("sse2")))
+static unsigned long long sse2Lanes(__m128i acc0, __m128i acc1) {
+    unsigned long long lanes[2];
+    _mm_storeu_si128((__m128i *)lanes, _mm_add_epi64(acc0, acc1));
+    return lanes[0] + lanes[1];
+}
+
+__attribute__((target("sse2")))
+static unsigned long long addSse2(unsigned long long sum, const void *data, int len) {
+    const unsigned char *p = data;
+    const __m128i zero = _mm_setzero_si128();
+    __m128i acc0 = zero, acc1 = zero;
+
+    for (; len >= 32; p += 32, len -= 32) {
+        __m128i a = _mm_loadu_si128((const __m128i *)p);
+        __m128i b = _mm_loadu_si128((const __m128i *)(p + 16));
+        SSE2_ACCUMULATE(a);
+        SSE2_ACCUMULATE(b);
+    }
+    return addScalar(sum + sse2Lanes(acc0, acc1), p, len);
+}
+
+__attribute__((target("sse2")))
+static unsigned long long copySse2(unsigned long long sum, void *dst, const void *src, int len) {
+    unsigned char *d = dst;
+    const unsigned char *s = src;
+    const __m128i zero = _mm_setzero_si128();
+    __m128i acc0 = zero, acc1 = zero;
+
+    for (; len >= 32; s += 32, d += 32, len -= 32) {
+        __m128i a = _mm_loadu_si128((const __m128i *)s);
+        __m128i b = _mm_loadu_si128((const __m128i *)(s + 16));
+        _mm_storeu_si128((__m128i *)d, a);
+        _mm_storeu_si128((__m128i *)(d + 16), b);
+        SSE2_ACCUMULATE(a);
+        SSE2_ACCUMULATE(b);
+    }
+    return copyScalar(sum + sse2Lanes(acc0, acc1), d, s, len);
+}
+
+static int haveSse2(void) {
+    return __builtin_cpu_supports("sse2");
+}
+
+/* Add the eight 32-bit words of v to the four 64-bit lanes of acc0 and acc1 */
+#define AVX2_ACCUMULATE(v) do { \
+        acc0 = _mm256_add_epi64(acc0, _mm256_unpacklo_epi32(v, zero)); \
+        acc1 = _mm256_add_epi64(acc1, _mm256_unpackhi_epi32(v, zero)); \
+    } while (0)
+
+__attribute__((target("avx2")))
+static unsigned long long avx2Lanes(__m256i acc0, __m256i acc1) {
+    unsigned long long lanes[4];
+    _mm256_storeu_si256((__m256i *)lanes, _mm256_add_epi64(acc0, acc1));
+    return lanes[0] + lanes[1] + lanes[2] + lanes[3];
+}
+
+/*
+ * The AVX2 kernels take a last 32-byte step themselves and clear the upper
+ * halves of the YMM registers before the scalar tail: handing the rest to
+ * the legacy-SSE kernel with them dirty costs a state transition per call.
+ */
+__attribute__((target("avx2")))
+static unsigned long long addAvx2(unsigned long long sum, const void *data, int len) {
+    const unsigned char *p = data;
+    const __m256i zero = _mm256_setzero_si256();
+    __m256i acc0 = zero, acc1 = zero;
+
+    for (; len >= 64; p += 64, len -= 64) {
+        __m256i a = _mm256_loadu_si256((const __m256i *)p);
+        __m256i b = _mm256_loadu_si256((const __m256i *)(p + 32));
+        AVX2_ACCUMULATE(a);
+        AVX2_ACCUMULATE(b);
+    }
+    if (len >= 32) {
+        __m256i a = _mm256_loadu_si256((const __m256i *)p);
+        AVX2_ACCUMULATE(a);
+        p += 32;
+        len -= 32;
+    }
+    sum += avx2Lanes(acc0, acc1);
+    _mm256_zeroupper();
+    return addScalar(sum, p, len);
+}
+
+__attribute__((target("avx2")))
+static unsigned long long copyAvx2(unsigned long long sum, void *dst, const void *src, int len) {
+    unsigned char *d = dst;
+    const unsigned char *s = src;
+    const __m256i zero = _mm256_setzero_si256();
+    __m256i acc0 = zero, acc1 = zero;
+
+    for (; len >= 64; s += 64, d += 64, len -= 64) {
+        __m256i a = _mm256_loadu_si256((const __m256i *)s);
+        __m256i b = _mm256_loadu_si256((const __m256i *)(s + 32));
+        _mm256_storeu_si256((__m256i *)d, a);
+        _mm256_storeu_si256((__m256i *)(d + 32), b);
+        AVX2_ACCUMULATE(a);
+        AVX2_ACCUMULATE(b);
+    }
+    if (len >= 32) {
+        __m256i a = _mm256_loadu_si256((const __m256i *)s);
+        _mm256_storeu_si256((__m256i *)d, a);
+        AVX2_ACCUMULATE(a);
+        s += 32;
+        d += 32;
+        len -= 32;
+    }
+    sum += avx2Lanes(acc0, acc1);
+    _mm256_zeroupper();
+    return copyScalar(sum, d, s, len);
+}
+
+static int haveAvx2(void) {
+    return __builtin_cpu_supports("avx2");
+}
+
+static const cksum_kernel kernelAvx2 = { "avx2", addAvx2, copyAvx2, haveAvx2 };
+static const cksum_kernel kernelSse2 = { "sse2", addSse2, copySse2, haveSse2 };
+#endif
+
+static const cksum_kernel kernelScalar = { "scalar", addScalar, copyScalar, NULL };
+
+const cksum_kernel *cksumKernels[] = {
+#ifdef CKSUM_HAVE_X86
+    &kernelAvx2,
+    &kernelSse2,
+#endif
+    &kernelScalar,
+    NULL
+};
+
+static const cksum_kernel *selected = NULL;
+
+/*
+ * The kernel the checksum functions use: the first one the CPU supports.
+ * Threads racing on the first call all store the same answer.
+ */
+const cksum_kernel *cksumSelected(void) {
+    if (selected == NULL) {
+        const cksum_kernel **k = cksumKernels;
+        while ((*k)->supported != NULL && !(*k)->supported())
+            k++;
+        selected = *k;
+    }
+    return selected;
+}
+
+// Compute Internet Checksum for "len" bytes beginning at location "data".
+unsigned short ipchecksum(void *data, int len) {
+    return cksumFinish(cksumAdd(0, data, len));
+}
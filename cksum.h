@@ -0,0 +1,62 @@
+#ifndef __CKSUM_H__
+#define __CKSUM_H__
+
+/*
+ * Internet checksum (RFC 1071) kernels.
+ *
+ * ipchecksum() is on every send and receive, so besides the portable
+ * scalar loop there are SSE2 and AVX2 versions that sum 32-bit words into
+ * 64-bit lanes.  The fastest kernel the CPU supports is picked on the
+ * first call.  All kernels sum in native byte order and give identical
+ * results for any length and alignment.
+ *
+ * A checksum can also be built up piece by piece: cksumAdd() and
+ * cksumCopy() extend an unfolded running sum, the latter copying the data
+ * as it goes so a payload is only touched once, and cksumFinish() folds
+ * and complements it.  Every piece but the last must be of even length.
+ */
+
+typedef struct cksum_kernel {
+    const char *name;
+    unsigned long long (*add)(unsigned long long sum, const void *data, int len);
+    unsigned long long (*copy)(unsigned long long sum, void *dst, const void *src, int len);
+    int (*supported)(void);     /* NULL: always available */
+} cksum_kernel;
+
+/* Every kernel compiled in, fastest first, NULL terminated */
+extern const cksum_kernel *cksumKernels[];
+
+extern const cksum_kernel *cksumSelected(void);
+extern unsigned short ipchecksum(void *data, int len);
+
+static inline unsigned long long cksumAdd(unsigned long long sum, const void *data, int len) {
+    return cksumSelected()->add(sum, data, len);
+}
+
+static inline unsigned long long cksumCopy(unsigned long long sum, void *dst, const void *src, int len) {
+    return cksumSelected()->copy(sum, dst, src, len);
+}
+
+/* Fold a running sum to 16 bits and complement it */
+static inline unsigned short cksumFinish(unsigned long long sum) {
+    while (sum >> 16)
+        sum = (sum & 0xffff) + (sum >> 16);
+    return ~sum;
+}
+
+/*
+ * RFC 1624 incremental update: the checksum after a 16-bit word of the
+ * summed data changes from old to new (both as they sit in memory),
+ * computed as ~(~HC + ~m + m') so that it never yields -0.
+ */
+static inline unsigned short cksumUpdate16(unsigned short check, unsigned short old, unsigned short new) {
+    return cksumFinish((unsigned short)~check + (unsigned long long)(unsigned short)~old + new);
+}
+
+/* The same for a 32-bit field, two words at once */
+static inline unsigned short cksumUpdate32(unsigned short check, unsigned int old, unsigned int new) {
+    return cksumFinish((unsigned short)~check + (unsigned long long)(~old & 0xffff) + (~old >> 16) +
+                       (new & 0xffff) + (new >> 16));
+}
+
+#endif
@@ -0,0 +1,411 @@
+/*
+ * Event loop: sockets through epoll (poll() elsewhere, or io_uring when
+ * asked for) and a min-heap of timers.  See event.h.
+ */
+
+#include <errno.h>
+#include <poll.h>
+#include <stdlib.h>
+#include <unistd.h>
+#include <sys/time.h>
+
+#ifdef __linux__
+#include <sys/epoll.h>
+#define STCP_HAVE_EPOLL 1
+#endif
+
+#include "stcp.h"
+#include "event.h"
+#include "uring.h"
+
+#define LOOP_MAX_EVENTS 64
+
+static unsigned long loopNow(void) {
+    struct timeval tv;
+    gettimeofday(&tv, NULL);
+    return tv.tv_sec * 1000000UL + tv.tv_usec;
+}
+
+/* Make room for "need" pointers in a growable array. */
+static int reserve(stcp_event ***arr, int *cap, int need) {
+    if (need <= *cap)
+        return 0;
+    int size = *cap ? *cap : 8;
+    while (size < need)
+        size *= 2;
+    stcp_event **bigger = realloc(*arr, size * sizeof(stcp_event *));
+    if (bigger == NULL) {
+        logPerror("realloc");
+        return -1;
+    }
+    *arr = bigger;
+    *cap = size;
+    return 0;
+}
+
+int loopInit(stcp_loop *loop) {
+    loop->fds = NULL;
+    loop->nfds = loop->fds_cap = 0;
+    loop->timers = NULL;
+    loop->ntimers = loop->timers_cap = 0;
+    loop->epfd = -1;
+    loop->uring = NULL;
+    loop->uring_deadline = 0;
+#ifdef STCP_HAVE_URING
+    if (stcpEnvInt("STCP_URING", 0)) {
+        loop->uring = malloc(sizeof(stcp_uring));
+        if (loop->uring != NULL && uringInit(loop->uring, STCP_URING_ENTRIES) == 0)
+            return 0;
+        logLog(LOG_ERROR, "io_uring unavailable, falling back to epoll");
+        free(loop->uring);
+        loop->uring = NULL;
+    }
+#endif
+#ifdef STCP_HAVE_EPOLL
+    loop->epfd = epoll_create1(EPOLL_CLOEXEC);
+    if (loop->epfd < 0) {
+        logPerror("epoll_create1");
+        return -1;
+    }
+#endif
+    return 0;
+}
+
+void loopFree(stcp_loop *loop) {
+    if (loop->epfd >= 0)
+        close(loop->epfd);
+    loop->epfd = -1;
+#ifdef STCP_HAVE_URING
+    if (loop->uring != NULL) {
+        uringFree(loop->uring);
+        free(loop->uring);
+        loop->uring = NULL;
+    }
+#endif
+    free(loop->fds);
+    free(loop->timers);
+    loop->fds = loop->timers = NULL;
+    loop->nfds = loop->ntimers = 0;
+}
+
+void eventInit(stcp_event *ev, int fd, stcp_handler handler, void *arg) {
+    ev->fd = fd;
+    ev->handler = handler;
+    ev->arg = arg;
+    ev->deadline = 0;
+    ev->slot = -1;
+    ev->uring_once = 0;
+}
+
+/* Register a socket; its handler is called from loopRun() when it is readable. */
+int loopAdd(stcp_loop *loop, stcp_event *ev) {
+    if (reserve(&loop->fds, &loop->fds_cap, loop->nfds + 1) < 0)
+        return -1;
+    nonblock(ev->fd);
+#ifdef STCP_HAVE_URING
+    if (loop->uring != NULL) {
+        ev->uring_once = !loop->uring->multishot;
+        if (uringPoll(loop->uring, ev->fd, uringTag(ev, URING_POLL)) < 0)
+            return -1;
+        loop->fds[loop->nfds++] = ev;
+        return 0;
+    }
+#endif
+#ifdef STCP_HAVE_EPOLL
+    struct epoll_event ee = { .events = EPOLLIN | EPOLLET, .data.ptr = ev };
+    if (epoll_ctl(loop->epfd, EPOLL_CTL_ADD, ev->fd, &ee) < 0) {
+        logPerror("epoll_ctl");
+        return -1;
+    }
+#endif
+    loop->fds[loop->nfds++] = ev;
+    return 0;
+}
+
+void loopRemove(stcp_loop *loop, stcp_event *ev) {
+    for (int i = 0; i < loop->nfds; i++) {
+        if (loop->fds[i] == ev) {
+            loop->fds[i] = loop->fds[--loop->nfds];
+#ifdef STCP_HAVE_URING
+            if (loop->uring != NULL) {
+                /* The poll is gone once submitted; drop what it already posted */
+                uringPollRemove(loop->uring, uringTag(ev, URING_POLL));
+                uringEnter(loop->uring, 0);
+                uringForget(loop->uring, uringTag(ev, URING_POLL));
+                return;
+            }
+#endif
+#ifdef STCP_HAVE_EPOLL
+            epoll_ctl(loop->epfd, EPOLL_CTL_DEL, ev->fd, NULL);
+#endif
+            return;
+        }
+    }
+}
+
+/* Timer heap maintenance; every move keeps the event's slot up to date. */
+static void heapPlace(stcp_loop *loop, int slot, stcp_event *ev) {
+    loop->timers[slot] = ev;
+    ev->slot = slot;
+}
+
+static void heapUp(stcp_loop *loop, int slot) {
+    stcp_event *ev = loop->timers[slot];
+    while (slot > 0) {
+        int parent = (slot - 1) / 2;
+        if (loop->timers[parent]->deadline <= ev->deadline)
+            break;
+        heapPlace(loop, slot, loop->timers[parent]);
+        slot = parent;
+    }
+    heapPlace(loop, slot, ev);
+}
+
+static void heapDown(stcp_loop *loop, int slot) {
+    stcp_event *ev = loop->timers[slot];
+    for (;;) {
+        int child = 2 * slot + 1;
+        if (child >= loop->ntimers)
+            break;
+        if (child + 1 < loop->ntimers && loop->timers[child + 1]->deadline < loop->timers[child]->deadline)
+            child++;
+        if (ev->deadline <= loop->timers[child]->deadline)
+            break;
+        heapPlace(loop, slot, loop->timers[child]);
+        slot = child;
+    }
+    heapPlace(loop, slot, ev);
+}
+
+/* Arm (or move) a timer to fire once at deadline. */
+int loopTimerSet(stcp_loop *loop, stcp_event *ev, unsigned long deadline) {
+    if (!eventArmed(ev)) {
+        if (reserve(&loop->timers, &loop->timers_cap, loop->ntimers + 1) < 0)
+            return -1;
+        ev->slot = loop->ntimers++;
+        loop->timers[ev->slot] = ev;
+    }
+    ev->deadline = deadline;
+    heapUp(loop, ev->slot);
+    heapDown(loop, ev->slot);
+    return 0;
+}
+
+void loopTimerCancel(stcp_loop *loop, stcp_event *ev) {
+    if (!eventArmed(ev))
+        return;
+    int slot = ev->slot;
+    stcp_event *last = loop->timers[--loop->ntimers];
+    ev->slot = -1;
+    if (last != ev) {
+        heapPlace(loop, slot, last);
+        heapUp(loop, slot);
+        heapDown(loop, last->slot);
+    }
+}
+
+/* The wait before the earliest timer is due, no longer than ms (< 0: forever) */
+static int loopTimeout(stcp_loop *loop, int ms) {
+    if (loop->ntimers == 0)
+        return ms;
+    unsigned long now = loopNow();
+    unsigned long deadline = loop->timers[0]->deadline;
+    if (deadline <= now)
+        return 0;
+    unsigned long wait = (deadline - now + 999) / 1000;
+    return ms >= 0 && (unsigned long)ms < wait ? ms : (int)wait;
+}
+
+#ifdef STCP_HAVE_URING
+/*
+ * Bound the coming wait on the ring to ms milliseconds with the one wait
+ * timeout kept pending there across waits.  It is left alone if it falls
+ * due less than a millisecond before the limit, and moved otherwise (on
+ * kernels before 5.11, withdrawn and prepared again).  Returns -1 if no
+ * timeout could be prepared.
+ */
+static int loopUringTimeout(stcp_loop *loop, int ms, struct __kernel_timespec *ts) {
+    stcp_uring *u = loop->uring;
+    unsigned long deadline = loopNow() + ms * 1000UL;
+    uint64_t tag = uringTag(loop, URING_IGNORE);
+
+    if (loop->uring_deadline != 0) {
+        if (loop->uring_deadline <= deadline && deadline - loop->uring_deadline < 1000)
+            return 0;
+        if (u->timeout_update) {
+            if (uringTimeoutUpdate(u, ts, tag) < 0)
+                return -1;
+            loop->uring_deadline = deadline;
+            return 0;
+        }
+        uringTimeoutRemove(u, tag);
+        loop->uring_deadline = 0;
+    }
+    if (uringTimeout(u, ts, tag) < 0)
+        return -1;
+    loop->uring_deadline = deadline;
+    return 0;
+}
+
+/*
+ * Wait on the ring for up to ms milliseconds (forever if negative), the
+ * limit itself a timeout operation, submitting whatever has been queued
+ * meanwhile in the same call, then handle every completion.  Completions
+ * that need nothing done, such as a withdrawn timeout's, do not end the
+ * wait, nor does a timeout left from an earlier wait if this one has no
+ * limit.
+ */
+static int loopPollUring(stcp_loop *loop, int ms) {
+    stcp_uring *u = loop->uring;
+    struct __kernel_timespec ts = { .tv_sec = ms / 1000, .tv_nsec = (ms % 1000) * 1000000L };
+    int count = 0;
+    int failed = 0;
+    int woken = 0;
+
+    if (ms > 0 && loopUringTimeout(loop, ms, &ts) < 0)
+        ms = 0;
+    do {
+        if (uringEnter(u, ms != 0 && uringPeek(u) == NULL) < 0)
+            return -1;
+
+        struct io_uring_cqe *cqe;
+        while ((cqe = uringPeek(u)) != NULL) {
+            uint64_t data = cqe->user_data;
+            int res = cqe->res;
+            int more = cqe->flags & IORING_CQE_F_MORE;
+            stcp_event *ev = URING_PTR(data);
+            uringAdvance(u);
+
+            switch (URING_KIND(data)) {
+            case URING_POLL:
+                if (res == -EINVAL && !ev->uring_once) {
+                    /* No multishot poll before Linux 5.13: poll once at a time */
+                    if (u->multishot)
+                        logLog(LOG_INIT, "io_uring multishot poll unavailable, polling once at a time");
+                    u->multishot = 0;
+                    ev->uring_once = 1;
+                    uringPoll(u, ev->fd, data);
+                    break;
+                }
+                if (res < 0) {
+                    /* A removed socket's poll is cancelled; anything else is fatal */
+                    if (res != -ECANCELED) {
+                        errno = -res;
+                        logPerror("io_uring poll");
+                        failed = 1;
+                    }
+                    break;
+                }
+                /* Re-arm a poll the kernel ended, before the handler can remove it */
+                if (!more)
+                    uringPoll(u, ev->fd, data);
+                ev->handler(ev);
+                count++;
+                break;
+            case URING_SEND:
+                txqSendFailed(URING_PTR(data), -res);
+                woken = 1;
+                break;
+            case URING_DONE:
+                ev->result = res;
+                ev->handler(ev);
+                count++;
+                break;
+            default:
+                if (ev == (void *)loop && res == -ETIME) {
+                    loop->uring_deadline = 0;
+                    woken |= ms > 0;
+                }
+                break;
+            }
+        }
+    } while (count == 0 && !woken && !failed && ms != 0);
+    return failed ? -1 : count;
+}
+#endif
+
+/* Wait for the sockets and call the handlers of those that are readable */
+static int loopPoll(stcp_loop *loop, int ms) {
+    int count = 0;
+#ifdef STCP_HAVE_URING
+    if (loop->uring != NULL)
+        return loopPollUring(loop, ms);
+#endif
+#ifdef STCP_HAVE_EPOLL
+    struct epoll_event ready[LOOP_MAX_EVENTS];
+    int n = epoll_wait(loop->epfd, ready, LOOP_MAX_EVENTS, ms);
+    for (int i = 0; i < n; i++) {
+        stcp_event *ev = ready[i].data.ptr;
+        ev->handler(ev);
+        count++;
+    }
+#else
+    struct pollfd pfds[loop->nfds + 1];
+    for (int i = 0; i < loop->nfds; i++) {
+        pfds[i].fd = loop->fds[i]->fd;
+        pfds[i].events = POLLIN;
+    }
+    int n = poll(pfds, loop->nfds, ms);
+    for (int i = 0; i < loop->nfds && n > 0; i++) {
+        if (pfds[i].revents != 0) {
+            loop->fds[i]->handler(loop->fds[i]);
+            count++;
+        }
+    }
+#endif
+    if (n < 0 && errno != EINTR) {
+        logPerror("loopRun");
+        return -1;
+    }
+    return count;
+}
+
+/*
+ * Wait up to ms milliseconds (forever if negative), stopping early for the
+ * earliest timer, and run the handlers of every readable socket and every
+ * timer that has fallen due.  A timer is disarmed before its handler runs,
+ * which may arm it again.  Returns the number of handlers run, 0 if the
+ * wait ran out, or -1 on error.
+ */
+int loopRun(stcp_loop *loop, int ms) {
+    int count = loopPoll(loop, loopTimeout(loop, ms));
+    if (count < 0)
+        return -1;
+
+    unsigned long now = loopNow();
+    while (loop->ntimers > 0 && loop->timers[0]->deadline <= now) {
+        stcp_event *ev = loop->timers[0];
+        loopTimerCancel(loop, ev);
+        ev->handler(ev);
+        count++;
+    }
+    return count;
+}
+
+/*
+ * Register buffers that loopRead() will read into, by index, so the
+ * kernel pins them once.  Returns -1 if the loop has no ring or the
+ * registration failed; loopRead() then works with unregistered buffers.
+ */
+int loopRegisterBuffers(stcp_loop *loop, struct iovec *iov, int count) {
+#ifdef STCP_HAVE_URING
+    if (loop->uring != NULL)
+        return uringRegisterBuffers(loop->uring, iov, count);
+#endif
+    return -1;
+}
+
+/*
+ * Start reading up to len bytes from ev->fd, at its current position,
+ * into buf, which is registered buffer buf_index (or none, if negative).
+ * Once the read is done ev's handler is called from loopRun() with the
+ * outcome in ev->result.  Returns -1 if the loop has no ring, in which
+ * case the caller should read for itself.
+ */
+int loopRead(stcp_loop *loop, stcp_event *ev, void *buf, int len, int buf_index) {
+#ifdef STCP_HAVE_URING
+    if (loop->uring != NULL)
+        return uringRead(loop->uring, ev->fd, buf, len, buf_index, uringTag(ev, URING_DONE));
+#endif
+    return -1;
+}
@@ -0,0 +1,65 @@
+#ifndef __EVENT_H__
+#define __EVENT_H__
+
+/*
+ * Event loop for STCP endpoints.
+ *
+ * A stcp_loop waits on any number of sockets and timers at once.  On Linux
+ * sockets are registered once with an edge-triggered epoll instance, so a
+ * wait is a single epoll_wait() with no per-call setup; elsewhere the loop
+ * falls back to poll().  Sockets are made non-blocking when added, and a
+ * socket's handler must read until the socket has nothing left (or until
+ * a short batch shows it had nothing left), since with edge triggering it
+ * is only called again when new data arrives.  Timers sit in a min-heap on
+ * their deadline and cut the wait short, so timer cost does not depend on
+ * how many are armed.  Handlers run from loopRun(), never asynchronously.
+ *
+ * With STCP_URING=1 (where io_uring is compiled in, see uring.h) the loop
+ * waits on an io_uring instead: each socket has a multishot poll on the
+ * ring and the wait is bounded by a timeout operation kept on the ring, and
+ * both go to the kernel together with the sends the connections queued
+ * since the last wait (txqPost()), so one system call both transmits and
+ * waits.  File reads can run on the ring as well (loopRead()).
+ */
+
+#include <sys/uio.h>
+
+typedef struct stcp_event stcp_event;
+typedef void (*stcp_handler)(stcp_event *ev);
+
+struct stcp_event {
+    int fd;                     /* socket, or -1 for a timer */
+    stcp_handler handler;
+    void *arg;
+    unsigned long deadline;     /* timers: microseconds, get_current_time() clock */
+    int slot;                   /* timers: position in the heap, -1 if not armed */
+    int result;                 /* loopRead(): bytes read, or -errno */
+    int uring_once;             /* sockets on io_uring: polled one completion at a time */
+};
+
+typedef struct stcp_loop {
+    int epfd;                   /* -1 when falling back to poll() */
+    stcp_event **fds;           /* registered sockets */
+    int nfds;
+    int fds_cap;
+    stcp_event **timers;        /* armed timers, a min-heap on deadline */
+    int ntimers;
+    int timers_cap;
+    struct stcp_uring *uring;   /* NULL unless waiting on io_uring */
+    unsigned long uring_deadline; /* when the wait timeout on the ring falls due, 0 if none is pending */
+} stcp_loop;
+
+static inline int eventArmed(stcp_event *ev) { return ev->slot >= 0; }
+
+extern int loopInit(stcp_loop *loop);
+extern void loopFree(stcp_loop *loop);
+extern void eventInit(stcp_event *ev, int fd, stcp_handler handler, void *arg);
+extern int loopAdd(stcp_loop *loop, stcp_event *ev);
+extern void loopRemove(stcp_loop *loop, stcp_event *ev);
+extern int loopTimerSet(stcp_loop *loop, stcp_event *ev, unsigned long deadline);
+extern void loopTimerCancel(stcp_loop *loop, stcp_event *ev);
+extern int loopRun(stcp_loop *loop, int ms);
+extern int loopRegisterBuffers(stcp_loop *loop, struct iovec *iov, int count);
+extern int loopRead(stcp_loop *loop, stcp_event *ev, void *buf, int len, int buf_index);
+
+#endif
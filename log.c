@@ -1,18 +1,171 @@
+#include <pthread.h>
 #include <stdio.h>
 #include <stdarg.h>
 #include <stdlib.h>
 #include <string.h>
+#include <time.h>
 #include "log.h"
 
-static char **enabledChannels = NULL;
+/* The names logConfig() knows the channels by, in LOG_ id order */
+static const char *channelNames[LOG_CHANNELS] = {
+    "init", "segment", "event", "error", "failure", "packet", "stats", "close"
+};
+
+unsigned int logMask;
 static char *prefix;
 
-static int enabled(char *channel) {
-    for (int i = 0; enabledChannels[i]; i++) {
-	char *c = enabledChannels[i];
-	if (!strcmp(c, channel)) return 1;
+/*
+ * Asynchronous logging (STCP_LOG_ASYNC=1).  Instead of formatting and
+ * writing each message where it is logged, every thread appends entries to
+ * a ring of its own, and a background thread takes them off, formats them
+ * and writes them out in batches.  A ring has one producer and one
+ * consumer, so the two only share its head and tail indexes, published
+ * with release stores and read with acquire loads: logging takes no lock
+ * and makes no system call.  An entry holds the time and channel, and
+ * either the message text or, for logRecord(), the raw bytes to format
+ * later, such as a packet header.  A full ring drops entries rather than
+ * wait; the count is reported at the end.  The rings are drained when the
+ * process exits (logFlush()), so a crash loses what was still in them.
+ */
+#define LOG_RING_ENTRIES 4096     /* per thread, STCP_LOG_RING overrides */
+#define LOG_ENTRY_DATA 232
+#define LOG_DRAIN_INTERVAL 5      /* ms the background thread sleeps when idle */
+
+typedef struct log_entry {
+    long time;                    /* ms, as now() */
+    short channel;                /* LOG_ id */
+    short len;
+    logFormatter format;          /* NULL for a text message */
+    unsigned char data[LOG_ENTRY_DATA];
+} log_entry;
+
+typedef struct log_ring {
+    struct log_ring *next;        /* every thread's ring, see rings */
+    unsigned int head;            /* next entry to take, written by the consumer */
+    unsigned int tail;            /* next entry to fill, written by the producer */
+    unsigned int mask;
+    unsigned long dropped;
+    log_entry *entries;
+} log_ring;
+
+static int async;
+static unsigned int ringEntries;
+static log_ring *rings;           /* registered under ringsLock, never freed */
+static pthread_mutex_t ringsLock = PTHREAD_MUTEX_INITIALIZER;
+static pthread_t drainThread;
+static volatile int stopping;
+static __thread log_ring *myRing;
+
+/* The calling thread's ring, created on first use.  NULL if out of memory. */
+static log_ring *threadRing() {
+    if (myRing != NULL)
+	return myRing;
+    log_ring *ring = calloc(1, sizeof(log_ring));
+    if (ring == NULL || (ring->entries = malloc(ringEntries * sizeof(log_entry))) == NULL) {
+	free(ring);
+	return NULL;
+    }
+    ring->mask = ringEntries - 1;
+    pthread_mutex_lock(&ringsLock);
+    ring->next = rings;
+    rings = ring;
+    pthread_mutex_unlock(&ringsLock);
+    return myRing = ring;
+}
+
+/* A free entry at the tail of this thread's ring, or NULL if it is full */
+static log_entry *ringClaim(log_ring *ring) {
+    unsigned int head = __atomic_load_n(&ring->head, __ATOMIC_ACQUIRE);
+    if (ring->tail - head > ring->mask) {
+	ring->dropped++;
+	return NULL;
     }
-    return 0;
+    return &ring->entries[ring->tail & ring->mask];
+}
+
+static void ringPublish(log_ring *ring) {
+    __atomic_store_n(&ring->tail, ring->tail + 1, __ATOMIC_RELEASE);
+}
+
+static void printLine(long t, char *text) {
+    t %= 100000000;
+    printf("%4ld.%03ld %s: %s\n", t / 1000, t % 1000, prefix, text);
+}
+
+/*
+ * Write out everything in the rings, oldest first across threads, and
+ * flush stdout once.  Only one thread drains at a time.
+ */
+static void drain() {
+    char text[512];
+    int any = 0;
+
+    pthread_mutex_lock(&ringsLock);
+    flockfile(stdout);
+    for (;;) {
+	log_ring *oldest = NULL;
+	log_entry *first = NULL;
+	for (log_ring *ring = rings; ring != NULL; ring = ring->next) {
+	    unsigned int tail = __atomic_load_n(&ring->tail, __ATOMIC_ACQUIRE);
+	    if (ring->head == tail)
+		continue;
+	    log_entry *e = &ring->entries[ring->head & ring->mask];
+	    if (first == NULL || e->time < first->time) {
+		oldest = ring;
+		first = e;
+	    }
+	}
+	if (oldest == NULL)
+	    break;
+	if (first->format != NULL)
+	    first->format(text, sizeof(text), first->data, first->len);
+	printLine(first->time, first->format != NULL ? text : (char *)first->data);
+	__atomic_store_n(&oldest->head, oldest->head + 1, __ATOMIC_RELEASE);
+	any = 1;
+    }
+    if (any)
+	fflush(stdout);
+    funlockfile(stdout);
+    pthread_mutex_unlock(&ringsLock);
+}
+
+static void *drainLoop(void *arg) {
+    struct timespec idle = { 0, LOG_DRAIN_INTERVAL * 1000000L };
+    while (!stopping) {
+	drain();
+	nanosleep(&idle, NULL);
+    }
+    return NULL;
+}
+
+/*
+ * Stop asynchronous logging and write out whatever is left, reporting any
+ * entries that were dropped; later messages are written directly.  Runs
+ * at exit, and can be called earlier so that what follows on stdout
+ * comes after the log.
+ */
+void logFlush() {
+    if (!async)
+	return;
+    stopping = 1;
+    pthread_join(drainThread, NULL);
+    async = 0;
+    drain();
+    for (log_ring *ring = rings; ring != NULL; ring = ring->next)
+	if (ring->dropped)
+	    logLog(LOG_FAILURE, "%lu log entries dropped, the log ring was full", ring->dropped);
+}
+
+/* Switch to asynchronous logging.  Stays synchronous if that fails. */
+static void logStartAsync() {
+    char *value = getenv("STCP_LOG_RING");
+    int want = value != NULL ? atoi(value) : LOG_RING_ENTRIES;
+    for (ringEntries = 64; ringEntries < (unsigned int)want && ringEntries < (1u << 20); ringEntries <<= 1)
+	;
+    if (pthread_create(&drainThread, NULL, drainLoop, NULL) != 0)
+	return;
+    async = 1;
+    atexit(logFlush);
 }
 
 long now() {
@@ -23,26 +176,21 @@ long now() {
     return ans;
 }
 
-static int countOccurances(char *s, char c) {
-    int count = 0;
-    while (*s) {
-	if (*s == c) count++;
-	s++;
-    }
-    return count;
-}
-
 static char *strsave(char *s) {
     char *ans = malloc(strlen(s) + 1);
     strcpy(ans, s);
     return ans;
 }
 
-static char *strnsave(char *s, int len) {
-    char *ans = malloc(len + 1);
-    strncpy(ans, s, len);
-    ans[len] = '\0';
-    return ans;
+/* Enable the channel named by the len bytes at name */
+static void enableChannel(char *name, int len) {
+    for (int id = 0; id < LOG_CHANNELS; id++) {
+	if (strlen(channelNames[id]) == len && !strncmp(channelNames[id], name, len)) {
+	    logMask |= LOG_BIT(id);
+	    return;
+	}
+    }
+    fprintf(stderr, "%s: unknown log channel %.*s\n", prefix, len, name);
 }
 
 /*
@@ -52,42 +200,86 @@ static char *strnsave(char *s, int len) {
  * channels is a string containing a comma-separated list of words, each of
  * which defines a channel that is enabled:  messages logged with that
  * channel name will be displayed.  messages logged with any other channel
- * names will not be displayed.
+ * names will not be displayed.  The STCP_LOG environment variable can
+ * enable more, "packet" for instance.  The names are resolved to the
+ * logMask bits that logLog() tests, once, here.
  */
 void logConfig(char *prefixx, char *channels) {
+    char *extra = getenv("STCP_LOG");
     prefix = strsave(prefixx);
-    int len = countOccurances(channels, ',') + 1;
-    enabledChannels = calloc(len + 1, sizeof(char *));
-    int i = 0;
-    while (*channels) {
-	char *pos = index(channels, ',');
-	if (pos == NULL) {
-	    len = strlen(channels);
-	} else {
-	    len = pos - channels;
+    logMask = 0;
+    for (int pass = 0; pass < 2; pass++, channels = extra) {
+	while (channels != NULL && *channels) {
+	    char *pos = index(channels, ',');
+	    int len = pos == NULL ? strlen(channels) : pos - channels;
+	    if (len > 0)
+		enableChannel(channels, len);
+	    channels += len + (pos == NULL ? 0 : 1);
 	}
-	char *one = strnsave(channels, len);
-	enabledChannels[i] = one;
-	i++;
-	channels += len + (pos == NULL ? 0 : 1);
     }
-    enabledChannels[i] = NULL;
+
+    char *value = getenv("STCP_LOG_ASYNC");
+    if (value != NULL && atoi(value) && !async)
+	logStartAsync();
 }
 
-void logLog(char *channel, char *format, ...) {
+/* logLog() once the channel is known to be enabled */
+void logWrite(int id, char *format, ...) {
     va_list al;
+    log_ring *ring;
 
-    if (enabled(channel)) {
+    if (async && (ring = threadRing()) != NULL) {
+	log_entry *e = ringClaim(ring);
+	if (e != NULL) {
+	    e->time = now();
+	    e->channel = id;
+	    e->format = NULL;
+	    va_start(al, format);
+	    vsnprintf((char *)e->data, sizeof(e->data), format, al);
+	    va_end(al);
+	    ringPublish(ring);
+	}
+    } else {
 	long t = now() % 100000000;
+	/* Keep the line whole when several threads log */
+	flockfile(stdout);
 	printf("%4ld.%03ld %s: ", t / 1000, t % 1000, prefix);
 	va_start(al, format);
 	vprintf(format, al);
 	va_end(al);
 	putchar('\n');
+	funlockfile(stdout);
+    }
+}
+
+/*
+ * logRecord(): log the len bytes at data on channel id, as format(buf,
+ * size, data, len) renders them.  With asynchronous logging only the bytes are copied
+ * here, and formatting is left to the background thread.  Otherwise the
+ * line is written and flushed at once.
+ */
+void logWriteRecord(int id, logFormatter format, const void *data, int len) {
+    char text[512];
+    log_ring *ring;
+
+    if (async && len <= LOG_ENTRY_DATA && (ring = threadRing()) != NULL) {
+	log_entry *e = ringClaim(ring);
+	if (e != NULL) {
+	    e->time = now();
+	    e->channel = id;
+	    e->format = format;
+	    e->len = len;
+	    memcpy(e->data, data, len);
+	    ringPublish(ring);
+	}
+	return;
     }
+    format(text, sizeof(text), data, len);
+    logWrite(id, "%s", text);
+    fflush(stdout);
 }
 
 void logPerror(char *who) {
     const char *const error = strerror(errno);
-    logLog("failure", "%s %s", who, error);
+    logLog(LOG_FAILURE, "%s %s", who, error);
 }
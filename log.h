@@ -4,14 +4,54 @@
 #include <sys/errno.h>
 
 /*
- * You can create channels for diagnostic messages just by including them in the 
- * argument to logConfig and then using them in calls to logLog.  
- * 
+ * Diagnostic messages go to channels, which are enabled by naming them in
+ * the argument to logConfig and logged to with logLog.
+ *
  * See sender.c for examples.
+ *
+ * Each channel has an id, and logConfig turns the names into a mask of
+ * enabled ids.  logLog and logRecord are macros that test the channel's
+ * bit before anything else, so a message on a disabled channel costs a
+ * test and a branch, and its arguments are never evaluated.  Channels
+ * listed in STCP_LOG_STRIP at compile time (make LOG_STRIP="PACKET ...")
+ * are never enabled, and the compiler drops their messages altogether.
  */
+enum {
+    LOG_INIT,
+    LOG_SEGMENT,
+    LOG_EVENT,
+    LOG_ERROR,
+    LOG_FAILURE,
+    LOG_PACKET,
+    LOG_STATS,
+    LOG_CLOSE,
+    LOG_CHANNELS
+};
+
+#define LOG_BIT(id) (1u << (id))
+
+#ifndef STCP_LOG_STRIP
+#define STCP_LOG_STRIP 0
+#endif
+
+extern unsigned int logMask;
+
+#define logEnabled(id) (!(STCP_LOG_STRIP & LOG_BIT(id)) && (logMask & LOG_BIT(id)))
+#define logLog(id, ...) \
+    do { if (logEnabled(id)) logWrite(id, __VA_ARGS__); } while (0)
+#define logRecord(id, format, data, len) \
+    do { if (logEnabled(id)) logWriteRecord(id, format, data, len); } while (0)
+
+/*
+ * Renders the len bytes logged with logRecord at data as text in buf,
+ * which holds size bytes.
+ */
+typedef void (*logFormatter)(char *buf, int size, const void *data, int len);
 
 extern void logConfig(char *name, char *channels);
-extern void logLog(char *channel, char *format, ...);
+extern void logWrite(int id, char *format, ...);
+extern void logWriteRecord(int id, logFormatter format, const void *data, int len);
+extern void logFlush();
 extern void logPerror(char *who);
 extern long now();
 
@@ -0,0 +1,117 @@
+#include <errno.h>
+#include <stdlib.h>
+#include <unistd.h>
+#include "stcp.h"
+#include "reader.h"
+
+static inline unsigned char *chunk(stcp_reader *r, unsigned long n) {
+    return r->bufs + (size_t)(n % r->nbufs) * r->bufsize;
+}
+
+/* The reader thread: fill free chunks in order until end of file or an error */
+static void *readerMain(void *arg) {
+    stcp_reader *r = arg;
+
+    pthread_mutex_lock(&r->lock);
+    for (;;) {
+        /* Chunks the sender has given back are free */
+        while (!r->stop && r->filled - (r->next - r->holding) == (unsigned long)r->nbufs)
+            pthread_cond_wait(&r->room, &r->lock);
+        if (r->stop)
+            break;
+        unsigned char *buf = chunk(r, r->filled);
+        pthread_mutex_unlock(&r->lock);
+
+        int n;
+        do {
+            n = read(r->fd, buf, r->bufsize);
+        } while (n < 0 && errno == EINTR);
+        int err = errno;
+
+        pthread_mutex_lock(&r->lock);
+        r->lens[r->filled % r->nbufs] = n;
+        if (n < 0)
+            r->err = err;
+        r->filled++;
+        pthread_cond_signal(&r->more);
+        if (n <= 0)
+            break;
+    }
+    pthread_mutex_unlock(&r->lock);
+    return NULL;
+}
+
+/*
+ * Start reading fd ahead into nbufs chunks (at least two) of bufsize
+ * bytes each.  Returns -1 on error, when the caller should read the file
+ * itself.
+ */
+int readerStart(stcp_reader *r, int fd, int nbufs, int bufsize) {
+    r->fd = fd;
+    r->nbufs = nbufs < 2 ? 2 : nbufs;
+    r->bufsize = bufsize;
+    r->err = 0;
+    r->filled = r->next = 0;
+    r->holding = r->stop = 0;
+    r->bufs = malloc((size_t)r->nbufs * bufsize);
+    r->lens = malloc(r->nbufs * sizeof(int));
+    if (r->bufs == NULL || r->lens == NULL) {
+        logPerror("malloc");
+        free(r->bufs);
+        free(r->lens);
+        return -1;
+    }
+    pthread_mutex_init(&r->lock, NULL);
+    pthread_cond_init(&r->more, NULL);
+    pthread_cond_init(&r->room, NULL);
+    if (pthread_create(&r->thread, NULL, readerMain, r) != 0) {
+        logPerror("pthread_create");
+        pthread_mutex_destroy(&r->lock);
+        pthread_cond_destroy(&r->more);
+        pthread_cond_destroy(&r->room);
+        free(r->bufs);
+        free(r->lens);
+        return -1;
+    }
+    return 0;
+}
+
+/*
+ * Give back the chunk from the previous call and wait for the next one.
+ * Stores its address in *data and returns its length, valid until the
+ * next call; returns 0 at end of file, or -1 with errno set if a read
+ * failed, then and on every later call.
+ */
+int readerNext(stcp_reader *r, unsigned char **data) {
+    pthread_mutex_lock(&r->lock);
+    if (r->holding) {
+        r->holding = 0;
+        pthread_cond_signal(&r->room);
+    }
+    while (r->filled == r->next)
+        pthread_cond_wait(&r->more, &r->lock);
+    int n = r->lens[r->next % r->nbufs];
+    if (n > 0) {
+        *data = chunk(r, r->next);
+        r->next++;
+        r->holding = 1;
+    } else if (n < 0) {
+        errno = r->err;
+    }
+    pthread_mutex_unlock(&r->lock);
+    return n;
+}
+
+/* Stop the reader thread, wherever it is, and free the chunks */
+void readerStop(stcp_reader *r) {
+    pthread_mutex_lock(&r->lock);
+    r->stop = 1;
+    pthread_cond_signal(&r->room);
+    pthread_mutex_unlock(&r->lock);
+    pthread_join(r->thread, NULL);
+    pthread_mutex_destroy(&r->lock);
+    pthread_cond_destroy(&r->more);
+    pthread_cond_destroy(&r->room);
+    free(r->bufs);
+    free(r->lens);
+}
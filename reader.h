@@ -0,0 +1,37 @@
+#ifndef __READER_H__
+#define __READER_H__
+
+/*
+ * Read-ahead for files that are sent from a buffer rather than mapped.
+ *
+ * A reader thread fills a bounded ring of chunks from the file while the
+ * sender is busy with the network, so a slow or cold disk and the round
+ * trips overlap instead of taking turns.  The sender takes the chunks in
+ * order with readerNext(); the chunk it holds goes back to the reader on
+ * its next call, and the reader stops when every other chunk is full.
+ */
+
+#include <pthread.h>
+
+typedef struct stcp_reader {
+    int fd;
+    int nbufs;
+    int bufsize;
+    unsigned char *bufs;        /* nbufs chunks of bufsize bytes */
+    int *lens;                  /* bytes in each, 0 at end of file, -1 on error */
+    int err;                    /* errno of a failed read */
+    unsigned long filled;       /* chunks the reader has finished */
+    unsigned long next;         /* chunks handed to the sender */
+    int holding;                /* the sender holds chunk next - 1 */
+    int stop;
+    pthread_mutex_t lock;
+    pthread_cond_t more;        /* a chunk was filled */
+    pthread_cond_t room;        /* a chunk was given back */
+    pthread_t thread;
+} stcp_reader;
+
+extern int readerStart(stcp_reader *r, int fd, int nbufs, int bufsize);
+extern int readerNext(stcp_reader *r, unsigned char **data);
+extern void readerStop(stcp_reader *r);
+
+#endif
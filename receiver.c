@@ -0,0 +1,1120 @@
+/************************************************************************
+ * The STCP receiver.
+ *
+ * Accepts one connection, writes the data it carries to OutputFile and
+ * acknowledges it, in place of the prebuilt receiver binaries and with
+ * the same command line and test scripts, so the receiving side can be
+ * measured and tuned along with the sender.  It understands the header
+ * options of tcp.h: it answers a SYN that carries them with its own MSS,
+ * window scale and SACK permission, reports out-of-order data in SACK
+ * blocks and acknowledges path MTU probes.
+ *
+ * A script can impair the packets going either way; see scriptLoad().
+ *
+ *************************************************************************/
+
+#include <assert.h>
+#include <fcntl.h>
+#include <limits.h>
+#include <stdio.h>
+#include <stdlib.h>
+#include <time.h>
+#include <unistd.h>
+#include <arpa/inet.h>
+#include <sys/stat.h>
+#include <sys/time.h>
+#include <sys/uio.h>
+
+#include "stcp.h"
+#include "event.h"
+
+#define STCP_SUCCESS 1
+#define STCP_ERROR -1
+
+/* The receiver is in LISTEN until the SYN arrives, then ESTABLISHED until
+ * the FIN, then in TIME_WAIT to answer retransmitted FINs */
+#define STCP_RECEIVER_LISTEN 0
+#define STCP_RECEIVER_ESTABLISHED 1
+#define STCP_RECEIVER_TIME_WAIT 2
+#define STCP_RECEIVER_CLOSED 3
+
+#define STCP_RCVBUF (1 << 20)     /* default receive buffer, STCP_RCVBUF overrides */
+#define STCP_SKB_OVERHEAD 768     /* socket memory a datagram takes beyond its bytes */
+#define STCP_MAX_RANGES 64        /* out-of-order ranges held at once */
+#define STCP_IDLE_LIMIT 2         /* silent STCP_INFINITE_TIMEOUT periods before giving up */
+#define STCP_SWAP_HOLD 500        /* longest a swapped packet waits for the next, ms */
+#define STCP_DELACK 40            /* default delayed ACK timeout, ms; STCP_DELACK overrides */
+#define STCP_DELACK_SEGS 2        /* ACK at least every second in-order segment */
+#define STCP_QUICKACK 16          /* in-order segments ACKed at once at the start */
+#define STCP_WRITE_SHARE 4        /* delivered data is written once it fills 1/4 of the buffer */
+
+/*
+ * Impairment scripts.  A script line either gives the probability that
+ * every packet of a kind is dropped, corrupted, swapped with the next
+ * packet or delayed:
+ *
+ *     drop ack 20%              (both directions)
+ *     corrupt out ack 50%       ("in" is what the receiver reads)
+ *     delay in data 10% 300     (by 300 ms)
+ *
+ * or picks out the nth packet of a kind:
+ *
+ *     in syn 1 drop
+ *     out syn 1 delay 300
+ *
+ * and "consume 70%" is the probability that the application is slow to
+ * take delivered data, which holds the receive window shut meanwhile.
+ * "//" starts a comment.
+ */
+enum { PKT_ACK, PKT_DATA, PKT_FIN, PKT_SYN, PKT_KINDS };
+enum { DIR_IN, DIR_OUT, DIRS };
+enum { ACT_CORRUPT, ACT_DELAY, ACT_DROP, ACT_SWAP, ACTS };
+
+static const char *kindNames[PKT_KINDS] = { "ACK", "DATA", "FIN", "SYN" };
+static const char *dirNames[DIRS] = { "IN", "OUT" };
+static const char *actNames[ACTS] = { "corrupt", "delay", "drop", "swap" };
+
+typedef struct script_rule {
+    int dir;
+    int kind;
+    unsigned int nth;           /* counting from 1 */
+    int action;
+    int delay_ms;
+} script_rule;
+
+typedef struct stcp_script {
+    double prob[DIRS][PKT_KINDS][ACTS];
+    int delay_ms[DIRS][PKT_KINDS];
+    double consume;
+    script_rule *rules;
+    int nrules;
+    unsigned int count[DIRS][PKT_KINDS];    /* packets seen so far */
+} stcp_script;
+
+/* A packet held back by a delay or a swap */
+typedef struct held_pkt {
+    struct held_pkt *next;
+    unsigned long due;
+    int dir;
+    int kind;
+    int swapped;                /* goes as soon as the next packet has */
+    int len;
+    unsigned char data[];
+} held_pkt;
+
+/* Out-of-order data held in the receive buffer: [left, right) */
+typedef struct rcv_range {
+    unsigned int left;
+    unsigned int right;
+    unsigned int stamp;         /* when last extended, newest SACKed first */
+} rcv_range;
+
+typedef struct {
+    int fd;
+    int state;
+    unsigned int iss;           /* our sequence number: we send no data */
+    unsigned int irs;           /* the peer's SYN */
+    unsigned int rcv_nxt;       /* next byte expected in order */
+    unsigned int consumed;      /* bytes below this have left the buffer */
+    int wscale;                 /* shift of the windows we advertise */
+    int peer_options;           /* the SYN carried options */
+    int sack_ok;
+    unsigned int mss;           /* the MSS we advertise */
+
+    /*
+     * Receive buffer.  Every byte of the window has a fixed place,
+     * sequence number modulo the (power of two) size, so a segment is
+     * copied straight to where it belongs, in order or not, and filling
+     * a hole makes everything after it deliverable without moving a byte.
+     * The ranges list what has arrived beyond rcv_nxt, in sequence order;
+     * they are the SACK scoreboard too.
+     */
+    unsigned char *buf;
+    unsigned int size;
+    unsigned int mask;
+    unsigned int window;        /* most ever advertised: the buffer, or what the socket holds */
+    rcv_range ranges[STCP_MAX_RANGES];
+    int nranges;
+    unsigned int stamp;
+
+    /* Where delivered data goes: OutputFile, at out_off.  A striped
+     * stream starts with a stripe header that places it in the file. */
+    int out;
+    unsigned long long out_off;
+    int striped;                /* 1 waiting for the stripe header, 2 placed */
+    unsigned int writes;        /* write system calls made */
+    stcp_stripe stripe;
+
+    stcp_loop loop;
+    stcp_event sock;
+    stcp_event idle_timer;
+    stcp_event held_timer;
+    stcp_event consume_timer;
+    stcp_event close_timer;
+    stcp_event ack_timer;
+    stcp_rxbatch rx;
+    stcp_txq txq;
+    unsigned char acks[STCP_BATCH][sizeof(tcpheader) + TCP_MAX_OPTLEN];
+    int ack_next;               /* the next of acks to build in, see ackBuffer() */
+    unsigned char synack[sizeof(tcpheader) + TCP_MAX_OPTLEN];
+    int synack_len;
+
+    stcp_script script;
+    held_pkt *held;             /* by due time */
+    unsigned long last_heard;
+    int idle_periods;
+    int fins;
+    int delack;                 /* ms an in-order ACK may wait, 0 to ACK every segment */
+    int unacked;                /* in-order segments not acknowledged yet */
+    int segments;               /* in-order segments so far, up to STCP_QUICKACK */
+    unsigned int rcv_mss;       /* largest payload seen, the peer's full segment */
+    int failed;
+} stcp_recv_ctrl_blk;
+
+unsigned long get_current_time() {
+    struct timeval tv;
+    gettimeofday(&tv, NULL);
+    return tv.tv_sec * 1000000UL + tv.tv_usec;
+}
+
+static const char *stateName(int state) {
+    switch (state) {
+    case STCP_RECEIVER_LISTEN:      return "listen";
+    case STCP_RECEIVER_ESTABLISHED: return "established";
+    case STCP_RECEIVER_TIME_WAIT:   return "time_wait";
+    case STCP_RECEIVER_CLOSED:      return "closed";
+    }
+    return "bogus state";
+}
+
+static int lookup(const char *word, const char **names, int count) {
+    for (int i = 0; i < count; i++)
+        if (strcasecmp(word, names[i]) == 0)
+            return i;
+    return -1;
+}
+
+/* A "20%" style probability, or -1 */
+static double percent(const char *word) {
+    char *end;
+    double p = strtod(word, &end);
+    return end != word && strcmp(end, "%") == 0 && p >= 0 && p <= 100 ? p / 100 : -1;
+}
+
+/*
+ * Read the script in "filename" into s (see stcp_script above).  Returns
+ * -1 if it cannot be read or has a syntax error.
+ */
+static int scriptLoad(stcp_script *s, const char *filename) {
+    char line[256];
+    FILE *f = fopen(filename, "r");
+    if (f == NULL) {
+        logLog(LOG_ERROR, "Can't open script file %s", filename);
+        return -1;
+    }
+
+    while (fgets(line, sizeof(line), f) != NULL) {
+        char *comment = strstr(line, "//");
+        if (comment != NULL)
+            *comment = '\0';
+        char *w[6];
+        int n = 0;
+        for (char *tok = strtok(line, " \t\r\n"); tok != NULL && n < 6; tok = strtok(NULL, " \t\r\n"))
+            w[n++] = tok;
+        if (n == 0)
+            continue;
+
+        int i = 0, dir = -1, kind, action;
+        if (strcasecmp(w[0], "consume") == 0) {
+            if (n != 2 || (s->consume = percent(w[1])) < 0)
+                goto syntax;
+            continue;
+        }
+        if ((action = lookup(w[0], actNames, ACTS)) >= 0) {
+            /* action [in|out] kind N% [ms] */
+            i = 1;
+            if (i < n && (dir = lookup(w[i], dirNames, DIRS)) >= 0)
+                i++;
+            if (i + 1 >= n || (kind = lookup(w[i], kindNames, PKT_KINDS)) < 0)
+                goto syntax;
+            double p = percent(w[i + 1]);
+            int ms = i + 2 < n ? atoi(w[i + 2]) : 0;
+            if (p < 0 || i + 2 + (action == ACT_DELAY) != n)
+                goto syntax;
+            for (int d = 0; d < DIRS; d++) {
+                if (dir < 0 || dir == d) {
+                    s->prob[d][kind][action] = p;
+                    if (action == ACT_DELAY)
+                        s->delay_ms[d][kind] = ms;
+                }
+            }
+        } else {
+            /* [in|out] kind nth action [ms] */
+            if ((dir = lookup(w[0], dirNames, DIRS)) >= 0)
+                i = 1;
+            if (i + 2 >= n || (kind = lookup(w[i], kindNames, PKT_KINDS)) < 0 ||
+                atoi(w[i + 1]) <= 0 || (action = lookup(w[i + 2], actNames, ACTS)) < 0 ||
+                i + 3 + (action == ACT_DELAY) != n)
+                goto syntax;
+            for (int d = 0; d < DIRS; d++) {
+                if (dir >= 0 && dir != d)
+                    continue;
+                script_rule *rules = realloc(s->rules, (s->nrules + 1) * sizeof(script_rule));
+                if (rules == NULL) {
+                    logPerror("malloc");
+                    fclose(f);
+                    return -1;
+                }
+                s->rules = rules;
+                s->rules[s->nrules++] = (script_rule){ d, kind, atoi(w[i + 1]), action,
+                                                       action == ACT_DELAY ? atoi(w[i + 3]) : 0 };
+            }
+        }
+        continue;
+    syntax:
+        logLog(LOG_ERROR, "Syntax error: near %s", w[0]);
+        fclose(f);
+        return -1;
+    }
+    fclose(f);
+
+    for (int d = 0; d < DIRS; d++)
+        for (int k = 0; k < PKT_KINDS; k++)
+            for (int a = 0; a < ACTS; a++)
+                if (s->prob[d][k][a] > 0)
+                    logLog(LOG_INIT, "Probability of %s %s %s = %g", dirNames[d], kindNames[k], actNames[a], s->prob[d][k][a]);
+    if (s->consume > 0)
+        logLog(LOG_INIT, "Probability of slow consume = %g", s->consume);
+    return 0;
+}
+
+static int chance(double p) {
+    return p > 0 && rand() < p * ((double)RAND_MAX + 1);
+}
+
+/* The kind of a segment on the wire, for the script */
+static int packetKind(unsigned char *seg, int len) {
+    tcpheader *hdr = (tcpheader *)seg;
+    if (len < (int)sizeof(tcpheader))
+        return PKT_DATA;
+    if (hdr->flags & SYN)
+        return PKT_SYN;
+    if (hdr->flags & FIN)
+        return PKT_FIN;
+    return len > tcpHdrLen(hdr) ? PKT_DATA : PKT_ACK;
+}
+
+/* What the script does to the next packet of a kind: an ACT_ value, or -1 */
+static int scriptAction(stcp_script *s, int dir, int kind, int *delay_ms) {
+    unsigned int nth = ++s->count[dir][kind];
+    for (int i = 0; i < s->nrules; i++) {
+        script_rule *rule = &s->rules[i];
+        if (rule->dir == dir && rule->kind == kind && rule->nth == nth) {
+            *delay_ms = rule->delay_ms;
+            return rule->action;
+        }
+    }
+    /* The draws are independent; a dropped packet is not corrupted too */
+    if (chance(s->prob[dir][kind][ACT_DROP]))
+        return ACT_DROP;
+    if (chance(s->prob[dir][kind][ACT_CORRUPT]))
+        return ACT_CORRUPT;
+    if (chance(s->prob[dir][kind][ACT_SWAP]))
+        return ACT_SWAP;
+    if (chance(s->prob[dir][kind][ACT_DELAY])) {
+        *delay_ms = s->delay_ms[dir][kind];
+        return ACT_DELAY;
+    }
+    return -1;
+}
+
+/* Flip one bit of a random byte */
+static void corrupt(unsigned char *seg, int len, const char *what, int kind) {
+    int byte = rand() % len;
+    unsigned char old = seg[byte];
+    seg[byte] ^= 1 << (rand() % 8);
+    logLog(LOG_EVENT, "%s %s corrupted: byte %d from %02x to %02x", what, kindNames[kind], byte, old, seg[byte]);
+}
+
+static unsigned int wireSeq(unsigned char *seg) {
+    return ntohl(((tcpheader *)seg)->seqNo);
+}
+
+static unsigned int wireAck(unsigned char *seg) {
+    return ntohl(((tcpheader *)seg)->ackNo);
+}
+
+/* Hold a copy of a packet until "due", keeping the list in due order */
+static void hold(stcp_recv_ctrl_blk *r, unsigned char *seg, int len, int dir, int kind, int swapped, unsigned long due) {
+    held_pkt *pkt = malloc(sizeof(held_pkt) + len);
+    if (pkt == NULL) {
+        logPerror("malloc");
+        return;
+    }
+    memcpy(pkt->data, seg, len);
+    pkt->len = len;
+    pkt->dir = dir;
+    pkt->kind = kind;
+    pkt->swapped = swapped;
+    pkt->due = due;
+    held_pkt **p = &r->held;
+    while (*p != NULL && (*p)->due <= due)
+        p = &(*p)->next;
+    pkt->next = *p;
+    *p = pkt;
+    loopTimerSet(&r->loop, &r->held_timer, r->held->due);
+}
+
+static void handleSegment(stcp_recv_ctrl_blk *r, unsigned char *seg, int len);
+static void transmit(stcp_recv_ctrl_blk *r, unsigned char *seg, int len);
+
+/* Pass on a held packet, as if it had only now arrived or been sent */
+static void release(stcp_recv_ctrl_blk *r, held_pkt *pkt) {
+    if (pkt->dir == DIR_IN) {
+        logLog(LOG_EVENT, "Receiving %s %s", pkt->swapped ? "swapped" : "delayed", kindNames[pkt->kind]);
+        handleSegment(r, pkt->data, pkt->len);
+    } else {
+        logLog(LOG_EVENT, "Sending %s %s", pkt->swapped ? "swapped" : "delayed", kindNames[pkt->kind]);
+        txqFlush(&r->txq);
+        if (send(r->fd, pkt->data, pkt->len, 0) < 0)
+            logPerror("send");
+    }
+    free(pkt);
+}
+
+/* Release the packets swapped with the one that just went by in dir */
+static void releaseSwapped(stcp_recv_ctrl_blk *r, int dir) {
+    held_pkt *ready = NULL, **tail = &ready;
+    held_pkt **p = &r->held;
+
+    /* Take them off the list first: passing them on can hold others */
+    while (*p != NULL) {
+        held_pkt *pkt = *p;
+        if (pkt->swapped && pkt->dir == dir) {
+            *p = pkt->next;
+            pkt->next = NULL;
+            *tail = pkt;
+            tail = &pkt->next;
+        } else {
+            p = &pkt->next;
+        }
+    }
+    while (ready != NULL) {
+        held_pkt *pkt = ready;
+        ready = pkt->next;
+        release(r, pkt);
+    }
+}
+
+static void heldDue(stcp_event *ev) {
+    stcp_recv_ctrl_blk *r = ev->arg;
+    unsigned long now = get_current_time();
+    while (r->held != NULL && r->held->due <= now) {
+        held_pkt *pkt = r->held;
+        r->held = pkt->next;
+        release(r, pkt);
+    }
+    if (r->held != NULL)
+        loopTimerSet(&r->loop, &r->held_timer, r->held->due);
+    txqPost(&r->txq);
+}
+
+/*
+ * Apply the script to a packet going in direction dir.  Returns 1 if it
+ * should go on now (possibly corrupted), 0 if it was dropped or held.
+ */
+static int impair(stcp_recv_ctrl_blk *r, unsigned char *seg, int len, int dir) {
+    const char *what = dir == DIR_IN ? "received" : "sent";
+    int kind = packetKind(seg, len);
+    int delay_ms = 0;
+
+    switch (scriptAction(&r->script, dir, kind, &delay_ms)) {
+    case ACT_DROP:
+        logLog(LOG_EVENT, dir == DIR_IN ? "Dropping received %s seq %u ack %u" : "Dropped transmitted %s seq %u ack %u",
+               kindNames[kind], wireSeq(seg), wireAck(seg));
+        return 0;
+    case ACT_CORRUPT:
+        corrupt(seg, len, what, kind);
+        return 1;
+    case ACT_SWAP:
+        logLog(LOG_EVENT, "Swapping %s %s seq %u ack %u", what, kindNames[kind], wireSeq(seg), wireAck(seg));
+        hold(r, seg, len, dir, kind, 1, get_current_time() + STCP_SWAP_HOLD * 1000UL);
+        return 0;
+    case ACT_DELAY:
+        logLog(LOG_EVENT, "Delaying %s %s seq %u ack %u for %d.%03ds", what, kindNames[kind],
+               wireSeq(seg), wireAck(seg), delay_ms / 1000, delay_ms % 1000);
+        hold(r, seg, len, dir, kind, 0, get_current_time() + delay_ms * 1000UL);
+        return 0;
+    }
+    return 1;
+}
+
+/* Send a segment built in buf (not yet queued), through the script */
+static void transmit(stcp_recv_ctrl_blk *r, unsigned char *seg, int len) {
+    dumpWire('s', seg, len);
+    if (!impair(r, seg, len, DIR_OUT))
+        return;
+    if (txqQueue(&r->txq, seg, len) < 0 && errno == ECONNREFUSED)
+        logPerror("send");
+    releaseSwapped(r, DIR_OUT);
+}
+
+/*
+ * The window to advertise, unscaled: the free part of the buffer, less
+ * whatever of it the socket could not queue (see sockWindow()).
+ */
+static unsigned int freeSpace(stcp_recv_ctrl_blk *r) {
+    unsigned int used = minus32(r->rcv_nxt, r->consumed);
+    return used < r->window ? r->window - used : 0;
+}
+
+static unsigned short advertisedWindow(stcp_recv_ctrl_blk *r) {
+    unsigned int window = freeSpace(r) >> r->wscale;
+    return window > STCP_MAXWIN ? STCP_MAXWIN : window;
+}
+
+/*
+ * A buffer to build the next ACK or SYN-ACK in.  The buffers are used in
+ * turn rather than by the queue's count: with io_uring txqPost() empties
+ * the queue but only prepares the sends, and they read the buffers when
+ * the next wait submits them, so a buffer is not free again just because
+ * the queue is.  Everything is flushed before the turn comes round.
+ */
+static unsigned char *ackBuffer(stcp_recv_ctrl_blk *r) {
+    if (r->ack_next == STCP_BATCH) {
+        txqFlush(&r->txq);
+        r->ack_next = 0;
+    }
+    return r->acks[r->ack_next++];
+}
+
+/*
+ * Send an ACK for everything received in order, with SACK blocks for the
+ * ranges held beyond it, most recently extended first (RFC 2018), and
+ * the FIN flag once the peer's FIN is in.  A probe_ack other than zero
+ * acknowledges a path MTU probe of that size instead.
+ */
+static void sendAck(stcp_recv_ctrl_blk *r, unsigned short probe_ack) {
+    tcpoptions opts;
+    memset(&opts, 0, sizeof(opts));
+    opts.probe_ack = probe_ack;
+    if (r->sack_ok && probe_ack == 0) {
+        unsigned int last = ~0u;
+        while (opts.nsack < min(TCP_MAX_SACK, r->nranges)) {
+            int newest = -1;
+            for (int i = 0; i < r->nranges; i++)
+                if (r->ranges[i].stamp < last && (newest < 0 || r->ranges[i].stamp > r->ranges[newest].stamp))
+                    newest = i;
+            opts.sack[opts.nsack][0] = r->ranges[newest].left;
+            opts.sack[opts.nsack][1] = r->ranges[newest].right;
+            opts.nsack++;
+            last = r->ranges[newest].stamp;
+        }
+    }
+
+    if (probe_ack == 0) {
+        /* This acknowledges everything, including what was being delayed */
+        r->unacked = 0;
+        loopTimerCancel(&r->loop, &r->ack_timer);
+    }
+    unsigned char *ack = ackBuffer(r);
+    int flags = ACK | (r->state == STCP_RECEIVER_TIME_WAIT ? FIN : 0);
+    int len = buildSegment(ack, flags, advertisedWindow(r), plus32(r->iss, 1), r->rcv_nxt,
+                           r->peer_options ? &opts : NULL, NULL, 0);
+    transmit(r, ack, len);
+}
+
+/*
+ * Send the SYN-ACK from a copy, since the script may corrupt what it
+ * sends and the original is kept for retransmission.
+ */
+static void sendSynAck(stcp_recv_ctrl_blk *r) {
+    unsigned char *synack = ackBuffer(r);
+    memcpy(synack, r->synack, r->synack_len);
+    transmit(r, synack, r->synack_len);
+}
+
+static void ackDue(stcp_event *ev) {
+    stcp_recv_ctrl_blk *r = ev->arg;
+    logLog(LOG_EVENT, "Delayed ACK for %u segments", r->unacked);
+    sendAck(r, 0);
+    txqPost(&r->txq);
+}
+
+/* Copy len bytes at seq out of the receive buffer */
+static void bufCopyOut(stcp_recv_ctrl_blk *r, unsigned int seq, unsigned char *dst, unsigned int len) {
+    unsigned int pos = seq & r->mask;
+    unsigned int first = len < r->size - pos ? len : r->size - pos;
+    memcpy(dst, r->buf + pos, first);
+    memcpy(dst + first, r->buf, len - first);
+}
+
+static void bufCopyIn(stcp_recv_ctrl_blk *r, unsigned int seq, const unsigned char *src, unsigned int len) {
+    unsigned int pos = seq & r->mask;
+    unsigned int first = len < r->size - pos ? len : r->size - pos;
+    memcpy(r->buf + pos, src, first);
+    memcpy(r->buf, src + first, len - first);
+}
+
+/*
+ * Write the len bytes of the buffer from seq on to the output file at
+ * off, both parts in one pwritev() when they wrap around the end of the
+ * buffer.  Returns -1 on error.
+ */
+static int writeOut(stcp_recv_ctrl_blk *r, unsigned int seq, unsigned int len, unsigned long long off) {
+    unsigned int pos = seq & r->mask;
+    unsigned int first = len < r->size - pos ? len : r->size - pos;
+    struct iovec iov[2] = { { r->buf + pos, first }, { r->buf, len - first } };
+    struct iovec *v = iov;
+    int cnt = len > first ? 2 : 1;
+
+    while (len > 0) {
+        ssize_t n = pwritev(r->out, v, cnt, off);
+        if (n < 0) {
+            if (errno == EINTR)
+                continue;
+            logPerror("OutputFile");
+            return -1;
+        }
+        r->writes++;
+        len -= n;
+        off += n;
+        while (cnt > 0 && (size_t)n >= v->iov_len) {
+            n -= v->iov_len;
+            v++;
+            cnt--;
+        }
+        if (cnt > 0) {
+            v->iov_base = (char *)v->iov_base + n;
+            v->iov_len -= n;
+        }
+    }
+    return 0;
+}
+
+/*
+ * Give the output file its final size up front, with real blocks where
+ * the file system allows, so that the stripes' writes neither extend it
+ * piecemeal nor fragment it.  The file is opened without O_TRUNC for the
+ * other stripes' sake, and fallocate never shrinks it, so what is left of
+ * a larger old file is cut off first.  Cutting to the final size never
+ * loses what another stripe has written.
+ */
+static void preallocate(stcp_recv_ctrl_blk *r, unsigned long long size) {
+    struct stat st;
+    if (fstat(r->out, &st) < 0 || (unsigned long long)st.st_size == size)
+        return;                 /* another stripe got here first */
+    if (ftruncate(r->out, size) < 0) {
+        logPerror("ftruncate");
+        return;
+    }
+    posix_fallocate(r->out, 0, size);      /* only an optimization */
+}
+
+/*
+ * The application takes everything delivered so far out of the buffer:
+ * write it to the file where it belongs, first taking the stripe header
+ * off a striped stream.
+ */
+static void consume(stcp_recv_ctrl_blk *r) {
+    unsigned int avail = minus32(r->rcv_nxt, r->consumed);
+    unsigned int opened = freeSpace(r) < r->mss;
+
+    if (r->striped == 1) {
+        unsigned char hdr[STCP_STRIPE_HDRLEN];
+        if (avail < STCP_STRIPE_HDRLEN && r->state == STCP_RECEIVER_ESTABLISHED)
+            return;             /* the rest of the header is on its way */
+        bufCopyOut(r, r->consumed, hdr, avail < sizeof(hdr) ? avail : sizeof(hdr));
+        if (stripeDecode(hdr, avail, &r->stripe) < 0) {
+            logLog(LOG_ERROR, "No stripe header, writing the stream from the start of the file");
+            r->striped = 0;
+        } else {
+            logLog(LOG_INIT, "Stripe %u of %u: %llu bytes at offset %llu", r->stripe.index, r->stripe.count,
+                   r->stripe.length, r->stripe.offset);
+            r->striped = 2;
+            r->out_off = r->stripe.offset;
+            r->consumed = plus32(r->consumed, STCP_STRIPE_HDRLEN);
+            avail -= STCP_STRIPE_HDRLEN;
+            preallocate(r, r->stripe.file_size);
+        }
+    }
+
+    if (avail == 0)
+        return;
+    logLog(LOG_EVENT, "Consume: %u bytes", avail);
+    if (writeOut(r, r->consumed, avail, r->out_off) < 0)
+        r->failed = 1;
+    r->out_off += avail;
+    r->consumed = plus32(r->consumed, avail);
+
+    /* Tell the peer as soon as a shut window opens again */
+    if (opened && r->state == STCP_RECEIVER_ESTABLISHED) {
+        logLog(LOG_EVENT, "rwnd adjusted: (%u)", freeSpace(r));
+        sendAck(r, 0);
+    }
+}
+
+static void consumeDue(stcp_event *ev) {
+    stcp_recv_ctrl_blk *r = ev->arg;
+    consume(r);
+    txqPost(&r->txq);
+}
+
+/*
+ * New data was delivered in order.  It is left to collect in the buffer
+ * until it fills a 1/STCP_WRITE_SHARE share, so that the file is written
+ * in a few large pieces however small the segments are; the rest goes
+ * when the FIN arrives.  Then, unless a consume delay is already pending,
+ * the application takes it now or, as the script decides, only after a
+ * while.
+ */
+static void delivered(stcp_recv_ctrl_blk *r) {
+    if (eventArmed(&r->consume_timer) || minus32(r->rcv_nxt, r->consumed) < r->size / STCP_WRITE_SHARE)
+        return;
+    if (chance(r->script.consume)) {
+        int ms = 100 + rand() % 400;
+        logLog(LOG_EVENT, "Delayed consuming %u bytes for %d ms", minus32(r->rcv_nxt, r->consumed), ms);
+        loopTimerSet(&r->loop, &r->consume_timer, get_current_time() + ms * 1000UL);
+    } else {
+        consume(r);
+    }
+}
+
+/* Note [left, right) as held beyond rcv_nxt, merging it with its neighbours */
+static void rangeAdd(stcp_recv_ctrl_blk *r, unsigned int left, unsigned int right) {
+    int i = 0;
+    while (i < r->nranges && greater32(left, r->ranges[i].right))
+        i++;
+    int j = i;
+    while (j < r->nranges && !greater32(r->ranges[j].left, right)) {
+        if (greater32(left, r->ranges[j].left))
+            left = r->ranges[j].left;
+        if (greater32(r->ranges[j].right, right))
+            right = r->ranges[j].right;
+        j++;
+    }
+    if (i == j && r->nranges == STCP_MAX_RANGES)
+        return;                 /* too scattered: the data will be resent */
+    memmove(&r->ranges[i + 1], &r->ranges[j], (r->nranges - j) * sizeof(rcv_range));
+    r->nranges += i + 1 - j;
+    r->ranges[i] = (rcv_range){ left, right, ++r->stamp };
+}
+
+/*
+ * Take the len byte payload of a segment starting at seq into the buffer.
+ * Whatever falls outside the window is trimmed off.  Returns 1 if it
+ * filled the start of the window, so that new data was delivered.
+ */
+static int receiveData(stcp_recv_ctrl_blk *r, unsigned int seq, unsigned char *data, unsigned int len) {
+    unsigned int end = plus32(seq, len);
+    unsigned int limit = plus32(r->consumed, r->size);
+
+    if (!greater32(end, r->rcv_nxt)) {
+        logLog(LOG_EVENT, "Duplicate data packet %u", seq);
+        return 0;
+    }
+    if (greater32(r->rcv_nxt, seq)) {
+        data += minus32(r->rcv_nxt, seq);
+        seq = r->rcv_nxt;
+    }
+    if (greater32(end, limit))
+        end = limit;
+    if (!greater32(end, seq)) {
+        logLog(LOG_ERROR, "Packet seqno too large to fit in receive window - ignored.");
+        return 0;
+    }
+    bufCopyIn(r, seq, data, minus32(end, seq));
+
+    if (seq != r->rcv_nxt) {
+        rangeAdd(r, seq, end);
+        return 0;
+    }
+    r->rcv_nxt = end;
+    int merged = 0;
+    while (merged < r->nranges && !greater32(r->ranges[merged].left, r->rcv_nxt)) {
+        if (greater32(r->ranges[merged].right, r->rcv_nxt)) {
+            logLog(LOG_EVENT, "Delivering buffered data %u-%u to application", r->rcv_nxt, r->ranges[merged].right - 1);
+            r->rcv_nxt = r->ranges[merged].right;
+        }
+        merged++;
+    }
+    memmove(r->ranges, r->ranges + merged, (r->nranges - merged) * sizeof(rcv_range));
+    r->nranges -= merged;
+    return 1;
+}
+
+/*
+ * Answer a SYN: take the peer's options, size our window scale to the
+ * buffer and send the SYN-ACK, which is kept to be sent again should the
+ * SYN be retransmitted.
+ */
+static void acceptSyn(stcp_recv_ctrl_blk *r, unsigned char *seg, int len) {
+    tcpheader *hdr = (tcpheader *)seg;
+    tcpoptions peer, opts;
+
+    r->irs = hdr->seqNo;
+    r->rcv_nxt = r->consumed = plus32(r->irs, 1);
+    r->peer_options = tcpParseOptions(seg, len, &peer) > 0;
+    memset(&opts, 0, sizeof(opts));
+    if (r->peer_options) {
+        opts.mss = r->mss;
+        r->sack_ok = opts.sack_permitted = peer.sack_permitted;
+        if (peer.has_wscale) {
+            while (r->wscale < TCP_MAX_WSCALE && (r->window >> r->wscale) > STCP_MAXWIN)
+                r->wscale++;
+            opts.has_wscale = 1;
+            opts.wscale = r->wscale;
+        }
+    }
+
+    /* The window in a SYN-ACK is never scaled */
+    unsigned int window = freeSpace(r) > STCP_MAXWIN ? STCP_MAXWIN : freeSpace(r);
+    r->synack_len = buildSegment(r->synack, SYN | ACK, window, r->iss, r->rcv_nxt,
+                                 r->peer_options ? &opts : NULL, NULL, 0);
+    r->state = STCP_RECEIVER_ESTABLISHED;
+    logLog(LOG_INIT, "Connection established, window %u (scale %d), MSS %u, SACK %s",
+           freeSpace(r), r->wscale, r->peer_options ? r->mss : STCP_MSS, r->sack_ok ? "on" : "off");
+    sendSynAck(r);
+}
+
+/*
+ * Handle a segment that got through the script: check it, then act on it
+ * for the state the connection is in.
+ */
+static void handleSegment(stcp_recv_ctrl_blk *r, unsigned char *seg, int len) {
+    unsigned short check = ipchecksum(seg, len);
+    if (len < (int)sizeof(tcpheader) || check != 0) {
+        logLog(LOG_ERROR, "Checksum %04x isn't 0. Ignoring packet.", check);
+        return;
+    }
+    r->last_heard = get_current_time();
+    r->idle_periods = 0;
+
+    tcpheader *hdr = (tcpheader *)seg;
+    ntohHdr(hdr);
+    int hdrlen = tcpHdrLen(hdr);
+    if (hdrlen > len)
+        return;
+    logLog(LOG_EVENT, "Packet %s arrives in state %s", kindNames[packetKind(seg, len)], stateName(r->state));
+
+    if (getRst(hdr)) {
+        logLog(LOG_ERROR, "Reset received from sender -- closing");
+        r->failed = 1;
+        r->state = STCP_RECEIVER_CLOSED;
+        return;
+    }
+    if (r->state == STCP_RECEIVER_LISTEN) {
+        if (getSyn(hdr))
+            acceptSyn(r, seg, len);
+        else
+            logLog(LOG_ERROR, "Expecting SYN in state LISTEN.");
+        return;
+    }
+    if (getSyn(hdr)) {
+        if (hdr->seqNo == r->irs)
+            sendSynAck(r);     /* our SYN-ACK was lost */
+        else
+            logLog(LOG_ERROR, "Got a weird SYN");
+        return;
+    }
+    if (r->state == STCP_RECEIVER_TIME_WAIT) {
+        if (getFin(hdr)) {
+            logLog(LOG_EVENT, "Got %d fins in time_wait, resending ACK", ++r->fins);
+            sendAck(r, 0);
+        }
+        return;
+    }
+
+    /* A path MTU probe is padding only and takes no sequence space */
+    tcpoptions opts;
+    if (r->peer_options && hdrlen > (int)sizeof(tcpheader) && tcpParseOptions(seg, len, &opts) > 0 && opts.probe) {
+        if (len == (int)sizeof(tcpheader) + opts.probe)
+            sendAck(r, opts.probe);
+        return;
+    }
+
+    int in_order = 0, holes = r->nranges;
+    if (len > hdrlen)
+        in_order = receiveData(r, hdr->seqNo, seg + hdrlen, len - hdrlen);
+    if (getFin(hdr)) {
+        unsigned int fin_seq = plus32(hdr->seqNo, len - hdrlen);
+        if (fin_seq == r->rcv_nxt) {
+            /* The application takes the rest now; the FIN is not data */
+            r->state = STCP_RECEIVER_TIME_WAIT;
+            logLog(LOG_EVENT, "State is now time_wait");
+            loopTimerCancel(&r->loop, &r->consume_timer);
+            consume(r);
+            r->rcv_nxt = plus32(r->rcv_nxt, 1);
+            r->consumed = plus32(r->consumed, 1);
+            loopTimerSet(&r->loop, &r->close_timer, get_current_time() + STCP_TIME_WAIT_DURATION * 1000UL);
+        } else {
+            logLog(LOG_ERROR, "FIN seq not equal to NBE (%u != %u) - ignoring it", fin_seq, r->rcv_nxt);
+        }
+    } else if (in_order) {
+        unsigned int payload = len - hdrlen;
+        int full = payload >= r->rcv_mss;
+        if (payload > r->rcv_mss)
+            r->rcv_mss = payload;
+        delivered(r);
+        /*
+         * A full segment in order with no holes before or after: the ACK
+         * can wait, except at the start, where every ACK lets slow start
+         * open the window.  A short one usually ends what the sender had
+         * to send, so nothing more is coming to carry the ACK.
+         */
+        if (r->segments < STCP_QUICKACK) {
+            r->segments++;
+        } else if (full && holes == 0 && r->delack > 0 && ++r->unacked < STCP_DELACK_SEGS) {
+            if (!eventArmed(&r->ack_timer))
+                loopTimerSet(&r->loop, &r->ack_timer, get_current_time() + r->delack * 1000UL);
+            return;
+        }
+    }
+    sendAck(r, 0);
+}
+
+/*
+ * Socket handler: read everything waiting, a batch at a time, and pass
+ * each packet through the script, then send the ACKs it produced.
+ */
+static void packetReady(stcp_event *ev) {
+    stcp_recv_ctrl_blk *r = ev->arg;
+    stcp_rxbatch *batch = &r->rx;
+    int res;
+
+    while ((res = readBatch(r->fd, batch, 0)) > 0) {
+        for (int i = 0; i < batch->count && r->state != STCP_RECEIVER_CLOSED; i++) {
+            unsigned char *seg = rxData(batch, i);
+            if (impair(r, seg, batch->len[i], DIR_IN)) {
+                handleSegment(r, seg, batch->len[i]);
+                releaseSwapped(r, DIR_IN);
+            }
+        }
+        if (!batch->more || r->state == STCP_RECEIVER_CLOSED)
+            break;
+    }
+    txqPost(&r->txq);
+}
+
+/* Give up if nothing at all has been heard for STCP_IDLE_LIMIT periods */
+static void idleCheck(stcp_event *ev) {
+    stcp_recv_ctrl_blk *r = ev->arg;
+    unsigned long now = get_current_time();
+    unsigned long period = STCP_INFINITE_TIMEOUT * 1000UL;
+
+    if (now - r->last_heard >= period) {
+        logLog(LOG_EVENT, "Timeout state: %s duration %d.%03ds", stateName(r->state),
+               STCP_INFINITE_TIMEOUT / 1000, STCP_INFINITE_TIMEOUT % 1000);
+        r->last_heard = now;
+        if (++r->idle_periods >= STCP_IDLE_LIMIT) {
+            r->failed = 1;
+            r->state = STCP_RECEIVER_CLOSED;
+            return;
+        }
+    }
+    loopTimerSet(&r->loop, &r->idle_timer, r->last_heard + period);
+}
+
+static void timeWaitOver(stcp_event *ev) {
+    stcp_recv_ctrl_blk *r = ev->arg;
+    logLog(LOG_EVENT, "State is now closed");
+    r->state = STCP_RECEIVER_CLOSED;
+}
+
+/*
+ * Open the receiving side: bind localPort, take packets only from
+ * <destination, remotePort> and wait for a SYN.  Returns NULL on error.
+ */
+/*
+ * Size the socket's receive buffer for a window of size bytes, and return
+ * the window it can actually take.  A window is only as good as the
+ * socket queue behind it: what the sender may put in flight arrives in a
+ * burst, and datagrams the queue has no room for are dropped by the
+ * kernel before we ever see them.  The queue is charged for each
+ * datagram's kernel memory, not only its bytes, so it is sized for a
+ * window of the smallest segments, the ones a sender starts with.  The
+ * limit for an unprivileged process is net.core.rmem_max; SO_RCVBUFFORCE
+ * goes past it where we may.  The kernel doubles what is asked for.
+ */
+static unsigned int sockWindow(int fd, unsigned int size) {
+    long per = STCP_MTU + STCP_SKB_OVERHEAD;
+    long want = ((long)size / STCP_MSS + 1) * per;
+    int ask = want / 2 < INT_MAX ? (int)(want / 2) : INT_MAX;
+    int granted = 0;
+    socklen_t len = sizeof(granted);
+
+    if (setsockopt(fd, SOL_SOCKET, SO_RCVBUF, &ask, sizeof(ask)) < 0)
+        logPerror("setsockopt SO_RCVBUF");
+    if (getsockopt(fd, SOL_SOCKET, SO_RCVBUF, &granted, &len) == 0 && granted < want) {
+#ifdef SO_RCVBUFFORCE
+        if (setsockopt(fd, SOL_SOCKET, SO_RCVBUFFORCE, &ask, sizeof(ask)) == 0) {
+            len = sizeof(granted);
+            getsockopt(fd, SOL_SOCKET, SO_RCVBUF, &granted, &len);
+        }
+#endif
+    }
+    long fits = granted / per * (long)STCP_MSS;
+    if (fits >= size)
+        return size;
+    logLog(LOG_INIT, "Socket receive buffer of %d bytes holds a window of %ld of the %u buffered", granted, fits, size);
+    return fits;
+}
+
+stcp_recv_ctrl_blk *stcpListen(char *destination, int localPort, int remotePort) {
+    stcp_recv_ctrl_blk *r = calloc(1, sizeof(stcp_recv_ctrl_blk));
+    if (r == NULL) {
+        logPerror("malloc");
+        return NULL;
+    }
+
+    r->fd = udp_open(destination, remotePort, localPort);
+    if (r->fd < 0) {
+        free(r);
+        return NULL;
+    }
+    r->state = STCP_RECEIVER_LISTEN;
+    r->iss = rand();
+    r->out = -1;
+    int local_mtu = min(STCP_MAX_MTU, max(STCP_MTU, stcpEnvInt("STCP_MAX_MTU", STCP_MAX_MTU)));
+    r->mss = local_mtu - sizeof(tcpheader);
+
+    /* A power of two, so that sequence numbers map straight onto it */
+    unsigned int want = max(stcpEnvInt("STCP_RCVBUF", STCP_RCVBUF), 2 * local_mtu);
+    for (r->size = 65536; r->size < want && r->size < (1u << 30); r->size <<= 1)
+        ;
+    r->mask = r->size - 1;
+    r->buf = malloc(r->size);
+    r->window = sockWindow(r->fd, r->size);
+
+    int offload = udpSetOffload(r->fd, stcpEnvInt("STCP_OFFLOAD", 0) & STCP_OFFLOAD_GRO);
+    if (r->buf == NULL || loopInit(&r->loop) < 0 || rxbatchInit(&r->rx, local_mtu, offload & STCP_OFFLOAD_GRO) < 0) {
+        logPerror("stcpListen");
+        free(r->buf);
+        close(r->fd);
+        free(r);
+        return NULL;
+    }
+    txqInit(&r->txq, r->fd, 0);
+    r->txq.uring = r->loop.uring;
+    eventInit(&r->sock, r->fd, packetReady, r);
+    eventInit(&r->idle_timer, -1, idleCheck, r);
+    eventInit(&r->held_timer, -1, heldDue, r);
+    eventInit(&r->consume_timer, -1, consumeDue, r);
+    eventInit(&r->close_timer, -1, timeWaitOver, r);
+    eventInit(&r->ack_timer, -1, ackDue, r);
+    r->delack = max(0, stcpEnvInt("STCP_DELACK", STCP_DELACK));
+    if (loopAdd(&r->loop, &r->sock) < 0) {
+        loopFree(&r->loop);
+        rxbatchFree(&r->rx);
+        free(r->buf);
+        close(r->fd);
+        free(r);
+        return NULL;
+    }
+    r->last_heard = get_current_time();
+    loopTimerSet(&r->loop, &r->idle_timer, r->last_heard + STCP_INFINITE_TIMEOUT * 1000UL);
+    return r;
+}
+
+/*
+ * Run the connection until the peer has closed it (or gone quiet for too
+ * long).  Returns STCP_SUCCESS if every byte was received and written.
+ */
+int stcpReceive(stcp_recv_ctrl_blk *r) {
+    while (r->state != STCP_RECEIVER_CLOSED) {
+        if (loopRun(&r->loop, STCP_INFINITE_TIMEOUT) < 0) {
+            r->failed = 1;
+            break;
+        }
+    }
+    return r->failed ? STCP_ERROR : STCP_SUCCESS;
+}
+
+void stcpReceiverFree(stcp_recv_ctrl_blk *r) {
+    txqClose(&r->txq);
+    loopRemove(&r->loop, &r->sock);
+    loopFree(&r->loop);
+    while (r->held != NULL) {
+        held_pkt *pkt = r->held;
+        r->held = pkt->next;
+        free(pkt);
+    }
+    free(r->script.rules);
+    rxbatchFree(&r->rx);
+    free(r->buf);
+    close(r->fd);
+    free(r);
+}
+
+/*
+ * Return a port number based on the uid of the caller, the one the sender
+ * sends to when no ports are given.
+ */
+int getDefaultPort() {
+    uid_t uid = getuid();
+    int port = (uid % (32768 - 512) * 2) + 1024;
+    assert(port >= 1024 && port <= 65535 - 1);
+    return port;
+}
+
+/*
+ * receiver [scriptFile]
+ * receiver host [sendResponseToPort [doRecvOnPort [scriptFile [randomSeed]]]]
+ *
+ * With STCP_STRIPES set the stream is expected to start with a stripe
+ * header, and is written to its place in OutputFile, which the other
+ * stripes' receivers share.
+ */
+int main(int argc, char **argv) {
+    char *host = "localhost";
+    char *script = NULL;
+    int remotePort = getDefaultPort() + 1;
+    int localPort = getDefaultPort();
+    int seed = time(NULL);
+
+    logConfig("receiver", "init,event,error,failure,stats");
+    if (argc > 6) {
+        fprintf(stderr, "usage: receiver ReceiveDataFromHost sendResponseToPort doRecvOnPort [scriptFile] [randomSeed]\n");
+        fprintf(stderr, "or   : receiver [scriptFile]\n");
+        exit(1);
+    }
+    if (argc == 2) {
+        script = argv[1];
+    } else {
+        if (argc > 1) host = argv[1];
+        if (argc > 2) remotePort = atoi(argv[2]);
+        if (argc > 3) localPort = atoi(argv[3]);
+        if (argc > 4) script = argv[4];
+        if (argc > 5) seed = atoi(argv[5]);
+    }
+    logLog(LOG_INIT, "Using seed %d", seed);
+    srand(seed);
+
+    stcp_recv_ctrl_blk *r = stcpListen(host, localPort, remotePort);
+    if (r == NULL)
+        exit(1);
+    if (script != NULL && scriptLoad(&r->script, script) < 0)
+        exit(1);
+    logLog(LOG_INIT, "Receiving on port %d from <%s, %d>", localPort, host, remotePort);
+
+    r->striped = stcpEnvInt("STCP_STRIPES", 1) > 1;
+    r->out = open("OutputFile", O_WRONLY | O_CREAT | (r->striped ? 0 : O_TRUNC), 0644);
+    if (r->out < 0) {
+        logLog(LOG_ERROR, "OutputFile could not be created");
+        exit(1);
+    }
+
+    int ok = stcpReceive(r) == STCP_SUCCESS;
+    for (int d = 0; d < DIRS; d++)
+        for (int k = 0; k < PKT_KINDS; k++)
+            logLog(LOG_STATS, "%s %s = %3d", dirNames[d], kindNames[k], r->script.count[d][k]);
+    logLog(LOG_STATS, "Writes = %u", r->writes);
+    if (close(r->out) < 0) {
+        logPerror("OutputFile");
+        ok = 0;
+    }
+    stcpReceiverFree(r);
+    logFlush();
+    printf("File transfer %s.\n", ok ? "completed successfully" : "failed");
+    return ok ? 0 : 1;
+}
@@ -16,18 +16,92 @@
 
 #include <assert.h>
 #include <fcntl.h>
+#include <limits.h>
+#include <pthread.h>
 #include <stdio.h>
 #include <stdlib.h>
 #include <unistd.h>
 #include <sys/types.h>
 #include <sys/uio.h>
 #include <sys/file.h>
+#include <sys/mman.h>
+#include <sys/stat.h>
 
 #include "stcp.h"
+#include "cc.h"
+#include "event.h"
+#include "reader.h"
+#include "stats.h"
 
 #define STCP_SUCCESS 1
 #define STCP_ERROR -1
 
+/*
+ * Retransmission ring.  Every sent-but-unacknowledged segment occupies one
+ * slot of a fixed-capacity ring allocated once the receiver's window is
+ * known.  Segments are appended at the tail and released from the head as
+ * cumulative ACKs arrive, so slot order is sequence order.  The segment
+ * bytes are built in place in one circular arena, each segment contiguous
+ * (wrapping to the start of the arena when the end is too short), so the
+ * segment size can change during the connection; the timing metadata is
+ * kept in its own compact array so that loss recovery never touches
+ * packet data.  The slots double as the SACK scoreboard: each records
+ * whether the peer has selectively acknowledged it and whether it is
+ * considered lost and waiting to be resent, and the ring keeps the byte
+ * totals of both so the amount in flight is known without a scan.
+ *
+ * A segment's payload may instead stay where the application keeps it,
+ * for instance in a mapped file, with only the header in the arena: the
+ * slot then points at the payload, which is sent and resent from there
+ * by gathering the two.  A ring set up that way has no room for payload
+ * in its arena at all.
+ *
+ * Retransmission deadlines live in a queue beside the slots.  Every segment
+ * is timed against the same RTO, so deadlines fall due in the order the
+ * segments were (re)transmitted: appending a (slot, send time) entry on each
+ * transmission keeps the queue sorted by deadline, the earliest at the
+ * front.  Entries are never removed from the middle; one whose segment has
+ * since been acknowledged, resent, SACKed or marked lost is simply dropped
+ * when it reaches the front.  Finding the next deadline therefore touches
+ * only entries that are stale or due, however large the window.
+ */
+typedef struct send_slot {
+    unsigned int seq;
+    unsigned int end;           /* seq + sequence space consumed */
+    int len;                    /* bytes on the wire, header included */
+    int retransmission_count;
+    unsigned long sent_time;    /* microseconds */
+    size_t off;                 /* position of the segment in the arena */
+    const unsigned char *payload; /* outside the arena, or NULL if it follows the header */
+    unsigned char sacked;       /* the peer holds it out of order */
+    unsigned char lost;         /* marked lost and not yet resent */
+} send_slot;
+
+typedef struct rto_timer {
+    unsigned int idx;           /* ring index of the segment */
+    unsigned long sent_time;    /* the transmission being timed */
+} rto_timer;
+
+typedef struct retx_ring {
+    unsigned int window;        /* bytes of payload the ring is sized for */
+    int mapped;                 /* payloads are referenced, the arena holds headers */
+    unsigned char *buf;
+    size_t size;                /* arena bytes */
+    size_t wr;                  /* arena offset of the next segment */
+    send_slot *slots;
+    unsigned int mask;          /* capacity - 1, capacity is a power of two */
+    unsigned int head;          /* oldest outstanding segment */
+    unsigned int tail;          /* next free slot */
+    unsigned int high_sacked;   /* index after the highest SACKed slot */
+    unsigned int sacked_bytes;
+    unsigned int lost_bytes;
+    unsigned long last_retransmit;
+    rto_timer *timers;          /* deadline queue, capacity timer_mask + 1 */
+    unsigned int timer_mask;
+    unsigned int timer_head;
+    unsigned int timer_tail;
+} retx_ring;
+
 typedef struct {
     
     /* YOUR CODE HERE */
@@ -36,126 +110,1273 @@ typedef struct {
     unsigned int isn;
     unsigned int next_seq_num;
     unsigned int last_ack_num;
-    unsigned short window_size;
+    unsigned int rcv_nxt;
+    unsigned int window_size;   /* peer's window in bytes, scaled */
+    int snd_wscale;             /* shift for the peer's windowSize */
+
+    /* The SYN, kept for retransmission until the SYN-ACK arrives */
+    unsigned char syn[sizeof(tcpheader) + TCP_MAX_OPTLEN];
+    int syn_len;
+    unsigned int syn_mss;       /* MSS the SYN advertised */
+    unsigned long syn_sent;
+    int syn_retransmitted;
+
+    /* Retransmission timer state (RFC 6298), times in microseconds */
+    long srtt;
+    long rttvar;
+    int rto;                    /* current timeout in milliseconds */
+    int rto_min;                /* floor for rto, STCP_MIN_RTO overrides */
+
+    /* Congestion control and loss recovery */
+    stcp_cc cc;
+    unsigned int dup_acks;
+    unsigned int rexmit_next;   /* ring index of the next segment to resend */
+    unsigned int loss_end;      /* segments below this index have been judged for loss */
+    int sack_ok;                /* the peer sends SACK blocks */
+
+    /* Sent but unacknowledged segments */
+    retx_ring ring;
+    int zerocopy;               /* stcp_write() data stays put until the close */
+
+    /*
+     * Written but not yet sent.  stcp_write() returns once its data is
+     * here, and segments are cut from it only when they are full sized
+     * (or on the close), so the window stays full across write calls and
+     * their boundaries leave no short segments behind.  The unsent bytes
+     * are copied into sndbuf, or in zero-copy mode referenced where the
+     * application keeps them.
+     */
+    unsigned char *sndbuf;
+    size_t sndbuf_size;
+    const unsigned char *unsent;
+    size_t unsent_len;
+
+    /* Batched I/O: segments waiting for the next flush, received packets */
+    stcp_txq txq;
+    stcp_rxbatch rx;
+
+    /* Event loop, possibly shared with other connections: the socket, the
+     * retransmission (or SYN) timer, and what the socket handler read
+     * during the last loopRun().  wake(owner) is called after every event
+     * so a connection manager knows the connection may make progress. */
+    stcp_loop *loop;
+    int own_loop;               /* the loop belongs to this connection */
+    stcp_event sock;
+    stcp_event rto_timer;
+    int acks_read;
+    int read_error;
+    void (*wake)(void *owner);
+    void *owner;
+
+    /* Pacing of new data, see paceAllow() */
+    int pacing;                 /* STCP_PACE_ mode */
+    double pace_tokens;         /* bytes that may be sent now */
+    unsigned long pace_last;    /* when the bucket was last filled */
+    unsigned long pace_kernel;  /* rate last given to the kernel */
+    stcp_event pace_timer;
+    int pace_woken;             /* the pace timer fired during the last loopRun() */
+
+    /* Segment size and path MTU probing (RFC 8899 style) */
+    int peer_options;           /* the SYN-ACK carried options */
+    unsigned int mss;           /* payload bytes per segment, known to get through */
+    unsigned int probe_hi;      /* largest MSS that might still get through */
+    unsigned int probe_size;    /* MSS being probed, 0 if none */
+    int probe_count;            /* probes of probe_size sent */
+    unsigned long probe_sent;
+    unsigned int probe_seq;     /* next_seq_num when the probe was sent */
+    unsigned char *probe_buf;
+
+    /* Performance counters, see stcpStats() */
+    stcp_stats stats;
 
 } stcp_send_ctrl_blk;
 
-typedef struct packet_node {
-    packet pkt;
-    unsigned int seq;
-    int retransmission_count;
-    unsigned long sent_time;
-    struct packet_node *next;
-} packet_node;
 
-packet_node *outstanding_head = NULL;
 /* ADD ANY EXTRA FUNCTIONS HERE */
 
 unsigned long get_current_time() {
     struct timeval tv;
     gettimeofday(&tv, NULL);
-    return tv.tv_sec * 1000UL + tv.tv_usec / 1000UL;
+    return tv.tv_sec * 1000000UL + tv.tv_usec;
+}
+
+/* Sequence space taken by a segment */
+static inline unsigned int slotBytes(send_slot *slot) {
+    return minus32(slot->end, slot->seq);
+}
+
+/* Bytes of a segment held in the arena */
+static inline unsigned int slotArenaBytes(send_slot *slot) {
+    return slot->payload != NULL ? slot->len - slotBytes(slot) : slot->len;
+}
+
+/*
+ * Size the ring for a window of "window" bytes sent as segments of at least
+ * "mss" bytes: one slot per full segment, plus room for the short segments
+ * pushed out by a close or a zero-copy write that does not follow on from
+ * the last, and the FIN.  No segment will be longer than
+ * max_seg bytes on the wire.  If "mapped" every payload will be kept
+ * outside the ring and the arena only needs room for headers.
+ */
+int ringInit(retx_ring *ring, unsigned int window, unsigned int mss, unsigned int max_seg, int mapped) {
+    unsigned int want = (window + mss - 1) / mss + 4;
+    unsigned int capacity = 1;
+    while (capacity < want)
+        capacity <<= 1;
+
+    /* Payload and headers of a full window, the space lost to a wrap and
+     * a reservation of the largest segment */
+    ring->size = (mapped ? 0 : window) + (size_t)capacity * (sizeof(tcpheader) + TCP_MAX_OPTLEN) + 3 * (size_t)max_seg;
+    ring->buf = malloc(ring->size);
+    ring->slots = calloc(capacity, sizeof(send_slot));
+    ring->timers = malloc(2 * capacity * sizeof(rto_timer));
+    if (ring->buf == NULL || ring->slots == NULL || ring->timers == NULL) {
+        logPerror("malloc");
+        free(ring->buf);
+        free(ring->slots);
+        free(ring->timers);
+        return -1;
+    }
+    ring->timer_mask = 2 * capacity - 1;
+    ring->timer_head = ring->timer_tail = 0;
+    ring->window = window;
+    ring->mapped = mapped;
+    ring->mask = capacity - 1;
+    ring->head = ring->tail = ring->high_sacked = 0;
+    ring->sacked_bytes = ring->lost_bytes = 0;
+    ring->wr = 0;
+    ring->last_retransmit = 0;
+    return 0;
+}
+
+/*
+ * Move the outstanding segments into a new ring sized for "window" bytes,
+ * keeping their ring indices, so the deadline queue carries over as it
+ * is.  Segments queued on a stcp_txq point into the old arena, so the
+ * queue must be flushed first.
+ */
+int ringGrow(retx_ring *ring, unsigned int window, unsigned int mss, unsigned int max_seg) {
+    retx_ring bigger;
+
+    if (ringInit(&bigger, window, mss, max_seg, ring->mapped) < 0)
+        return -1;
+    for (unsigned int idx = ring->head; idx != ring->tail; idx++) {
+        send_slot *slot = &ring->slots[idx & ring->mask];
+        send_slot *copy = &bigger.slots[idx & bigger.mask];
+        *copy = *slot;
+        copy->off = bigger.wr;
+        memcpy(bigger.buf + bigger.wr, ring->buf + slot->off, slotArenaBytes(slot));
+        bigger.wr += slotArenaBytes(slot);
+    }
+    bigger.head = ring->head;
+    bigger.tail = ring->tail;
+    bigger.high_sacked = ring->high_sacked;
+    bigger.sacked_bytes = ring->sacked_bytes;
+    bigger.lost_bytes = ring->lost_bytes;
+    bigger.last_retransmit = ring->last_retransmit;
+    free(bigger.timers);
+    bigger.timers = ring->timers;
+    bigger.timer_mask = ring->timer_mask;
+    bigger.timer_head = ring->timer_head;
+    bigger.timer_tail = ring->timer_tail;
+    free(ring->buf);
+    free(ring->slots);
+    *ring = bigger;
+    return 0;
+}
+
+void ringFree(retx_ring *ring) {
+    free(ring->buf);
+    free(ring->slots);
+    free(ring->timers);
+    ring->buf = NULL;
+    ring->slots = NULL;
+    ring->timers = NULL;
+    ring->head = ring->tail = 0;
+    ring->timer_head = ring->timer_tail = 0;
+}
+
+static inline unsigned int ringCount(retx_ring *ring) {
+    return ring->tail - ring->head;
+}
+
+static inline int ringEmpty(retx_ring *ring) {
+    return ring->buf == NULL || ring->head == ring->tail;
+}
+
+static inline int ringFull(retx_ring *ring) {
+    return ringCount(ring) > ring->mask;
 }
 
-void addOutstanding(packet_node **head, const packet *pkt, unsigned int seq, unsigned long sent_time) {
-    packet_node *new_node = malloc(sizeof(packet_node));
-    if (new_node == NULL) {
-        perror("malloc");
+static inline send_slot *ringSlot(retx_ring *ring, unsigned int idx) {
+    return &ring->slots[idx & ring->mask];
+}
+
+static inline unsigned char *ringData(retx_ring *ring, unsigned int idx) {
+    return ring->buf + ringSlot(ring, idx)->off;
+}
+
+/*
+ * Return the buffer the next segment, of at most "need" bytes, should be
+ * built in, or NULL if every slot is in use or the arena has no room.
+ * The segment only becomes outstanding once ringCommit() is called.
+ */
+unsigned char *ringReserve(retx_ring *ring, size_t need) {
+    if (ringFull(ring))
+        return NULL;
+    if (ringEmpty(ring)) {
+        ring->wr = 0;
+        return need <= ring->size ? ring->buf : NULL;
+    }
+
+    size_t start = ringSlot(ring, ring->head)->off;
+    if (ring->wr > start) {
+        if (ring->size - ring->wr >= need)
+            return ring->buf + ring->wr;
+        if (start < need)
+            return NULL;
+        ring->wr = 0;
+        return ring->buf;
+    }
+    return start - ring->wr >= need ? ring->buf + ring->wr : NULL;
+}
+
+/*
+ * Start timing the transmission of slot idx made at sent_time.  The queue
+ * doubles when full; should that fail the entry is dropped, which only
+ * delays the timeout until a later segment's deadline.
+ */
+void ringTimerArm(retx_ring *ring, unsigned int idx, unsigned long sent_time) {
+    unsigned int count = ring->timer_tail - ring->timer_head;
+    if (count > ring->timer_mask) {
+        rto_timer *timers = malloc(2 * count * sizeof(rto_timer));
+        if (timers == NULL) {
+            logPerror("malloc");
+            return;
+        }
+        for (unsigned int i = 0; i < count; i++)
+            timers[i] = ring->timers[(ring->timer_head + i) & ring->timer_mask];
+        free(ring->timers);
+        ring->timers = timers;
+        ring->timer_mask = 2 * count - 1;
+        ring->timer_head = 0;
+        ring->timer_tail = count;
+    }
+    rto_timer *timer = &ring->timers[ring->timer_tail++ & ring->timer_mask];
+    timer->idx = idx;
+    timer->sent_time = sent_time;
+}
+
+/*
+ * Make the segment built in the buffer ringReserve() returned outstanding:
+ * len bytes on the wire, of which the seqLen byte payload is at "payload"
+ * if that is not NULL, or in the arena after the header.
+ */
+void ringCommit(retx_ring *ring, unsigned int seq, unsigned int seqLen, int len, const unsigned char *payload, unsigned long sent_time) {
+    send_slot *slot = ringSlot(ring, ring->tail);
+    slot->seq = seq;
+    slot->end = plus32(seq, seqLen);
+    slot->len = len;
+    slot->sent_time = sent_time;
+    slot->retransmission_count = 0;
+    slot->sacked = 0;
+    slot->lost = 0;
+    slot->payload = payload;
+    slot->off = ring->wr;
+    ring->wr += slotArenaBytes(slot);
+    ringTimerArm(ring, ring->tail, sent_time);
+    ring->tail++;
+}
+
+/*
+ * Return the ring index of the first outstanding segment that starts at
+ * or after seq (the tail if there is none).  Nearly all segments are full
+ * sized (see stcp_write()), so the slot is normally found
+ * directly from the sequence offset in units of the oldest segment's size;
+ * a binary search over the (ordered) slots covers the remaining cases.
+ */
+unsigned int ringSeek(retx_ring *ring, unsigned int seq) {
+    if (ringEmpty(ring))
+        return ring->tail;
+
+    send_slot *first = ringSlot(ring, ring->head);
+    if (!greater32(seq, first->seq))
+        return ring->head;
+    unsigned int offset = minus32(seq, first->seq);
+    unsigned int guess = ring->head + offset / slotBytes(first);
+    if (guess - ring->head < ringCount(ring) && ringSlot(ring, guess)->seq == seq)
+        return guess;
+
+    unsigned int lo = ring->head, hi = ring->tail;
+    while (lo < hi) {
+        unsigned int mid = lo + (hi - lo) / 2;
+        unsigned int midSeq = ringSlot(ring, mid)->seq;
+        if (midSeq == seq)
+            return mid;
+        if (greater32(seq, midSeq))
+            lo = mid + 1;
+        else
+            hi = mid;
+    }
+    return lo;
+}
+
+/* Return the ring index of the outstanding segment starting at seq, or -1. */
+long ringFind(retx_ring *ring, unsigned int seq) {
+    unsigned int idx = ringSeek(ring, seq);
+    return idx != ring->tail && ringSlot(ring, idx)->seq == seq ? (long)idx : -1;
+}
+
+/*
+ * Release every segment fully covered by the cumulative acknowledgement.
+ * Returns the number of segments released.
+ */
+unsigned int ringRelease(retx_ring *ring, unsigned int ack) {
+    if (ringEmpty(ring))
+        return 0;
+
+    unsigned int oldHead = ring->head;
+    if (ringSlot(ring, ring->tail - 1)->end == ack) {
+        ring->head = ring->tail;
+    } else {
+        long idx = ringFind(ring, ack);
+        if (idx >= 0) {
+            ring->head = idx;
+        } else {
+            while (ring->head != ring->tail && !greater32(ringSlot(ring, ring->head)->end, ack))
+                ring->head++;
+        }
+    }
+
+    /* Take the released segments out of the scoreboard totals */
+    if (ring->sacked_bytes != 0 || ring->lost_bytes != 0) {
+        for (unsigned int idx = oldHead; idx != ring->head; idx++) {
+            send_slot *slot = ringSlot(ring, idx);
+            if (slot->sacked)
+                ring->sacked_bytes -= slotBytes(slot);
+            if (slot->lost)
+                ring->lost_bytes -= slotBytes(slot);
+        }
+    }
+    if ((int)(ring->head - ring->high_sacked) > 0)
+        ring->high_sacked = ring->head;
+    return ring->head - oldHead;
+}
+
+/*
+ * Record a SACK block: every outstanding segment lying entirely within
+ * [left, right) has reached the peer.  Returns the bytes newly SACKed.
+ */
+unsigned int ringSack(retx_ring *ring, unsigned int left, unsigned int right) {
+    unsigned int bytes = 0;
+
+    for (unsigned int idx = ringSeek(ring, left); idx != ring->tail; idx++) {
+        send_slot *slot = ringSlot(ring, idx);
+        if (greater32(slot->end, right))
+            break;
+        if (slot->sacked)
+            continue;
+        if (slot->lost) {
+            slot->lost = 0;
+            ring->lost_bytes -= slotBytes(slot);
+        }
+        slot->sacked = 1;
+        ring->sacked_bytes += slotBytes(slot);
+        bytes += slotBytes(slot);
+        if ((int)(idx + 1 - ring->high_sacked) > 0)
+            ring->high_sacked = idx + 1;
+    }
+    return bytes;
+}
+
+/* Mark slot idx lost unless the peer already has it */
+void ringMarkLost(retx_ring *ring, unsigned int idx) {
+    send_slot *slot = ringSlot(ring, idx);
+    if (!slot->sacked && !slot->lost) {
+        slot->lost = 1;
+        ring->lost_bytes += slotBytes(slot);
+    }
+}
+
+/* Forget every SACK, for when the peer turns out to have discarded data */
+void ringClearSacks(retx_ring *ring) {
+    for (unsigned int idx = ring->head; idx != ring->tail; idx++)
+        ringSlot(ring, idx)->sacked = 0;
+    ring->sacked_bytes = 0;
+    ring->high_sacked = ring->head;
+}
+
+/* Queue the segment in ring slot idx for sending again and restart its timer. */
+void ringRetransmit(retx_ring *ring, unsigned int idx, stcp_txq *txq, unsigned long now) {
+    send_slot *slot = ringSlot(ring, idx);
+    if (slot->payload != NULL)
+        txqQueueParts(txq, ringData(ring, idx), slot->len - slotBytes(slot), slot->payload, slotBytes(slot));
+    else
+        txqQueue(txq, ringData(ring, idx), slot->len);
+    if (slot->lost) {
+        slot->lost = 0;
+        ring->lost_bytes -= slotBytes(slot);
+    }
+    slot->sent_time = now;
+    slot->retransmission_count++;
+    ring->last_retransmit = now;
+    ringTimerArm(ring, idx, now);
+}
+
+/*
+ * Whether a queue entry still times a segment: the segment is outstanding,
+ * has not been sent again since, and is neither marked lost (it is timed
+ * again once resent) nor SACKed.
+ */
+static int ringTimerLive(retx_ring *ring, rto_timer *timer) {
+    if ((int)(timer->idx - ring->head) < 0 || (int)(timer->idx - ring->tail) >= 0)
+        return 0;
+    send_slot *slot = ringSlot(ring, timer->idx);
+    return slot->sent_time == timer->sent_time && !slot->lost && !slot->sacked;
+}
+
+/*
+ * Return the send time of the earliest transmission still being timed, or
+ * 0 if there is none, discarding stale entries on the way.  A SACKed oldest
+ * segment is timed as well: if it expires the peer has reneged.
+ */
+unsigned long ringFirstTimer(retx_ring *ring) {
+    if (ringEmpty(ring)) {
+        ring->timer_head = ring->timer_tail;
+        return 0;
+    }
+    while (ring->timer_head != ring->timer_tail &&
+           !ringTimerLive(ring, &ring->timers[ring->timer_head & ring->timer_mask]))
+        ring->timer_head++;
+
+    unsigned long first = 0;
+    if (ring->timer_head != ring->timer_tail)
+        first = ring->timers[ring->timer_head & ring->timer_mask].sent_time;
+    send_slot *oldest = ringSlot(ring, ring->head);
+    if (oldest->sacked && (first == 0 || oldest->sent_time < first))
+        first = oldest->sent_time;
+    return first;
+}
+
+/*
+ * Set the RTO from the current estimators, discarding any backoff.  Called
+ * for every RTT sample, and also whenever an ACK for new data shows the
+ * path is delivering again: under sustained loss every ACK may cover a
+ * retransmitted segment, and Karn's rule alone would then leave the timer
+ * backed off to STCP_MAX_TIMEOUT indefinitely.
+ */
+void rttRestoreTimeout(stcp_send_ctrl_blk *cb) {
+    if (cb->srtt == 0)
+        return;
+    long rto = cb->srtt + (4 * cb->rttvar > 1000 ? 4 * cb->rttvar : 1000);
+    cb->rto = min(STCP_MAX_TIMEOUT, max(cb->rto_min, (rto + 999) / 1000));
+}
+
+/*
+ * Fold one round-trip measurement (microseconds) into the smoothed
+ * estimators and recompute the retransmission timeout as in RFC 6298.
+ */
+void rttSample(stcp_send_ctrl_blk *cb, long rtt) {
+    if (cb->srtt == 0) {
+        cb->srtt = rtt;
+        cb->rttvar = rtt / 2;
+    } else {
+        long delta = cb->srtt - rtt;
+        if (delta < 0)
+            delta = -delta;
+        cb->rttvar = (3 * cb->rttvar + delta) / 4;
+        cb->srtt = (7 * cb->srtt + rtt) / 8;
+    }
+    rttRestoreTimeout(cb);
+    statsRtt(&cb->stats, rtt);
+}
+
+/*
+ * Bytes the sender considers to be in the network (the "pipe" of RFC
+ * 6675): everything sent and not yet acknowledged, less what the peer has
+ * SACKed and the segments marked lost that have not been resent yet.
+ */
+unsigned int inFlight(stcp_send_ctrl_blk *cb, retx_ring *ring) {
+    return minus32(cb->next_seq_num, cb->last_ack_num) - ring->sacked_bytes - ring->lost_bytes;
+}
+
+/* Retransmit the segment in ring slot idx, counting it */
+static void segmentResend(stcp_send_ctrl_blk *cb, retx_ring *ring, unsigned int idx, unsigned long now) {
+    cb->stats.retransmits++;
+    cb->stats.bytes_retransmitted += slotBytes(ringSlot(ring, idx));
+    ringRetransmit(ring, idx, &cb->txq, now);
+}
+
+/* How many bytes the congestion and receive windows allow in flight. */
+static inline unsigned int sendWindow(stcp_send_ctrl_blk *cb) {
+    return cb->cc.cwnd < cb->window_size ? cb->cc.cwnd : cb->window_size;
+}
+
+/*
+ * SACK based loss detection (RFC 6675): a segment the peer has not SACKed
+ * is lost once at least three segments' worth of data above it has been
+ * SACKed.  Walk down from the highest SACKed segment to find where that
+ * holds and mark the holes below it; everything below loss_end has
+ * already been judged.
+ */
+void sackMarkLost(stcp_send_ctrl_blk *cb, retx_ring *ring) {
+    unsigned int threshold = 3 * cb->mss;
+    unsigned int sacked = 0;
+    unsigned int idx = ring->high_sacked;
+
+    while (sacked < threshold && (int)(idx - cb->loss_end) > 0 && (int)(idx - ring->head) > 0) {
+        send_slot *slot = ringSlot(ring, --idx);
+        if (slot->sacked)
+            sacked += slotBytes(slot);
+    }
+    if (sacked < threshold)
+        return;
+    unsigned int lost = (int)(ring->head - cb->loss_end) > 0 ? ring->head : cb->loss_end;
+    for (; (int)(idx - lost) > 0; lost++)
+        ringMarkLost(ring, lost);
+    cb->loss_end = idx;
+}
+
+/*
+ * Handle a cumulative acknowledgement: release the covered segments, take
+ * an RTT sample from the newest of them and let congestion control react.
+ * Per Karn's rule segments that were retransmitted are never sampled,
+ * since the ACK could belong to any of their transmissions.  Likewise a
+ * segment sent before the most recent retransmission is not sampled: the
+ * receiver may have been holding it until that retransmission filled a
+ * hole.  The third duplicate ACK triggers a fast retransmit and NewReno
+ * fast recovery.  window is the unscaled windowSize of the ACK, and opts
+ * its options if the peer sends SACK blocks (NULL otherwise).  An ACK may
+ * cover any number of segments, as when the peer delays its ACKs; the
+ * release, the RTT sample and congestion control all go by the bytes it
+ * acknowledges, not by the number of ACKs.
+ */
+void processAck(stcp_send_ctrl_blk *cb, retx_ring *ring, unsigned int ack, unsigned short window, tcpoptions *opts) {
+    unsigned long now = get_current_time();
+    unsigned int window_size = (unsigned int)window << cb->snd_wscale;
+    int window_update = window_size != cb->window_size;
+
+    /* Take window updates from any ACK that is not older than the last */
+    if (!greater32(cb->last_ack_num, ack))
+        cb->window_size = window_size;
+
+    cb->stats.acks++;
+    for (int b = 0; opts != NULL && b < opts->nsack; b++)
+        ringSack(ring, opts->sack[b][0], opts->sack[b][1]);
+
+    if (!greater32(ack, cb->last_ack_num)) {
+        /* An ACK that only opens the window is not a duplicate (RFC 5681) */
+        if (ack == cb->last_ack_num && !window_update && !ringEmpty(ring)) {
+            cb->stats.dup_acks++;
+            if (++cb->dup_acks == 3 && !cb->cc.in_recovery) {
+                logLog(LOG_SEGMENT, "Fast retransmission triggered for seq: %u", ack);
+                ccOnCongestion(&cb->cc, inFlight(cb, ring), cb->next_seq_num);
+                cb->stats.fast_retransmits++;
+                segmentResend(cb, ring, ring->head, now);
+                if ((int)(ring->head + 1 - cb->loss_end) > 0)
+                    cb->loss_end = ring->head + 1;
+            } else if (cb->dup_acks >= 3) {
+                ccOnDupAck(&cb->cc);
+            }
+        }
+        if (cb->cc.in_recovery && cb->sack_ok)
+            sackMarkLost(cb, ring);
         return;
     }
-    new_node->pkt = *pkt;
-    new_node->seq = seq;
-    new_node->sent_time = sent_time;
-    new_node->retransmission_count = 0;
-    new_node->next = NULL;
-    
-    if (*head == NULL) {
-        *head = new_node;
+
+    unsigned int acked = minus32(ack, cb->last_ack_num);
+    long rtt = 0;
+    if (ringRelease(ring, ack) > 0) {
+        send_slot *newest = ringSlot(ring, ring->head - 1);
+        if (newest->retransmission_count == 0 && newest->sent_time > ring->last_retransmit) {
+            rtt = now - newest->sent_time;
+            rttSample(cb, rtt);
+        } else {
+            rttRestoreTimeout(cb);
+        }
+    }
+    cb->last_ack_num = ack;
+    cb->dup_acks = 0;
+    cb->stats.bytes_acked += acked;
+    if ((int)(ring->head - cb->rexmit_next) > 0)
+        cb->rexmit_next = ring->head;
+    if ((int)(ring->head - cb->loss_end) > 0)
+        cb->loss_end = ring->head;
+
+    if (!cb->cc.in_recovery) {
+        ccOnAck(&cb->cc, acked, rtt, now);
+    } else if (!greater32(cb->cc.recover, ack)) {
+        ccExitRecovery(&cb->cc);
     } else {
-        packet_node *current = *head;
-        while (current->next != NULL)
-            current = current->next;
-        current->next = new_node;
+        /*
+         * Partial ACK: the next hole is lost too.  With SACK information
+         * the scoreboard says which segments to resend, otherwise resend
+         * the hole right away.
+         */
+        ccOnPartialAck(&cb->cc, acked);
+        if (cb->sack_ok && ring->sacked_bytes != 0)
+            sackMarkLost(cb, ring);
+        else if (!ringEmpty(ring) && !ringSlot(ring, ring->head)->lost)
+            segmentResend(cb, ring, ring->head, now);
+    }
+}
+
+/* Resend segments marked lost while the window has room. */
+void retransmitLost(stcp_send_ctrl_blk *cb, retx_ring *ring) {
+    unsigned long now = get_current_time();
+    while ((int)(cb->loss_end - cb->rexmit_next) > 0) {
+        send_slot *slot = ringSlot(ring, cb->rexmit_next);
+        if (slot->lost) {
+            unsigned int flight = inFlight(cb, ring);
+            if (flight > 0 && flight + slotBytes(slot) > sendWindow(cb))
+                break;
+            logLog(LOG_SEGMENT, "Retransmitting data packet");
+            segmentResend(cb, ring, cb->rexmit_next, now);
+        }
+        cb->rexmit_next++;
+    }
 }
+
+/* When the next retransmission timeout is due, or 0 if nothing is timed */
+unsigned long rtoDeadline(stcp_send_ctrl_blk *cb, retx_ring *ring) {
+    unsigned long first = ringFirstTimer(ring);
+    return first == 0 ? 0 : first + cb->rto * 1000UL;
 }
 
+/*
+ * Check whether the earliest retransmission deadline has passed, that is
+ * whether a segment has been outstanding for longer than the current RTO
+ * since its last transmission.  A timeout collapses the congestion window and marks
+ * everything outstanding that the peer has not SACKed as lost;
+ * retransmitLost() then resends those segments as the window allows rather
+ * than in one burst.  The timeout is backed off until the next ACK for new
+ * data.  Segments already marked lost are not timed, nor are SACKed ones
+ * other than the oldest: if that times out the peer has dropped data it
+ * SACKed, and the scoreboard is cleared.
+ */
+void checkAndRetransmit(stcp_send_ctrl_blk *cb, retx_ring *ring) {
+    if (ringEmpty(ring))
+        return;
+
+    unsigned long first = ringFirstTimer(ring);
+    if (first == 0 || get_current_time() - first < cb->rto * 1000UL)
+        return;
 
-void removeOutstanding(packet_node **head, unsigned int ack) {
-    while (*head != NULL && (*head)->seq < ack) {
-        packet_node *temp = *head;
-        *head = (*head)->next;
-        free(temp);
+    logLog(LOG_SEGMENT, "Retransmission timeout after %d ms, %u segments outstanding", cb->rto, ringCount(ring));
+    ccOnTimeout(&cb->cc, inFlight(cb, ring));
+    cb->stats.timeouts++;
+    cb->rto = stcpNextTimeout(cb->rto);
+    cb->dup_acks = 0;
+    if (ringSlot(ring, ring->head)->sacked) {
+        logLog(LOG_SEGMENT, "Peer discarded SACKed data, clearing the scoreboard");
+        ringClearSacks(ring);
     }
+    for (unsigned int idx = ring->head; idx != ring->tail; idx++)
+        ringMarkLost(ring, idx);
+    cb->rexmit_next = ring->head;
+    cb->loss_end = ring->tail;
+    retransmitLost(cb, ring);
+    txqPost(&cb->txq);
+}
+
+/*
+ * Packetization layer path MTU discovery.  Once the peer has shown it
+ * understands options, padding-only probe segments of a candidate MSS are
+ * sent alongside the data; they occupy no sequence space, so losing one
+ * costs no retransmission and does not count as congestion.  A probe the
+ * peer acknowledges raises the MSS, STCP_PROBE_TRIES lost probes lower the
+ * ceiling, and the search is a binary search between the two that stops
+ * once they are within STCP_PROBE_STEP bytes.  A probe counts as lost after
+ * an RTO, or as soon as data sent after it has been acknowledged.
+ */
+#define STCP_PROBE_TRIES 3
+#define STCP_PROBE_STEP  32
+
+void pmtuProbe(stcp_send_ctrl_blk *cb) {
+    if (cb->probe_buf == NULL)
+        return;
+
+    unsigned long now = get_current_time();
+    if (cb->probe_size != 0) {
+        if (now - cb->probe_sent < cb->rto * 1000UL)
+            return;
+        if (cb->probe_count >= STCP_PROBE_TRIES) {
+            logLog(LOG_INIT, "Path MTU probe for MSS %u lost", cb->probe_size);
+            cb->probe_hi = cb->probe_size - 1;
+            cb->probe_size = 0;
+        }
+    }
+    if (cb->probe_size == 0) {
+        if (cb->probe_hi < cb->mss + STCP_PROBE_STEP)
+            return;
+        cb->probe_size = cb->mss + (cb->probe_hi - cb->mss + 1) / 2;
+        cb->probe_count = 0;
+    }
+
+    logLog(LOG_SEGMENT, "Sending path MTU probe for MSS %u", cb->probe_size);
+    int len = sizeof(tcpheader) + cb->probe_size;
+    if (cb->probe_count == 0) {
+        /* The zero padding adds nothing to the checksum */
+        tcpoptions opts = { .probe = cb->probe_size };
+        int hdrlen = buildSegment(cb->probe_buf, ACK, STCP_MAXWIN, cb->next_seq_num, cb->rcv_nxt, &opts, NULL, 0);
+        memset(cb->probe_buf + hdrlen, 0, len - hdrlen);
+    } else {
+        /* Another try at the same size: only the sequence numbers move */
+        tcpheader *hdr = (tcpheader *)cb->probe_buf;
+        segmentUpdate32(cb->probe_buf, &hdr->seqNo, cb->next_seq_num);
+        segmentUpdate32(cb->probe_buf, &hdr->ackNo, cb->rcv_nxt);
+    }
+    dumpWire('s', cb->probe_buf, len);
+    txqQueue(&cb->txq, cb->probe_buf, len);
+    cb->probe_sent = now;
+    cb->probe_seq = cb->next_seq_num;
+    cb->probe_count++;
+}
+
+/* The peer received a probe for an MSS of "size" bytes */
+void pmtuProbeAcked(stcp_send_ctrl_blk *cb, unsigned int size) {
+    if (cb->probe_size == 0 || size != cb->probe_size)
+        return;
+    cb->mss = size;
+    cb->cc.mss = size;
+    cb->probe_size = 0;
+    logLog(LOG_INIT, "Path MTU probe succeeded, MSS now %u", cb->mss);
+}
+
+int verifyPacketIntegrity(unsigned char *data, int len) {
     
-    packet_node *current = *head;
-    while (current != NULL && current->next != NULL) {
-        if (current->next->seq < ack) {
-            packet_node *temp = current->next;
-            current->next = current->next->next;
-            free(temp);
+    if (len < (int)sizeof(tcpheader))
+        return 0;
+
+    tcpheader *hdr = (tcpheader *)data;
+    unsigned short original_checksum = hdr->checksum;
+
+    hdr->checksum = 0;
+
+    unsigned short calculated_checksum = ipchecksum(data, len);
+
+    hdr->checksum = original_checksum;
+    return (original_checksum == calculated_checksum);
+}
+
+/*
+ * The connection's performance counters, with the snapshot of its window
+ * and RTT estimators brought up to date.  The result stays valid until
+ * the connection is freed; it is only safe to read from the thread that
+ * drives the connection.
+ */
+const stcp_stats *stcpStats(stcp_send_ctrl_blk *cb) {
+    cb->stats.cwnd = cb->cc.cwnd;
+    cb->stats.ssthresh = cb->cc.ssthresh;
+    cb->stats.mss = cb->mss;
+    cb->stats.srtt = cb->srtt;
+    cb->stats.rttvar = cb->rttvar;
+    cb->stats.rto = cb->rto;
+    return &cb->stats;
+}
+
+/*
+ * Publish the counters (STCP_STATS, STCP_STATS_PROM) if a periodic
+ * report is due, or unconditionally when final.  The final report also
+ * goes to the stats log channel.
+ */
+static void statsReport(stcp_send_ctrl_blk *cb, int final) {
+    unsigned long now = get_current_time();
+    if (!final && now < cb->stats.next_report)
+        return;
+    stcpStats(cb);
+    statsPublish(&cb->stats, now, final);
+    if (final && logEnabled(LOG_STATS)) {
+        char line[2048];
+        statsJson(&cb->stats, now, 1, line, sizeof(line));
+        logLog(LOG_STATS, "%s", line);
+    }
+}
+
+/*
+ * Tell whoever drives the connection that it may be able to make
+ * progress.  This follows every event, so it is also where periodic
+ * stats reports are made.
+ */
+static void cbWake(stcp_send_ctrl_blk *cb) {
+    if (cb->stats.next_report != 0)
+        statsReport(cb, 0);
+    if (cb->wake != NULL)
+        cb->wake(cb->owner);
+}
+
+/* Arm the retransmission timer for the next deadline, or disarm it */
+void rtoArm(stcp_send_ctrl_blk *cb) {
+    if (cb->state == STCP_SENDER_SYN_SENT)
+        return;                 /* the timer is timing the SYN */
+    unsigned long deadline = rtoDeadline(cb, &cb->ring);
+    if (deadline != 0)
+        loopTimerSet(cb->loop, &cb->rto_timer, deadline);
+    else
+        loopTimerCancel(cb->loop, &cb->rto_timer);
+}
+
+/*
+ * Handle the SYN-ACK: take the peer's window, sequence number and options,
+ * complete the three-way handshake and size the retransmission ring.
+ * The header is in host byte order.  Returns -1 on failure.
+ */
+int synAckReceived(stcp_send_ctrl_blk *cb, unsigned char *data, int len) {
+    tcpheader *hdr = (tcpheader *)data;
+
+    logLog(LOG_SEGMENT, "Connection Established: Received ACK packet");
+    cb->window_size = hdr->windowSize;
+    cb->last_ack_num = hdr->ackNo;
+    cb->rcv_nxt = hdr->seqNo + 1;
+    tcpoptions peer_opts;
+    cb->peer_options = tcpParseOptions(data, len, &peer_opts) > 0;
+    /* The window in the SYN-ACK itself is never scaled */
+    if (peer_opts.has_wscale)
+        cb->snd_wscale = min(peer_opts.wscale, TCP_MAX_WSCALE);
+    cb->sack_ok = peer_opts.sack_permitted;
+    if (peer_opts.mss) {
+        cb->probe_hi = min(peer_opts.mss, cb->syn_mss);
+        cb->mss = min(cb->mss, cb->probe_hi);
+        cb->cc.mss = cb->mss;
+    } else {
+        /* No MSS from the peer: stay at the default, do not probe */
+        cb->probe_hi = cb->mss;
+    }
+    if (!cb->syn_retransmitted)
+        rttSample(cb, get_current_time() - cb->syn_sent);
+    else
+        cb->rto = STCP_INITIAL_TIMEOUT;
+    loopTimerCancel(cb->loop, &cb->rto_timer);
+
+    //three way handshake
+    unsigned char ack[sizeof(tcpheader)];
+    int ack_len = buildSegment(ack, ACK, STCP_MAXWIN, cb->next_seq_num, cb->rcv_nxt, NULL, NULL, 0);
+    logLog(LOG_SEGMENT, "Sending ACK packet (3-way handshake)");
+    dumpWire('s', ack, ack_len);
+    if (send(cb->fd, ack, ack_len, 0) < 0) {
+        logPerror("send");
+        return -1;
+    }
+
+    /* The ring starts at the initial window and grows with it in sendData() */
+    if (ringInit(&cb->ring, sendWindow(cb), cb->mss, sizeof(tcpheader) + cb->probe_hi, cb->zerocopy) < 0)
+        return -1;
+    if (cb->probe_hi > cb->mss && (cb->probe_buf = malloc(sizeof(tcpheader) + cb->probe_hi)) == NULL) {
+        logPerror("malloc");
+        return -1;
+    }
+
+    logLog(LOG_INIT, "Connection established with window size %u (scale %d), MSS %u (up to %u), SACK %s",
+           cb->window_size, cb->snd_wscale, cb->mss, cb->probe_hi, cb->sack_ok ? "on" : "off");
+    cb->state = STCP_SENDER_ESTABLISHED;
+    return 0;
+}
+
+/*
+ * Socket handler: process every packet queued on the socket, a batch at
+ * a time.  The socket is edge triggered, so it is read until a batch comes
+ * back short, which means the queue was empty.  While the SYN is
+ * outstanding only a SYN-ACK is of interest; after the FIN has been sent
+ * the connection is closed once the peer acknowledges it or sends its own
+ * FIN.
+ */
+void packetReady(stcp_event *ev) {
+    stcp_send_ctrl_blk *cb = ev->arg;
+    stcp_rxbatch *batch = &cb->rx;
+    int res;
+
+    while ((res = readBatch(cb->fd, batch, 0)) > 0) {
+        cb->acks_read += res;
+        for (int i = 0; i < batch->count && cb->state != STCP_SENDER_CLOSED; i++) {
+            unsigned char *data = rxData(batch, i);
+            if (!verifyPacketIntegrity(data, batch->len[i])) {
+                logLog(LOG_ERROR, "Checksum mismatch in ACK packet");
+                cb->stats.checksum_errors++;
+                continue;
+            }
+            tcpheader *hdr = (tcpheader *)data;
+            ntohHdr(hdr);
+            if (cb->state == STCP_SENDER_SYN_SENT) {
+                if (getSyn(hdr) && synAckReceived(cb, data, batch->len[i]) < 0)
+                    cb->read_error = STCP_READ_PERMANENT_FAILURE;
+                continue;
+            }
+            tcpoptions opts;
+            if (cb->peer_options) {
+                tcpParseOptions(data, batch->len[i], &opts);
+                if (opts.probe_ack) {
+                    pmtuProbeAcked(cb, opts.probe_ack);
+                    continue;
+                }
+            }
+            logLog(LOG_SEGMENT, "Received ACK packet");
+            processAck(cb, &cb->ring, hdr->ackNo, hdr->windowSize, cb->sack_ok ? &opts : NULL);
+            if (cb->probe_size != 0 && greater32(cb->last_ack_num, cb->probe_seq))
+                cb->probe_sent = 0;     /* overtaken by later data: lost */
+            if (cb->state == STCP_SENDER_CLOSING && (ringEmpty(&cb->ring) || getFin(hdr))) {
+                logLog(LOG_INIT, "Connection closed");
+                cb->state = STCP_SENDER_CLOSED;
+            }
+        }
+        if (!batch->more || cb->state == STCP_SENDER_CLOSED)
+            break;
+    }
+    if (res == STCP_READ_PERMANENT_FAILURE) {
+        if (cb->state == STCP_SENDER_CLOSING) {
+            /* Every byte of data was acknowledged before the FIN was sent */
+            logLog(LOG_CLOSE, "Peer closed before acknowledging the FIN");
+            cb->state = STCP_SENDER_CLOSED;
         } else {
-            current = current->next;
+            cb->read_error = res;
         }
     }
+    cbWake(cb);
 }
 
-packet_node *findPacketNode(packet_node *head, unsigned int seq) {
-    while (head != NULL) {
-        if (head->seq == seq)
-            return head;
-        head = head->next;
+/*
+ * Timer handler.  In SYN_SENT the SYN has gone unanswered for an RTO and
+ * is sent again with the timeout backed off; afterwards the earliest
+ * retransmission deadline has passed.
+ */
+void timerExpired(stcp_event *ev) {
+    stcp_send_ctrl_blk *cb = ev->arg;
+
+    if (cb->state == STCP_SENDER_SYN_SENT) {
+        logLog(LOG_ERROR, "Timeout waiting for ACK packet");
+        logLog(LOG_SEGMENT, "Retransmitting SYN packet");
+        send(cb->fd, cb->syn, cb->syn_len, 0);
+        cb->syn_retransmitted = 1;
+        cb->stats.timeouts++;
+        cb->stats.retransmits++;
+        cb->rto = stcpNextTimeout(cb->rto);
+        loopTimerSet(cb->loop, &cb->rto_timer, get_current_time() + cb->rto * 1000UL);
+    } else {
+        checkAndRetransmit(cb, &cb->ring);
+        rtoArm(cb);
     }
-    return NULL;
+    cbWake(cb);
 }
 
-void checkAndRetransmit(packet_node **head, int fd) {
-    unsigned long now = get_current_time();
-    packet_node *node = *head;
-    while (node != NULL) {
-        int timeout;
-
-        if (node->retransmission_count == 0)
-            timeout = 1000;
-        else if (node->retransmission_count == 1)
-            timeout = 2000;
-        else
-            timeout = 4000;
-        
-        if (now - node->sent_time >= timeout) {
-            
-            logLog("segment", "Retransmitting data packet");
-            send(fd, node->pkt.data, node->pkt.len, 0);
-            
-            node->sent_time = now;
-            node->retransmission_count++;
+/*
+ * Post any queued segments, arm the retransmission timer for the next
+ * deadline and run the event loop once, waiting up to ms milliseconds for
+ * ACKs.  The ACKs that arrive are processed and whatever they caused to be
+ * retransmitted is posted as well; without io_uring posting is flushing,
+ * with it the segments go out with the next wait.  A deadline that passes fires the timeout even
+ * if ACKs keep arriving, since a resent segment can be lost again while
+ * duplicate ACKs for later data stream in.  If the loop is shared the
+ * other connections' events are handled too.  Returns the number of
+ * packets read, 0 if none arrived but pacing allows more to be sent, or
+ * STCP_READ_TIMED_OUT / STCP_READ_PERMANENT_FAILURE if none arrived.
+ */
+int receiveAcks(stcp_send_ctrl_blk *cb, int ms) {
+    if (txqPost(&cb->txq) < 0)
+        return errno == ECONNREFUSED ? STCP_READ_PERMANENT_FAILURE : STCP_READ_TIMED_OUT;
+    rtoArm(cb);
+
+    cb->acks_read = 0;
+    cb->read_error = 0;
+    cb->pace_woken = 0;
+    if (loopRun(cb->loop, ms) < 0)
+        return STCP_READ_PERMANENT_FAILURE;
+    if (cb->read_error)
+        return cb->read_error;
+
+    /* Send any retransmissions the ACKs triggered */
+    if (txqPost(&cb->txq) < 0)
+        return errno == ECONNREFUSED ? STCP_READ_PERMANENT_FAILURE : STCP_READ_TIMED_OUT;
+    if (cb->acks_read == 0 && cb->pace_woken)
+        return 0;               /* time to send more */
+    return cb->acks_read > 0 ? cb->acks_read : STCP_READ_TIMED_OUT;
+}
+
+/*
+ * Pacing.  Rather than release what the window allows back to back, new
+ * data leaves at a rate of gain times cwnd per smoothed RTT, so a window
+ * is spread over the round trip it covers and the queues along the path
+ * see a steady stream instead of line-rate bursts.  The gain (higher in
+ * slow start, where the window doubles every round trip) keeps the pacing
+ * from holding the window back.  A token bucket holds the credit: it fills
+ * at the pacing rate up to STCP_PACE_BURST_MS worth, and at least two
+ * segments, and each segment spends its length.  When it runs dry the
+ * pace timer wakes the connection once enough has built up.  Until the
+ * first RTT sample there is no rate to pace at.
+ *
+ * STCP_PACING selects the mode.  With STCP_PACE_KERNEL the rate is given
+ * to the kernel instead (SO_MAX_PACING_RATE, enforced by the fq queueing
+ * discipline) whenever it moves by more than an eighth.
+ */
+#define STCP_PACE_OFF 0
+#define STCP_PACE_USER 1
+#define STCP_PACE_KERNEL 2
+
+#define STCP_PACE_BURST_MS 2
+#define STCP_PACE_GAIN_SS 2.0
+#define STCP_PACE_GAIN_CA 1.25
+
+/* The pacing rate in bytes per second, 0 if there is none yet */
+static unsigned long paceRate(stcp_send_ctrl_blk *cb) {
+    if (cb->srtt <= 0)
+        return 0;
+    double gain = cb->cc.cwnd < cb->cc.ssthresh ? STCP_PACE_GAIN_SS : STCP_PACE_GAIN_CA;
+    return (unsigned long)(cb->cc.cwnd * gain * 1000000.0 / cb->srtt);
+}
+
+/* Hand the rate to the kernel.  Returns -1 if it will not take it. */
+static int paceKernel(stcp_send_ctrl_blk *cb, unsigned long rate) {
+#ifdef SO_MAX_PACING_RATE
+    if (rate == 0 || (rate > cb->pace_kernel - cb->pace_kernel / 8 && rate < cb->pace_kernel + cb->pace_kernel / 8))
+        return 0;
+    unsigned int value = rate < UINT_MAX ? rate : UINT_MAX;
+    if (setsockopt(cb->fd, SOL_SOCKET, SO_MAX_PACING_RATE, &value, sizeof(value)) == 0) {
+        cb->pace_kernel = rate;
+        return 0;
+    }
+    logPerror("SO_MAX_PACING_RATE");
+#endif
+    return -1;
+}
+
+/*
+ * May a segment with len bytes of payload go now?  If not, the pace timer
+ * is set for when it may.
+ */
+static int paceAllow(stcp_send_ctrl_blk *cb, unsigned int len) {
+    if (cb->pacing == STCP_PACE_OFF)
+        return 1;
+    unsigned long rate = paceRate(cb);
+    if (cb->pacing == STCP_PACE_KERNEL) {
+        if (paceKernel(cb, rate) < 0) {
+            logLog(LOG_INIT, "Kernel pacing unavailable, pacing in the sender");
+            cb->pacing = STCP_PACE_USER;
+        } else {
+            return 1;
         }
-        node = node->next;
     }
+    if (rate == 0)
+        return 1;
+
+    unsigned long now = get_current_time();
+    double burst = (double)rate * STCP_PACE_BURST_MS / 1000;
+    if (burst < 2 * cb->mss)
+        burst = 2 * cb->mss;
+    cb->pace_tokens += (double)(now - cb->pace_last) * rate / 1000000;
+    if (cb->pace_tokens > burst)
+        cb->pace_tokens = burst;
+    cb->pace_last = now;
+    if (cb->pace_tokens >= len) {
+        cb->pace_tokens -= len;
+        return 1;
+    }
+    loopTimerSet(cb->loop, &cb->pace_timer, now + (unsigned long)((len - cb->pace_tokens) * 1000000 / rate) + 1);
+    return 0;
+}
+
+/* The pace timer: the bucket has filled enough for the next segment */
+static void paceExpired(stcp_event *ev) {
+    stcp_send_ctrl_blk *cb = ev->arg;
+    cb->pace_woken = 1;
+    cbWake(cb);
 }
 
-void freeOutstandingList(packet_node **head) {
-    while (*head != NULL) {
-        packet_node *temp = *head;
-        *head = (*head)->next;
-        free(temp);
+/*
+ * Queue as much of the length bytes at data as the windows and the ring
+ * allow, and pacing, after any lost segments and path MTU probe that
+ * are due.  The segments are only handed to the kernel when the queue is
+ * flushed.
+ * Returns the number of bytes queued, or -1 on error.
+ */
+int sendData(stcp_send_ctrl_blk *cb, unsigned char *data, int length) {
+    int bytes_sent = 0;
+
+    /* Keep the ring ahead of the window as it opens (nothing is queued here) */
+    unsigned int limit = sendWindow(cb);
+    if (limit > cb->ring.window) {
+        limit = limit < cb->window_size / 2 ? 2 * limit : cb->window_size;
+        if (txqFlush(&cb->txq) < 0 ||
+            ringGrow(&cb->ring, limit, cb->mss, sizeof(tcpheader) + cb->probe_hi) < 0)
+            return -1;
     }
+
+    retransmitLost(cb, &cb->ring);
+    pmtuProbe(cb);
+
+    // while there is still data to send and the window is not full
+    while (bytes_sent < length) {
+
+        unsigned int in_flight = inFlight(cb, &cb->ring);
+        unsigned int window = sendWindow(cb);
+        int chunk_size = min(cb->mss, length - bytes_sent);
+        if (in_flight + chunk_size > window) {
+            if (in_flight > 0)
+                break;
+            /* Nothing in flight: send what fits, or probe a zero window */
+            chunk_size = max(1, window);
+        }
+        /* Reserve first: pacing spends its credit on a segment that will go */
+        unsigned char *payload = data + bytes_sent;
+        unsigned char *segment = ringReserve(&cb->ring, sizeof(tcpheader) + (cb->zerocopy ? 0 : chunk_size));
+        if (segment == NULL || !paceAllow(cb, chunk_size))
+            break;
+
+        int segment_len;
+        if (cb->zerocopy) {
+            int hdr_len = buildHeader(segment, ACK, STCP_MAXWIN, cb->next_seq_num, cb->rcv_nxt, NULL, payload, chunk_size);
+            segment_len = hdr_len + chunk_size;
+            if (txqQueueParts(&cb->txq, segment, hdr_len, payload, chunk_size) < 0)
+                return -1;
+        } else {
+            segment_len = buildSegment(segment, ACK, STCP_MAXWIN, cb->next_seq_num, cb->rcv_nxt, NULL, payload, chunk_size);
+            if (txqQueue(&cb->txq, segment, segment_len) < 0)
+                return -1;
+        }
+        logLog(LOG_SEGMENT, "Sending data packet");
+        dumpWire('s', segment, segment_len);
+
+        ringCommit(&cb->ring, cb->next_seq_num, chunk_size, segment_len, cb->zerocopy ? payload : NULL, get_current_time());
+        bytes_sent += chunk_size;
+        cb->next_seq_num += chunk_size;
+        cb->stats.segments_sent++;
+        cb->stats.bytes_sent += chunk_size;
+    }
+    return bytes_sent;
 }
 
-void createDataSegment(packet *pkt, int flags, unsigned short rwnd, unsigned int seq, unsigned int ack, unsigned char *data, int len) {
-    createSegment(pkt, flags, rwnd, seq, ack, data, len);
-    memcpy(pkt->data+sizeof(tcpheader), data, len);
+/*
+ * Queue the FIN, once every byte of data has been acknowledged.  It takes
+ * a slot in the ring and a byte of sequence space like data, so it is
+ * retransmitted the same way.  Returns -1 on error.
+ */
+int sendFin(stcp_send_ctrl_blk *cb) {
+    unsigned char *fin_segment = ringReserve(&cb->ring, sizeof(tcpheader));
+    int fin_len = buildSegment(fin_segment, FIN, STCP_MAXWIN, cb->next_seq_num, cb->rcv_nxt, NULL, NULL, 0);
+    logLog(LOG_SEGMENT, "Sending FIN packet");
+    dumpWire('s', fin_segment, fin_len);
+    if (txqQueue(&cb->txq, fin_segment, fin_len) < 0)
+        return -1;
+    ringCommit(&cb->ring, cb->next_seq_num, 1, fin_len, NULL, get_current_time());
+    cb->next_seq_num++;
+    cb->state = STCP_SENDER_CLOSING;
+    return 0;
 }
 
-int verifyPacketIntegrity(packet *pkt, int len) {
-    
-    unsigned short original_checksum = pkt->hdr->checksum;
+#define STCP_SNDBUF (256 * 1024)  /* default send buffer, STCP_SNDBUF overrides */
+
+/* The first len bytes of unsent data that make whole segments */
+static inline size_t wholeSegments(stcp_send_ctrl_blk *cb, size_t len) {
+    return len - len % cb->mss;
+}
 
-    pkt->hdr->checksum = 0;
+/*
+ * Queue the unsent data the windows allow: whole segments only, or
+ * everything down to a short last segment if push is set.  Returns the
+ * number of bytes queued, or -1 on error.
+ */
+static int sendBuffered(stcp_send_ctrl_blk *cb, int push) {
+    size_t len = cb->unsent_len < INT_MAX / 2 ? cb->unsent_len : INT_MAX / 2;
+    int queued = sendData(cb, (unsigned char *)cb->unsent, push && len == cb->unsent_len ? len : wholeSegments(cb, len));
+    if (queued <= 0)
+        return queued;
+    cb->unsent += queued;
+    cb->unsent_len -= queued;
+    if (cb->unsent_len == 0 && !cb->zerocopy)
+        cb->unsent = cb->sndbuf;
+    return queued;
+}
+
+/*
+ * Take up to length bytes at data into the send buffer, moving what is
+ * already there to the front if that makes room.  In zero-copy mode the
+ * data is only referenced, which is possible if it directly follows the
+ * unsent data (or there is none).  Returns the number of bytes taken.
+ */
+static size_t sndbufAppend(stcp_send_ctrl_blk *cb, unsigned char *data, size_t length) {
+    if (cb->zerocopy) {
+        if (cb->unsent_len == 0)
+            cb->unsent = data;
+        else if (cb->unsent + cb->unsent_len != data)
+            return 0;
+        cb->unsent_len += length;
+        return length;
+    }
+
+    size_t room = cb->sndbuf + cb->sndbuf_size - (cb->unsent + cb->unsent_len);
+    if (room < length && cb->unsent != cb->sndbuf) {
+        memmove(cb->sndbuf, cb->unsent, cb->unsent_len);
+        cb->unsent = cb->sndbuf;
+        room = cb->sndbuf_size - cb->unsent_len;
+    }
+    if (length > room)
+        length = room;
+    memcpy(cb->sndbuf + (cb->unsent - cb->sndbuf) + cb->unsent_len, data, length);
+    cb->unsent_len += length;
+    return length;
+}
+
+/*
+ * Send what the windows allow and wait up to an RTO for ACKs to open
+ * them.  Returns -1 on a permanent failure.
+ */
+static int sendWait(stcp_send_ctrl_blk *cb, int push) {
+    if (sendBuffered(cb, push) < 0)
+        return -1;
+    int ack_length = receiveAcks(cb, cb->rto);
+    if (ack_length == STCP_READ_TIMED_OUT) {
+        logLog(LOG_ERROR, "Timeout waiting for ACK packet");
+    } else if (ack_length < 0) {
+        logPerror("read");
+        return -1;
+    }
+    return 0;
+}
+
+/*
+ * Write up to length bytes to the connection, like write() on a socket:
+ * the data is taken into the send buffer (or, in zero-copy mode,
+ * referenced) and the call returns as soon as it is, having sent what the
+ * windows allow and handled any ACKs already waiting, rather than once
+ * everything is acknowledged.  Segments are cut from the buffer only when
+ * full sized, so consecutive writes are sent as one stream.  While nothing
+ * is buffered whole segments are built straight from the caller's data.
+ * Blocks only while the buffer is full.  Returns the number of bytes
+ * written, which is less than length only if the buffer filled, or -1 on
+ * error.
+ */
+int stcp_write(stcp_send_ctrl_blk *cb, unsigned char *data, int length) {
+    if (cb->state != STCP_SENDER_ESTABLISHED)
+        return -1;
+    if (!cb->zerocopy && cb->sndbuf == NULL) {
+        cb->sndbuf_size = max(stcpEnvInt("STCP_SNDBUF", STCP_SNDBUF), 65535);
+        cb->sndbuf = malloc(cb->sndbuf_size);
+        if (cb->sndbuf == NULL) {
+            logPerror("malloc");
+            return -1;
+        }
+        cb->unsent = cb->sndbuf;
+    }
 
-    unsigned short calculated_checksum = ipchecksum(pkt->data, len);
+    int written = 0;
+    if (cb->unsent_len == 0 && !cb->zerocopy) {
+        written = sendData(cb, data, wholeSegments(cb, length));
+        if (written < 0)
+            return -1;
+    }
+    written += sndbufAppend(cb, data + written, length - written);
+    while (written == 0 && length > 0) {
+        /* Full, or zero-copy data that does not follow on: wait for room */
+        if (sendWait(cb, cb->zerocopy || wholeSegments(cb, cb->unsent_len) == 0) < 0)
+            return -1;
+        written = sndbufAppend(cb, data, length);
+    }
 
-    pkt->hdr->checksum = original_checksum;
-    return (original_checksum == calculated_checksum);
+    if (sendBuffered(cb, 0) < 0)
+        return -1;
+    int ack_length = receiveAcks(cb, 0);
+    if (ack_length < 0 && ack_length != STCP_READ_TIMED_OUT) {
+        logPerror("read");
+        return -1;
+    }
+    return written;
 }
 
 /*
@@ -171,135 +1392,140 @@ int verifyPacketIntegrity(packet *pkt, int len) {
  * function readWithTimeout() defined in stcp.c to receive segments) is done
  * as a side effect of the work of this function (and stcp_close()).
  *
- * The function returns STCP_SUCCESS on success, or STCP_ERROR on error.
+ * Writes all the data with stcp_write(), so it returns once the last of
+ * it is in the send buffer.  The function returns STCP_SUCCESS on
+ * success, or STCP_ERROR on error.
  */
 int stcp_send(stcp_send_ctrl_blk *stcp_CB, unsigned char* data, int length) {
 
     /* YOUR CODE HERE */
     int bytes_sent = 0;
-    // int local_unacked_bytes = 0;
-
 
     // while there is still data to send
     while (bytes_sent < length) {
-
-        int local_unacked_bytes = 0;
-
-        // while there is still data to send and the window is not full
-        while (bytes_sent < length && local_unacked_bytes < stcp_CB->window_size) {
-
-            int chunk_size = min(STCP_MSS, length - bytes_sent);
-            packet data_packet;
-            createDataSegment(&data_packet, ACK, stcp_CB->window_size, stcp_CB->next_seq_num, stcp_CB->last_ack_num + 1, data + bytes_sent, chunk_size);
-            htonHdr(data_packet.hdr);
-
-            data_packet.hdr->checksum = ipchecksum(data_packet.data, sizeof(tcpheader) + chunk_size);
-
-            logLog("segment", "Sending data packet");
-
-            dump('s', data_packet.data, data_packet.len);
-
-            if (send(stcp_CB->fd, data_packet.data, data_packet.len, 0) < 0) {
-                logPerror("send");
-                return STCP_ERROR;
-            }
-
-            addOutstanding(&outstanding_head, &data_packet, stcp_CB->next_seq_num, get_current_time());
-            bytes_sent += chunk_size;
-            stcp_CB->next_seq_num += chunk_size;
-            local_unacked_bytes += chunk_size;
-        }
-
-
-
-        packet ack_packet;
-        // initialize ack_packet
-        initPacket(&ack_packet, NULL, STCP_MTU);
-        // reading ack_packet
-        int ack_length = readWithTimeout(stcp_CB->fd, ack_packet.data, STCP_INITIAL_TIMEOUT); 
-        if (ack_length > 0) {
-            if (!verifyPacketIntegrity(&ack_packet, ack_length)) {
-                logLog("error", "Checksum mismatch in ACK packet");
-                continue;
-            } else {
-            ntohHdr(ack_packet.hdr);
-            logLog("segment", "Received ACK packet blah blah");
-            dump('r', ack_packet.data, ack_length);
-            
-            
-            unsigned int received_ack = ack_packet.hdr->ackNo;
-            int newly_acked = received_ack - stcp_CB->last_ack_num;
-            stcp_CB->last_ack_num = received_ack;
-            local_unacked_bytes -= newly_acked;
-
-            removeOutstanding(&outstanding_head, received_ack);
-            }
-
-        } else if (ack_length == STCP_READ_TIMED_OUT) {
-            logLog("error", "Timeout waiting for ACK packet");
-            checkAndRetransmit(&outstanding_head, stcp_CB->fd);
-        } else {
-            logPerror("read");
+        int written = stcp_write(stcp_CB, data + bytes_sent, length - bytes_sent);
+        if (written < 0)
             return STCP_ERROR;
-            
-        }
-
+        bytes_sent += written;
+    }
 
-        int last_duplicate_ack = 0;
-        int duplicate_ack_count = 0;
+    return STCP_SUCCESS;
+}
 
-        while ((ack_length = readWithTimeout(stcp_CB->fd, ack_packet.data, 0)) > 0) {
-            if (!verifyPacketIntegrity(&ack_packet, ack_length)) {
-                logLog("error", "Checksum mismatch in ACK packet");
-                continue;
-            }
-            ntohHdr(ack_packet.hdr);
-            logLog("segment", "Draining ACK packet");
-            dump('r', ack_packet.data, ack_length);
-            unsigned int received_ack = ack_packet.hdr->ackNo;
+/*
+ * Start opening a connection driven by "loop": create the control block,
+ * register the socket and send the SYN.  The connection is in SYN_SENT
+ * until the loop has delivered the SYN-ACK, with the SYN retransmitted
+ * from the timer meanwhile.  Returns NULL on error.
+ */
+stcp_send_ctrl_blk *stcpConnect(char *destination, int sendersPort, int receiversPort, stcp_loop *loop) {
 
-            if (received_ack == last_duplicate_ack) {
-                duplicate_ack_count++;
-            } else {
-                last_duplicate_ack = received_ack;
-                duplicate_ack_count = 1;
-            }
+    logLog(LOG_INIT, "Sending from port %d to <%s, %d>", sendersPort, destination, receiversPort);
+    // Since I am the sender, the destination and receiversPort name the other side
+    int fd = udp_open(destination, receiversPort, sendersPort);
+    if (fd < 0) {
+        logLog(LOG_ERROR, "Failed to open UDP connection");
+        return NULL;
+    }
 
-            if (duplicate_ack_count == 3) {
-                logLog("segment", "Fast retransmission triggered for seq: %u", received_ack);
-                int temp_ack_length;
-                while ((temp_ack_length = readWithTimeout(stcp_CB->fd, ack_packet.data, 0)) > 0) {
-                    ntohHdr(ack_packet.hdr);
-                    logLog("segment", "Draining additional ACK during fast retransmission, ackNo: %u", ack_packet.hdr->ackNo);
-                    dump('r', ack_packet.data, temp_ack_length);
-                    
-                }
-                
-                packet_node *node = findPacketNode(outstanding_head, received_ack);
-                if (node != NULL) {
-                    logLog("segment", "Fast retransmitting packet with seq: %u", node->seq);
-                    send(stcp_CB->fd, node->pkt.data, node->pkt.len, 0);
-                    node->sent_time = get_current_time();
-                    node->retransmission_count++;
-                }
-                
-                duplicate_ack_count = 0;
-            }
+    stcp_send_ctrl_blk *cb = (stcp_send_ctrl_blk *) calloc(1, sizeof(stcp_send_ctrl_blk));
+    if (cb == NULL) {
+        logPerror("malloc");
+        close(fd);
+        return NULL;
+    }
 
+    cb->fd = fd;
+    int offload = udpSetOffload(fd, stcpEnvInt("STCP_OFFLOAD", 0));
+    txqInit(&cb->txq, fd, offload & STCP_OFFLOAD_GSO);
+    cb->txq.uring = loop->uring;
+    if (rxbatchInit(&cb->rx, STCP_MTU, offload & STCP_OFFLOAD_GRO) < 0) {
+        close(fd);
+        free(cb);
+        return NULL;
+    }
+    cb->state = STCP_SENDER_CLOSED;
+    cb->isn = rand();
+    cb->next_seq_num = cb->isn + 1;
+    cb->window_size = STCP_MAXWIN;
+    cb->snd_wscale = 0;
+    cb->srtt = 0;
+    cb->rttvar = 0;
+    cb->rto = STCP_INITIAL_TIMEOUT;
+    cb->rto_min = stcpEnvInt("STCP_MIN_RTO", STCP_MIN_TIMEOUT);
+    cb->pacing = stcpEnvInt("STCP_PACING", STCP_PACE_USER);
+    cb->dup_acks = 0;
+    cb->rexmit_next = 0;
+    cb->loss_end = 0;
+    cb->sack_ok = 0;
+    if (ccInit(&cb->cc, getenv("STCP_CC"), STCP_MSS) < 0)
+        logLog(LOG_ERROR, "Unknown congestion control \"%s\", using %s", getenv("STCP_CC"), cb->cc.ops->name);
+    cb->peer_options = 0;
+    cb->mss = STCP_MSS;
+    cb->probe_size = 0;
+    cb->probe_buf = NULL;
+    cb->loop = loop;
 
-            int newly_acked = received_ack - stcp_CB->last_ack_num;
-            stcp_CB->last_ack_num = received_ack;
-            local_unacked_bytes -= newly_acked;
-            removeOutstanding(&outstanding_head, received_ack);
-            //hello
-        }
+    /*
+     * With STCP_OPTIONS set the SYN advertises the largest segment we
+     * could handle and offers window scaling and SACK.  Otherwise it carries no
+     * options, as peers that do not know them treat them as payload.  Our
+     * own window is never scaled: the sender receives no data.
+     */
+    int local_mtu = min(STCP_MAX_MTU, max(STCP_MTU, stcpEnvInt("STCP_MAX_MTU", STCP_MAX_MTU)));
+    tcpoptions syn_opts = { .mss = local_mtu - sizeof(tcpheader), .has_wscale = 1, .wscale = 0, .sack_permitted = 1 };
+    cb->syn_mss = syn_opts.mss;
+    cb->syn_len = buildSegment(cb->syn, SYN, STCP_MAXWIN, cb->isn, 0,
+                               stcpEnvInt("STCP_OPTIONS", 0) ? &syn_opts : NULL, NULL, 0);
+
+    eventInit(&cb->sock, fd, packetReady, cb);
+    eventInit(&cb->rto_timer, -1, timerExpired, cb);
+    eventInit(&cb->pace_timer, -1, paceExpired, cb);
+    if (loopAdd(loop, &cb->sock) < 0) {
+        rxbatchFree(&cb->rx);
+        close(fd);
+        free(cb);
+        return NULL;
+    }
 
+    logLog(LOG_SEGMENT, "Sending SYN packet");
+    if (send(cb->fd, cb->syn, cb->syn_len, 0) < 0) {
+        logPerror("send");
+        loopRemove(loop, &cb->sock);
+        rxbatchFree(&cb->rx);
+        close(fd);
+        free(cb);
+        return NULL;
     }
+    cb->syn_sent = get_current_time();
+    cb->state = STCP_SENDER_SYN_SENT;
+    loopTimerSet(loop, &cb->rto_timer, cb->syn_sent + cb->rto * 1000UL);
 
-    return STCP_SUCCESS;
+    char local[16], remote[80];
+    snprintf(local, sizeof(local), "%d", sendersPort);
+    snprintf(remote, sizeof(remote), "%s:%d", destination, receiversPort);
+    statsInit(&cb->stats, local, remote, cb->syn_sent);
+    return cb;
 }
 
-
+/* Release everything a connection holds, including the control block */
+void stcpFree(stcp_send_ctrl_blk *cb) {
+    statsReport(cb, 1);
+    txqClose(&cb->txq);
+    loopTimerCancel(cb->loop, &cb->rto_timer);
+    loopTimerCancel(cb->loop, &cb->pace_timer);
+    loopRemove(cb->loop, &cb->sock);
+    if (cb->own_loop) {
+        loopFree(cb->loop);
+        free(cb->loop);
+    }
+    ringFree(&cb->ring);
+    rxbatchFree(&cb->rx);
+    free(cb->probe_buf);
+    free(cb->sndbuf);
+    close(cb->fd);
+    free(cb);
+}
 
 /*
  * Open the sender side of the STCP connection. Returns the pointer to
@@ -315,165 +1541,40 @@ int stcp_send(stcp_send_ctrl_blk *stcp_CB, unsigned char* data, int length) {
  * number of "connections" to the number of file descriptors and isn't
  * very good for a pure request response protocol like DNS where there
  * is no long term relationship between the client and server.
+ *
+ * The connection gets an event loop of its own and this call blocks
+ * until the handshake is complete; see stcpConnect() for connections
+ * that share a loop.
  */
 stcp_send_ctrl_blk * stcp_open(char *destination, int sendersPort,
                              int receiversPort) {
 
-    logLog("init", "Sending from port %d to <%s, %d>", sendersPort, destination, receiversPort);
-    // Since I am the sender, the destination and receiversPort name the other side
-    int fd = udp_open(destination, receiversPort, sendersPort);
-    if (fd < 0) {
-        logLog("error", "Failed to open UDP connection");
+    stcp_loop *loop = malloc(sizeof(stcp_loop));
+    if (loop == NULL) {
+        logPerror("malloc");
         return NULL;
     }
-    // (void) fd;
-    /* YOUR CODE HERE */
-
-    // for reference:
-        // #define STCP_SENDER_CLOSED 0
-        // #define STCP_SENDER_SYN_SENT 1
-        // #define STCP_SENDER_ESTABLISHED 2
-        // #define STCP_SENDER_CLOSING 3
-        // #define STCP_SENDER_FIN_WAIT 4
-
-
-    stcp_send_ctrl_blk *cb = (stcp_send_ctrl_blk *) malloc(sizeof(stcp_send_ctrl_blk));
-    if (cb == NULL) {
-        logPerror("malloc");
+    if (loopInit(loop) < 0) {
+        free(loop);
         return NULL;
     }
-    // TODO: handle malloc error
-
-
-    cb->fd = fd;
-    cb->state = STCP_SENDER_CLOSED;
-    cb->isn = rand();
-    cb->next_seq_num = cb->isn + 1;
-    cb->window_size = STCP_MAXWIN;
-    
-    
-    packet syn_packet;
-    createSegment(&syn_packet, SYN, STCP_MAXWIN, cb->isn, 0, NULL, 0);
-    htonHdr(syn_packet.hdr);
-
-    
-
-    syn_packet.hdr->checksum = ipchecksum(syn_packet.data, sizeof(tcpheader));
-    logLog("segment", "Sending SYN packet");
-
-    
-    if (send(cb->fd, syn_packet.data, syn_packet.len, 0) < 0) {
-        logPerror("send");
+    stcp_send_ctrl_blk *cb = stcpConnect(destination, sendersPort, receiversPort, loop);
+    if (cb == NULL) {
+        loopFree(loop);
+        free(loop);
         return NULL;
     }
-
-    addOutstanding(&outstanding_head, &syn_packet, cb->isn, get_current_time());
-
-    cb->state = STCP_SENDER_SYN_SENT;
-
-    packet ack_packet;
-    initPacket(&ack_packet, NULL, STCP_MTU);
-
-    int ack_length = 0;
-    // if (ack_length > 0) {
-    //     ntohHdr(ack_packet.hdr);
-    //     logLog("segment", "Connection Established: Received ACK packet");
-    //     dump('r', ack_packet.data, ack_length);
-    //     cb->window_size = ack_packet.hdr->windowSize;
-    //     cb->last_ack_num = ack_packet.hdr->seqNo;
-    // } else if (ack_length == STCP_READ_TIMED_OUT) {
-    //     logLog("error", "Timeout waiting for ACK packet");
-    //     checkAndRetransmit(&outstanding_head, cb->fd);
-    // } else {
-    //     logPerror("read");
-    //     return NULL;
-    // }
-
-    while (1) {
-        ack_length = readWithTimeout(cb->fd, ack_packet.data, STCP_INITIAL_TIMEOUT);
-        if (ack_length < 0) {
-            if (ack_length == STCP_READ_PERMANENT_FAILURE) {
-                logLog("error", "Permanent failure reading ACK packet");
-                return NULL;
-            }
-            
-            logLog("error", "Timeout waiting for ACK packet");
-            logLog("segment", "Retransmitting SYN packet");
-            
-            checkAndRetransmit(&outstanding_head, cb->fd);
-        } else {
-
-            unsigned short original_checksum = ack_packet.hdr->checksum;
-            
-            ack_packet.hdr->checksum = 0;
-            
-            unsigned short calculated_checksum = ipchecksum(ack_packet.data, ack_length);
-            
-            if (original_checksum != calculated_checksum) {
-                logLog("error", "Checksum mismatch; Ignoring ACK packet (original %u, calculated %u)", 
-                    original_checksum, calculated_checksum);
-                continue;
-            }    
-            
-        
-            ntohHdr(ack_packet.hdr);    
-            logLog("segment", "Connection Established: Received ACK packet");
-            dump('r', ack_packet.data, ack_length);
-            cb->window_size = ack_packet.hdr->windowSize;
-            cb->last_ack_num = ack_packet.hdr->seqNo;
-            break;
-
+    cb->own_loop = 1;
+
+    while (cb->state == STCP_SENDER_SYN_SENT) {
+        cb->read_error = 0;
+        if (loopRun(loop, STCP_INFINITE_TIMEOUT) < 0 || cb->read_error) {
+            logLog(LOG_ERROR, "Permanent failure reading ACK packet");
+            stcpFree(cb);
+            return NULL;
         }
     }
-    // while ((ack_length = readWithTimeout(cb->fd, ack_packet.data, STCP_INITIAL_TIMEOUT)) < 0) {
-
-    //     if (ack_length == STCP_READ_PERMANENT_FAILURE) {
-    //         logLog("error", "Permanent failure reading ACK packet");
-    //         return NULL;
-    //     }
-        
-    //     logLog("error", "Timeout waiting for ACK packet");
-    //     logLog("segment", "Retransmitting SYN packet");
-        
-    //     checkAndRetransmit(&outstanding_head, cb->fd);
-        
-    // }
-
-    // if (ack_packet.hdr->checksum != ipchecksum(ack_packet.data, sizeof(tcpheader))) {
-    //     logLog("error", "Checksum mismatch; Ignoring ACK packet");
-     
-    // } else {
-    //     ntohHdr(ack_packet.hdr);
-    //     logLog("segment", "Connection Established: Received ACK packet");
-    //     dump('r', ack_packet.data, ack_length);
-    //     cb->window_size = ack_packet.hdr->windowSize;
-    //     cb->last_ack_num = ack_packet.hdr->seqNo;
-    // }
-    
-
-    //three way handshake
-    packet ack_packet2;
-    initPacket(&ack_packet2, NULL, STCP_MTU);
-    createSegment(&ack_packet2, ACK, cb->window_size, cb->next_seq_num, cb->last_ack_num + 1, NULL, 0);
-    htonHdr(ack_packet2.hdr);
-    ack_packet2.hdr->checksum = ipchecksum(ack_packet2.data, sizeof(tcpheader));
-    logLog("segment", "Sending ACK packet (3-way handshake)");
-    dump('s', ack_packet2.data, ack_packet2.len);
-    if (send(cb->fd, ack_packet2.data, ack_packet2.len, 0) < 0) {
-        logPerror("send");
-        return NULL;
-    }
-
-
-    logLog("init", "Connection established with window size %d", cb->window_size);
-    cb->state = STCP_SENDER_ESTABLISHED;
-
-
     return cb;
-
-
-
-    // return NULL;
 }
 
 
@@ -489,85 +1590,302 @@ stcp_send_ctrl_blk * stcp_open(char *destination, int sendersPort,
 int stcp_close(stcp_send_ctrl_blk *cb) {
     /* YOUR CODE HERE */
 
-    while (outstanding_head != NULL) {
-        logLog("close", "Outstanding data still pending. Retransmitting...");
-        checkAndRetransmit(&outstanding_head, cb->fd);
-        
-        packet drain_ack;
-        initPacket(&drain_ack, NULL, STCP_MTU);
-        int drain_length;
-        while ((drain_length = readWithTimeout(cb->fd, drain_ack.data, 0)) > 0) {
-            if (!verifyPacketIntegrity(&drain_ack, drain_length)) {
-                logLog("error", "Checksum mismatch in drain ACK packet; ignoring");
-                continue;
-            }
-            ntohHdr(drain_ack.hdr);
-            unsigned int received_ack = drain_ack.hdr->ackNo;
-            removeOutstanding(&outstanding_head, received_ack);
-        }
+    while (cb->unsent_len > 0 || !ringEmpty(&cb->ring)) {
+        logLog(LOG_CLOSE, "Outstanding data still pending. Retransmitting...");
+        if (sendBuffered(cb, 1) < 0)
+            return STCP_ERROR;
+        retransmitLost(cb, &cb->ring);
+        int drain_length = receiveAcks(cb, cb->rto);
+        if (drain_length < 0 && drain_length != STCP_READ_TIMED_OUT)
+            return STCP_ERROR;
     }
 
-
-    packet fin_packet;
-    createSegment(&fin_packet, FIN, cb->window_size, cb->next_seq_num, cb->last_ack_num + 1, NULL, 0);
-    htonHdr(fin_packet.hdr);
-    fin_packet.hdr->checksum = ipchecksum(fin_packet.data, sizeof(tcpheader));
-    logLog("segment", "Sending FIN packet");
-    dump('s', fin_packet.data, fin_packet.len);
-    if (send(cb->fd, fin_packet.data, fin_packet.len, 0) < 0) {
+    if (sendFin(cb) < 0) {
         logPerror("send");
         return STCP_ERROR;
     }
-    addOutstanding(&outstanding_head, &fin_packet, cb->next_seq_num, get_current_time());
-
-    cb->state = STCP_SENDER_CLOSING;
-
-    packet ack_packet;
-    initPacket(&ack_packet, NULL, STCP_MTU);
-    // int ack_length = readWithTimeout(cb->fd, ack_packet.data, STCP_INITIAL_TIMEOUT);
-    int ack_length;
-    while (1) {
-        ack_length = readWithTimeout(cb->fd, ack_packet.data, STCP_INITIAL_TIMEOUT);
-        if (ack_length < 0) {
-            if (ack_length == STCP_READ_PERMANENT_FAILURE) {
-            logLog("error", "Permanent failure reading ACK packet");
+    while (cb->state != STCP_SENDER_CLOSED) {
+        retransmitLost(cb, &cb->ring);
+        int ack_length = receiveAcks(cb, cb->rto);
+        if (ack_length == STCP_READ_TIMED_OUT) {
+            logLog(LOG_ERROR, "Timeout waiting for ACK packet");
+        } else if (ack_length < 0) {
+            logLog(LOG_ERROR, "Permanent failure reading ACK packet");
             return STCP_ERROR;
         }
-        
-        logLog("error", "Timeout waiting for ACK packet");
-        logLog("segment", "Retransmitting FIN packet");
-        
-        checkAndRetransmit(&outstanding_head, cb->fd);
-        } else {
-            if (!verifyPacketIntegrity(&ack_packet, ack_length) && ack_packet.hdr->flags != FIN) {
-                logLog("error", "Checksum mismatch in ACK packet");
-                continue;
-            } else {
-                ntohHdr(ack_packet.hdr);
-                logLog("segment", "Received ACK packet");
-                dump('r', ack_packet.data, ack_length);
-                cb->window_size = ack_packet.hdr->windowSize;
-                cb->last_ack_num = ack_packet.hdr->seqNo;
+    }
+
+    stcpFree(cb);
+    return STCP_SUCCESS;
+}
+
+/*
+ * From now on the data given to stcp_write() stays valid and unchanged
+ * until the connection is closed, as a mapped file does, so segments
+ * refer to it rather than keep copies and the ring shrinks to headers.
+ * Must be called before anything is sent.  Returns -1 on error.
+ */
+int stcpZeroCopy(stcp_send_ctrl_blk *cb) {
+    if (cb->ring.tail != 0 || cb->unsent_len != 0)
+        return -1;
+    cb->zerocopy = 1;
+    if (cb->ring.buf == NULL)
+        return 0;               /* the SYN-ACK will size the ring */
+    unsigned int window = cb->ring.window;
+    ringFree(&cb->ring);
+    return ringInit(&cb->ring, window, cb->mss, sizeof(tcpheader) + cb->probe_hi, 1);
+}
+
+/*
+ * Map an open file for reading so it can be sent in place (see
+ * stcpZeroCopy()), storing its size in *size.  Returns NULL if it is not
+ * a non-empty regular file, mmap() fails or STCP_MMAP=0; the caller then
+ * reads it instead.  The file must not shrink while it is being sent.
+ */
+#define STCP_MAP_CHUNK (1 << 30)  /* bytes of a mapping per stcp_send() */
+
+unsigned char *mapFile(int file, size_t *size) {
+    struct stat st;
+    if (!stcpEnvInt("STCP_MMAP", 1) || fstat(file, &st) < 0 || !S_ISREG(st.st_mode) || st.st_size == 0)
+        return NULL;
+    void *map = mmap(NULL, st.st_size, PROT_READ, MAP_PRIVATE, file, 0);
+    if (map == MAP_FAILED) {
+        logPerror("mmap");
+        return NULL;
+    }
+    madvise(map, st.st_size, MADV_SEQUENTIAL);
+    *size = st.st_size;
+    return map;
+}
+
+/*
+ * Connection manager: runs any number of file transfers, each over its
+ * own connection, from one event loop on one thread.  A connection wakes
+ * its transfer whenever an ACK or a timeout may let it make progress, and
+ * only woken transfers are looked at, so idle connections cost nothing.
+ * A file that is not mapped is read into the transfer's buffer; when the
+ * loop runs on io_uring the read is another operation on the ring, into
+ * a registered buffer, and its completion wakes the transfer in turn.
+ */
+#define STCP_XFER_BUFSIZE 65535
+
+typedef struct stcp_transfer {
+    struct stcp_mgr *mgr;
+    stcp_send_ctrl_blk *cb;
+    char *filename;
+    int file;
+    unsigned char *map;         /* the file, or NULL if it is read into buf */
+    size_t map_size;
+    size_t map_off;             /* bytes of the mapping handed out so far */
+    unsigned char *buf;
+    int buf_index;              /* registered with the loop's ring, or -1 */
+    stcp_event read_ev;         /* a read of buf on the ring */
+    int reading;                /* ... is in progress */
+    unsigned char *data;        /* the piece being sent: in buf or the mapping */
+    int len;                    /* bytes in the piece */
+    int off;                    /* bytes of the piece already sent */
+    int eof;
+    int queued;                 /* on the ready list */
+    struct stcp_transfer *next_ready;
+} stcp_transfer;
+
+typedef struct stcp_mgr {
+    stcp_loop loop;
+    stcp_transfer *ready;       /* transfers woken since they last ran */
+    int active;
+    int reads;                  /* file reads in progress on the ring */
+    int failed;
+} stcp_mgr;
+
+static void transferWake(void *owner) {
+    stcp_transfer *t = owner;
+    if (t->queued)
+        return;
+    t->queued = 1;
+    t->next_ready = t->mgr->ready;
+    t->mgr->ready = t;
+}
+
+int mgrInit(stcp_mgr *mgr) {
+    mgr->ready = NULL;
+    mgr->active = mgr->failed = mgr->reads = 0;
+    return loopInit(&mgr->loop);
+}
+
+/*
+ * Start sending the file "filename" from sendersPort to <destination,
+ * receiversPort>.  Returns -1 if the transfer could not be started.
+ */
+static void transferReadDone(stcp_event *ev);
+
+int mgrAdd(stcp_mgr *mgr, stcp_transfer *t, char *destination, int sendersPort, int receiversPort, char *filename) {
+    t->mgr = mgr;
+    t->filename = filename;
+    t->len = t->off = t->eof = t->queued = t->reading = 0;
+    t->buf_index = -1;
+    t->file = open(filename, O_RDONLY);
+    if (t->file < 0) {
+        logPerror(filename);
+        return -1;
+    }
+    t->map = mapFile(t->file, &t->map_size);
+    t->map_off = 0;
+    t->buf = t->map == NULL ? malloc(STCP_XFER_BUFSIZE) : NULL;
+    t->cb = t->map != NULL || t->buf != NULL ? stcpConnect(destination, sendersPort, receiversPort, &mgr->loop) : NULL;
+    if (t->cb == NULL) {
+        logLog(LOG_ERROR, "Failed to open connection for %s", filename);
+        if (t->map != NULL)
+            munmap(t->map, t->map_size);
+        free(t->buf);
+        t->buf = NULL;
+        close(t->file);
+        return -1;
+    }
+    if (t->map != NULL)
+        stcpZeroCopy(t->cb);
+    eventInit(&t->read_ev, t->file, transferReadDone, t);
+    t->cb->wake = transferWake;
+    t->cb->owner = t;
+    mgr->active++;
+    return 0;
+}
+
+static void transferDone(stcp_transfer *t, int ok) {
+    if (ok)
+        logLog(LOG_INIT, "Transfer of %s complete", t->filename);
+    else
+        logLog(LOG_ERROR, "Transfer of %s failed", t->filename);
+    stcpFree(t->cb);
+    t->cb = NULL;
+    if (t->map != NULL)
+        munmap(t->map, t->map_size);
+    if (!t->reading)
+        free(t->buf);           /* else once the read is over */
+    close(t->file);
+    t->mgr->active--;
+    t->mgr->failed += !ok;
+}
+
+/* A read on the ring finished: the buffer holds the next piece of the file */
+static void transferReadDone(stcp_event *ev) {
+    stcp_transfer *t = ev->arg;
+    t->reading = 0;
+    t->mgr->reads--;
+    if (t->cb == NULL) {
+        free(t->buf);           /* the transfer ended meanwhile */
+        return;
+    }
+    if (ev->result < 0) {
+        errno = -ev->result;
+        logPerror(t->filename);
+        transferDone(t, 0);
+        return;
+    }
+    t->data = t->buf;
+    t->len = ev->result;
+    t->off = 0;
+    t->eof = ev->result == 0;
+    transferWake(t);
+}
+
+/*
+ * Move a woken transfer along: take the next piece of the file, from the
+ * mapping or by reading it, and send while the windows allow, and send
+ * the FIN once the file is done and acknowledged.
+ */
+static void transferRun(stcp_transfer *t) {
+    stcp_send_ctrl_blk *cb = t->cb;
+
+    if (cb->read_error) {
+        transferDone(t, 0);
+        return;
+    }
+    if (cb->state == STCP_SENDER_ESTABLISHED || cb->state == STCP_SENDER_CLOSING)
+        retransmitLost(cb, &cb->ring);
+    while (cb->state == STCP_SENDER_ESTABLISHED && !t->reading) {
+        if (t->off == t->len && !t->eof) {
+            int n;
+            if (t->map != NULL) {
+                n = t->map_size - t->map_off < STCP_MAP_CHUNK ? t->map_size - t->map_off : STCP_MAP_CHUNK;
+                t->data = t->map + t->map_off;
+                t->map_off += n;
+            } else if (loopRead(&t->mgr->loop, &t->read_ev, t->buf, STCP_XFER_BUFSIZE, t->buf_index) == 0) {
+                t->reading = 1;
+                t->mgr->reads++;
                 break;
+            } else {
+                n = read(t->file, t->buf, STCP_XFER_BUFSIZE);
+                t->data = t->buf;
+            }
+            if (n < 0) {
+                logPerror(t->filename);
+                transferDone(t, 0);
+                return;
+            }
+            t->eof = n == 0;
+            t->len = n;
+            t->off = 0;
+        }
+        if (t->off == t->len) {
+            if (ringEmpty(&cb->ring) && sendFin(cb) < 0) {
+                transferDone(t, 0);
+                return;
             }
+            break;
         }
+        int queued = sendData(cb, t->data + t->off, t->len - t->off);
+        if (queued < 0) {
+            transferDone(t, 0);
+            return;
+        }
+        t->off += queued;
+        if (t->off < t->len)
+            break;              /* the window is full */
     }
+    if (cb->state == STCP_SENDER_CLOSED) {
+        transferDone(t, 1);
+        return;
+    }
+    if (txqPost(&cb->txq) < 0 && errno == ECONNREFUSED) {
+        transferDone(t, 0);
+        return;
+    }
+    rtoArm(cb);
+}
 
+/* Run every transfer to completion.  Returns the number that failed. */
+int mgrRun(stcp_mgr *mgr) {
+    while (mgr->active > 0 || mgr->reads > 0) {
+        while (mgr->ready != NULL) {
+            stcp_transfer *t = mgr->ready;
+            mgr->ready = t->next_ready;
+            t->queued = 0;
+            transferRun(t);
+        }
+        if ((mgr->active > 0 || mgr->reads > 0) && loopRun(&mgr->loop, STCP_INFINITE_TIMEOUT) < 0)
+            return mgr->failed + mgr->active;
+    }
+    loopFree(&mgr->loop);
+    return mgr->failed;
+}
 
-    // ntohHdr(ack_packet.hdr);
-    // logLog("segment", "Received ACK packet");
-    // dump('r', ack_packet.data, ack_length);
-    // cb->window_size = ack_packet.hdr->windowSize;
-    // cb->last_ack_num = ack_packet.hdr->seqNo;
-
-    logLog("init", "Connection closed");
-    cb->state = STCP_SENDER_CLOSED;
-    freeOutstandingList(&outstanding_head);
-    close(cb->fd);
-    free(cb);
-    
-    return STCP_SUCCESS;
+/* Register the read buffers of the transfers that have one with the loop's ring */
+static void mgrRegisterBuffers(stcp_mgr *mgr, stcp_transfer *transfers, int count) {
+    struct iovec iov[count];
+    int n = 0;
+    for (int i = 0; i < count; i++) {
+        if (transfers[i].cb != NULL && transfers[i].buf != NULL) {
+            iov[n].iov_base = transfers[i].buf;
+            iov[n].iov_len = STCP_XFER_BUFSIZE;
+            transfers[i].buf_index = n++;
+        }
+    }
+    if (n > 0 && loopRegisterBuffers(&mgr->loop, iov, n) < 0) {
+        for (int i = 0; i < count; i++)
+            transfers[i].buf_index = -1;
+    }
 }
+
 /*
  * Return a port number based on the uid of the caller.  This will
  * with reasonably high probability return a port number different from
@@ -582,6 +1900,181 @@ int getDefaultPort() {
     return port;
 }
 
+/*
+ * Whether count connections, the ith from sendersPort + 2i to
+ * receiversPort + 2i, all have ports that fit in 16 bits.  Logs the range
+ * that does not.
+ */
+static int portsFit(int sendersPort, int receiversPort, int count) {
+    long last = 2L * (count - 1);
+    if (sendersPort + last <= 65535 && receiversPort + last <= 65535)
+        return 1;
+    logLog(LOG_ERROR, "%d connections need ports up to %ld and %ld, past 65535",
+           count, sendersPort + last, receiversPort + last);
+    return 0;
+}
+
+/*
+ * Send several files at once, each over its own connection, all driven
+ * by one connection manager.  File i goes from sendersPort + 2i to
+ * receiversPort + 2i, so each transfer needs a receiver of its own.
+ * Returns the exit status.
+ */
+int sendFiles(char *destination, int receiversPort, int sendersPort, char **files, int count) {
+    if (!portsFit(sendersPort, receiversPort, count))
+        return 1;
+    stcp_mgr mgr;
+    stcp_transfer *transfers = calloc(count, sizeof(stcp_transfer));
+    if (transfers == NULL || mgrInit(&mgr) < 0) {
+        logPerror("sendFiles");
+        return 1;
+    }
+    for (int i = 0; i < count; i++) {
+        if (mgrAdd(&mgr, &transfers[i], destination, sendersPort + 2 * i, receiversPort + 2 * i, files[i]) < 0)
+            mgr.failed++;
+    }
+    mgrRegisterBuffers(&mgr, transfers, count);
+    int failed = mgrRun(&mgr);
+    free(transfers);
+    return failed == 0 ? 0 : 1;
+}
+
+/*
+ * Striped mode: one range of the file, sent by its own worker thread over
+ * its own connection.  Connections share nothing, so the workers need no
+ * locking; each has a private event loop through stcp_open().  When the
+ * file is mapped every worker sends its range straight from the one
+ * mapping, and the stripe header from the job.
+ */
+typedef struct stcp_stripe_job {
+    char *destination;
+    int sendersPort;
+    int receiversPort;
+    int file;
+    unsigned char *map;         /* the whole file, or NULL to pread() it */
+    unsigned char header[STCP_STRIPE_HDRLEN];
+    stcp_stripe stripe;
+    int ok;
+} stcp_stripe_job;
+
+/* Send the job's stripe header and then its range over cb.  Returns -1 on error. */
+static int stripeSend(stcp_stripe_job *job, stcp_send_ctrl_blk *cb, unsigned char *buffer) {
+    /* The header goes out in front of the first piece of the range */
+    unsigned char *data = job->map != NULL ? job->header : buffer;
+    int len = stripeEncode(data, &job->stripe);
+    if (job->map != NULL) {
+        if (stcp_send(cb, data, len) == STCP_ERROR)
+            return -1;
+        len = 0;
+    }
+    unsigned long long done = 0;
+    do {
+        unsigned long long want = job->stripe.length - done;
+        int n;
+        if (job->map != NULL) {
+            n = want < STCP_MAP_CHUNK ? want : STCP_MAP_CHUNK;
+            data = job->map + job->stripe.offset + done;
+        } else {
+            if (want > STCP_XFER_BUFSIZE - len)
+                want = STCP_XFER_BUFSIZE - len;
+            n = want > 0 ? pread(job->file, buffer + len, want, job->stripe.offset + done) : 0;
+            if (n < 0 || (n == 0 && want > 0)) {
+                logPerror("pread");
+                return -1;
+            }
+        }
+        if (stcp_send(cb, data, len + n) == STCP_ERROR)
+            return -1;
+        done += n;
+        len = 0;
+    } while (done < job->stripe.length);
+    return 0;
+}
+
+/*
+ * A stripe's thread.  Whatever fails once the connection is open, the
+ * connection is freed on the way out.
+ */
+void *stripeWorker(void *arg) {
+    stcp_stripe_job *job = arg;
+    unsigned char *buffer = job->map == NULL ? malloc(STCP_XFER_BUFSIZE) : NULL;
+    if (job->map == NULL && buffer == NULL) {
+        logPerror("malloc");
+        return NULL;
+    }
+    stcp_send_ctrl_blk *cb = stcp_open(job->destination, job->sendersPort, job->receiversPort);
+    if (cb == NULL || (job->map != NULL && stcpZeroCopy(cb) < 0)) {
+        logLog(LOG_ERROR, "Failed to open connection for stripe %u", job->stripe.index);
+        if (cb != NULL)
+            stcpFree(cb);
+    } else if (stripeSend(job, cb, buffer) < 0) {
+        logLog(LOG_ERROR, "Failed to send stripe %u", job->stripe.index);
+        stcpFree(cb);
+    } else if (stcp_close(cb) == STCP_ERROR) {
+        logLog(LOG_ERROR, "Failed to close connection for stripe %u", job->stripe.index);
+        stcpFree(cb);           /* stcp_close() frees it only on success */
+    } else {
+        logLog(LOG_INIT, "Stripe %u of %u complete", job->stripe.index, job->stripe.count);
+        job->ok = 1;
+    }
+    free(buffer);
+    return NULL;
+}
+
+/*
+ * Send one file as "stripes" byte ranges at once, each from its own thread
+ * over its own connection.  Ranges are page aligned so the receiver's
+ * positional writes are too.  Stripe i uses both ports plus 2i, as the
+ * files of sendFiles() do.  Returns the exit status.
+ */
+int sendStriped(char *destination, int receiversPort, int sendersPort, char *filename, int stripes) {
+    struct stat st;
+    if (!portsFit(sendersPort, receiversPort, stripes))
+        return 1;
+    int file = open(filename, O_RDONLY);
+    if (file < 0 || fstat(file, &st) < 0) {
+        logPerror(filename);
+        return 1;
+    }
+
+    unsigned long long size = st.st_size;
+    size_t map_size;
+    unsigned char *map = mapFile(file, &map_size);
+    unsigned long long chunk = ((size + stripes - 1) / stripes + 4095) & ~4095ULL;
+    stcp_stripe_job jobs[STCP_MAX_STRIPES];
+    pthread_t threads[STCP_MAX_STRIPES];
+    int failed = 0;
+
+    logLog(LOG_INIT, "Sending %s in %d stripes of up to %llu bytes", filename, stripes, chunk);
+    for (int i = 0; i < stripes; i++) {
+        stcp_stripe_job *job = &jobs[i];
+        job->destination = destination;
+        job->sendersPort = sendersPort + 2 * i;
+        job->receiversPort = receiversPort + 2 * i;
+        job->file = file;
+        job->map = map;
+        job->stripe.index = i;
+        job->stripe.count = stripes;
+        job->stripe.offset = i * chunk < size ? i * chunk : size;
+        job->stripe.length = size - job->stripe.offset < chunk ? size - job->stripe.offset : chunk;
+        job->stripe.file_size = size;
+        job->ok = 0;
+        if (pthread_create(&threads[i], NULL, stripeWorker, job) != 0) {
+            logPerror("pthread_create");
+            stripes = i;
+            failed = 1;
+        }
+    }
+    for (int i = 0; i < stripes; i++) {
+        pthread_join(threads[i], NULL);
+        failed |= !jobs[i].ok;
+    }
+    if (map != NULL)
+        munmap(map, map_size);
+    close(file);
+    return failed;
+}
+
 /*
  * This application is to invoke the send-side functionality.
  */
@@ -592,16 +2085,21 @@ int main(int argc, char **argv) {
     int receiversPort, sendersPort;
     char *filename = NULL;
     int file;
+    unsigned char *map;
+    size_t map_size, map_off = 0;
+    stcp_reader reader;
+    int readahead;
+    unsigned char *data;
     /* You might want to change the size of this buffer to test how your
      * code deals with different packet sizes.
      */
     unsigned char buffer[65535];
     int num_read_bytes;
 
-    logConfig("sender", "init,segment,error,failure");
+    logConfig("sender", "init,segment,error,failure,stats");
     /* Verify that the arguments are right */
-    if (argc > 5 || argc == 1) {
-        fprintf(stderr, "usage: sender DestinationIPAddress/Name receiveDataOnPort sendDataToPort filename\n");
+    if (argc == 1) {
+        fprintf(stderr, "usage: sender DestinationIPAddress/Name receiveDataOnPort sendDataToPort filename [filename...]\n");
         fprintf(stderr, "or   : sender filename\n");
         exit(1);
     }
@@ -614,8 +2112,15 @@ int main(int argc, char **argv) {
     destinationHost = argc > 1 ? argv[1] : "localhost";
     receiversPort = argc > 2 ? atoi(argv[2]) : getDefaultPort();
     sendersPort = argc > 3 ? atoi(argv[3]) : getDefaultPort() + 1;
+    if (argc > 5)
+        return sendFiles(destinationHost, receiversPort, sendersPort, argv + 4, argc - 4);
     if (argc > 4) filename = argv[4];
 
+    /* STCP_STRIPES > 1 splits the file over that many connections */
+    int stripes = min(STCP_MAX_STRIPES, stcpEnvInt("STCP_STRIPES", 1));
+    if (stripes > 1 && filename != NULL)
+        return sendStriped(destinationHost, receiversPort, sendersPort, filename, stripes);
+
     /* Open file for transfer */
     file = open(filename, O_RDONLY);
     if (file < 0) {
@@ -635,18 +2140,40 @@ int main(int argc, char **argv) {
         exit(1);
     }
 
+    /* Send the file in place if it can be mapped, otherwise read it, from
+     * a thread that keeps STCP_READAHEAD chunks ahead if it can */
+    map = mapFile(file, &map_size);
+    if (map != NULL && stcpZeroCopy(cb) < 0) {
+        munmap(map, map_size);
+        map = NULL;
+    }
+    readahead = map == NULL ? stcpEnvInt("STCP_READAHEAD", 4) : 0;
+    if (readahead > 0 && readerStart(&reader, file, readahead + 1, sizeof(buffer)) < 0)
+        readahead = 0;
+
     /* Start to send data in file via STCP to remote receiver. Chop up
      * the file into pieces as large as max packet size and transmit
      * those pieces.
      */
     while (1) {
-        num_read_bytes = read(file, buffer, sizeof(buffer));
+        if (map != NULL) {
+            num_read_bytes = map_size - map_off < STCP_MAP_CHUNK ? map_size - map_off : STCP_MAP_CHUNK;
+            data = map + map_off;
+            map_off += num_read_bytes;
+        } else if (readahead > 0) {
+            num_read_bytes = readerNext(&reader, &data);
+        } else {
+            num_read_bytes = read(file, buffer, sizeof(buffer));
+            data = buffer;
+        }
 
         /* Break when EOF is reached */
+        if (num_read_bytes < 0)
+            logPerror(filename);
         if (num_read_bytes <= 0)
             break;
 
-        if (stcp_send(cb, buffer, num_read_bytes) == STCP_ERROR) {
+        if (stcp_send(cb, data, num_read_bytes) == STCP_ERROR) {
             /* YOUR CODE HERE */
             logPerror("Failed to send data");
             close(file);
@@ -662,6 +2189,10 @@ int main(int argc, char **argv) {
         exit(1);
     }
 
+    if (map != NULL)
+        munmap(map, map_size);
+    if (readahead > 0)
+        readerStop(&reader);
     close(file);
     return 0;
 }
\ No newline at end of file
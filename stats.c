@@ -0,0 +1,283 @@
+/*
+ * Per-connection performance counters and their export, see stats.h.
+ */
+
+#include <limits.h>
+#include <pthread.h>
+#include <stdarg.h>
+#include <stddef.h>
+#include <stdio.h>
+#include <stdlib.h>
+#include <string.h>
+
+#include "stcp.h"
+#include "stats.h"
+
+#define STATS_INTERVAL 1000     /* default STCP_STATS_INTERVAL, milliseconds */
+
+/*
+ * Export configuration, read from the environment once, and the latest
+ * copy of every connection published to the Prometheus file.  Stripes
+ * publish from their own threads, so all of it is under statsLock.
+ */
+static pthread_once_t statsOnce = PTHREAD_ONCE_INIT;
+static pthread_mutex_t statsLock = PTHREAD_MUTEX_INITIALIZER;
+static FILE *statsSink;         /* JSON lines, NULL if off */
+static char *statsPromPath;     /* NULL if off */
+static int statsInterval;
+
+static const stcp_stats **statsOwners;
+static stcp_stats *statsCopies;
+static int statsCount;
+static int statsCap;
+
+static void statsConfig(void) {
+    char *path = getenv("STCP_STATS");
+    if (path != NULL && *path != '\0') {
+        statsSink = strcmp(path, "-") == 0 ? stdout : fopen(path, "a");
+        if (statsSink == NULL)
+            logPerror(path);
+    }
+    path = getenv("STCP_STATS_PROM");
+    if (path != NULL && *path != '\0')
+        statsPromPath = path;
+    statsInterval = stcpEnvInt("STCP_STATS_INTERVAL", STATS_INTERVAL);
+}
+
+/* Copy a label value, replacing what the text formats would have to escape */
+static void statsLabel(char *dst, int size, const char *src) {
+    int i;
+    for (i = 0; i < size - 1 && src[i] != '\0'; i++)
+        dst[i] = (src[i] == '"' || src[i] == '\\' || src[i] < ' ') ? '_' : src[i];
+    dst[i] = '\0';
+}
+
+void statsInit(stcp_stats *st, const char *local, const char *remote, unsigned long now) {
+    pthread_once(&statsOnce, statsConfig);
+    memset(st, 0, sizeof(*st));
+    statsLabel(st->local, sizeof(st->local), local);
+    statsLabel(st->remote, sizeof(st->remote), remote);
+    st->start = now;
+    if ((statsSink != NULL || statsPromPath != NULL) && statsInterval > 0)
+        st->next_report = now + statsInterval * 1000UL;
+}
+
+/* Record one round-trip measurement, in microseconds */
+void statsRtt(stcp_stats *st, long rtt) {
+    unsigned long long us = rtt > 0 ? rtt : 0;
+    int bucket = 0;
+    if (us >> STATS_RTT_SHIFT)
+        bucket = 64 - __builtin_clzll(us >> STATS_RTT_SHIFT);
+    if (bucket >= STATS_RTT_BUCKETS)
+        bucket = STATS_RTT_BUCKETS - 1;
+    st->rtt_hist[bucket]++;
+    if (st->rtt_samples == 0 || us < st->rtt_min)
+        st->rtt_min = us;
+    if (us > st->rtt_max)
+        st->rtt_max = us;
+    st->rtt_sum += us;
+    st->rtt_samples++;
+}
+
+/* Bytes acknowledged per second since the connection started */
+static double statsGoodput(const stcp_stats *st, unsigned long now) {
+    return now > st->start ? st->bytes_acked * 1e6 / (now - st->start) : 0;
+}
+
+/* snprintf at pos in buf, returning the new end, which stays below size */
+static int statsAppend(char *buf, int size, int pos, const char *format, ...) {
+    va_list args;
+    va_start(args, format);
+    int n = vsnprintf(buf + pos, size - pos, format, args);
+    va_end(args);
+    if (n < 0)
+        return pos;
+    return pos + n < size ? pos + n : size - 1;
+}
+
+/*
+ * Render the stats as one line of JSON in buf, which holds size bytes.
+ * The histogram lists the non-empty buckets by their upper bound in
+ * microseconds.  Returns the length, truncated to fit.
+ */
+int statsJson(const stcp_stats *st, unsigned long now, int final, char *buf, int size) {
+    int pos = 0;
+    buf[0] = '\0';
+    pos = statsAppend(buf, size, pos,
+        "{\"local\":\"%s\",\"remote\":\"%s\",\"final\":%s,\"elapsed_us\":%lu,"
+        "\"bytes_sent\":%llu,\"bytes_retransmitted\":%llu,\"bytes_acked\":%llu,\"goodput_bps\":%.0f,"
+        "\"segments_sent\":%llu,\"retransmits\":%llu,\"fast_retransmits\":%llu,\"timeouts\":%llu,"
+        "\"acks\":%llu,\"dup_acks\":%llu,\"checksum_errors\":%llu,",
+        st->local, st->remote, final ? "true" : "false", now - st->start,
+        st->bytes_sent, st->bytes_retransmitted, st->bytes_acked, statsGoodput(st, now),
+        st->segments_sent, st->retransmits, st->fast_retransmits, st->timeouts,
+        st->acks, st->dup_acks, st->checksum_errors);
+    pos = statsAppend(buf, size, pos,
+        "\"cwnd\":%llu,\"ssthresh\":%llu,\"mss\":%llu,\"srtt_us\":%llu,\"rttvar_us\":%llu,\"rto_ms\":%llu,"
+        "\"rtt_samples\":%llu,\"rtt_min_us\":%llu,\"rtt_avg_us\":%llu,\"rtt_max_us\":%llu,\"rtt_hist_us\":{",
+        st->cwnd, st->ssthresh, st->mss, st->srtt, st->rttvar, st->rto,
+        st->rtt_samples, st->rtt_min, st->rtt_samples ? st->rtt_sum / st->rtt_samples : 0, st->rtt_max);
+    const char *sep = "";
+    for (int i = 0; i < STATS_RTT_BUCKETS; i++) {
+        if (st->rtt_hist[i] == 0)
+            continue;
+        if (i < STATS_RTT_BUCKETS - 1)
+            pos = statsAppend(buf, size, pos, "%s\"%lu\":%llu", sep, STATS_RTT_BOUND(i), st->rtt_hist[i]);
+        else
+            pos = statsAppend(buf, size, pos, "%s\"+Inf\":%llu", sep, st->rtt_hist[i]);
+        sep = ",";
+    }
+    return statsAppend(buf, size, pos, "}}");
+}
+
+/*
+ * The Prometheus metrics taken straight from a field.  Counters print as
+ * integers; fields with a scale other than 1 are converted to base units.
+ */
+typedef struct stats_metric {
+    const char *name;
+    const char *type;
+    const char *help;
+    size_t offset;
+    double scale;
+} stats_metric;
+
+#define STATS_FIELD(f) offsetof(stcp_stats, f)
+
+static const stats_metric statsMetrics[] = {
+    { "stcp_sent_bytes_total", "counter", "Data bytes sent, retransmissions excluded", STATS_FIELD(bytes_sent), 1 },
+    { "stcp_retransmitted_bytes_total", "counter", "Data bytes sent again", STATS_FIELD(bytes_retransmitted), 1 },
+    { "stcp_acked_bytes_total", "counter", "Sequence space acknowledged by the peer", STATS_FIELD(bytes_acked), 1 },
+    { "stcp_segments_sent_total", "counter", "Data segments sent, retransmissions excluded", STATS_FIELD(segments_sent), 1 },
+    { "stcp_retransmits_total", "counter", "Segments sent again, for any reason", STATS_FIELD(retransmits), 1 },
+    { "stcp_fast_retransmits_total", "counter", "Retransmissions on the third duplicate ACK", STATS_FIELD(fast_retransmits), 1 },
+    { "stcp_timeouts_total", "counter", "Retransmission timeouts", STATS_FIELD(timeouts), 1 },
+    { "stcp_acks_total", "counter", "ACKs processed", STATS_FIELD(acks), 1 },
+    { "stcp_dup_acks_total", "counter", "Duplicate ACKs", STATS_FIELD(dup_acks), 1 },
+    { "stcp_checksum_errors_total", "counter", "Received segments dropped for a bad checksum", STATS_FIELD(checksum_errors), 1 },
+    { "stcp_cwnd_bytes", "gauge", "Congestion window", STATS_FIELD(cwnd), 1 },
+    { "stcp_ssthresh_bytes", "gauge", "Slow start threshold", STATS_FIELD(ssthresh), 1 },
+    { "stcp_mss_bytes", "gauge", "Payload bytes per segment", STATS_FIELD(mss), 1 },
+    { "stcp_srtt_seconds", "gauge", "Smoothed round-trip time", STATS_FIELD(srtt), 1e-6 },
+    { "stcp_rttvar_seconds", "gauge", "Round-trip time variation", STATS_FIELD(rttvar), 1e-6 },
+    { "stcp_rto_seconds", "gauge", "Retransmission timeout", STATS_FIELD(rto), 1e-3 },
+};
+
+static void statsPromHeader(FILE *f, const char *name, const char *type, const char *help) {
+    fprintf(f, "# HELP %s %s\n# TYPE %s %s\n", name, help, name, type);
+}
+
+/* Write count connections' stats in the Prometheus text format */
+void statsPrometheus(FILE *f, const stcp_stats *all, int count, unsigned long now) {
+    for (size_t m = 0; m < sizeof(statsMetrics) / sizeof(statsMetrics[0]); m++) {
+        const stats_metric *metric = &statsMetrics[m];
+        statsPromHeader(f, metric->name, metric->type, metric->help);
+        for (int c = 0; c < count; c++) {
+            unsigned long long value = *(const unsigned long long *)((const char *)&all[c] + metric->offset);
+            fprintf(f, "%s{local=\"%s\",remote=\"%s\"} ", metric->name, all[c].local, all[c].remote);
+            if (metric->scale == 1)
+                fprintf(f, "%llu\n", value);
+            else
+                fprintf(f, "%g\n", value * metric->scale);
+        }
+    }
+
+    statsPromHeader(f, "stcp_goodput_bytes_per_second", "gauge", "Bytes acknowledged per second since the connection started");
+    for (int c = 0; c < count; c++)
+        fprintf(f, "stcp_goodput_bytes_per_second{local=\"%s\",remote=\"%s\"} %.0f\n",
+                all[c].local, all[c].remote, statsGoodput(&all[c], now));
+
+    statsPromHeader(f, "stcp_rtt_seconds", "histogram", "Round-trip time samples");
+    for (int c = 0; c < count; c++) {
+        const stcp_stats *st = &all[c];
+        unsigned long long cumulative = 0;
+        for (int i = 0; i < STATS_RTT_BUCKETS - 1; i++) {
+            cumulative += st->rtt_hist[i];
+            fprintf(f, "stcp_rtt_seconds_bucket{local=\"%s\",remote=\"%s\",le=\"%.7g\"} %llu\n",
+                    st->local, st->remote, STATS_RTT_BOUND(i) * 1e-6, cumulative);
+        }
+        fprintf(f, "stcp_rtt_seconds_bucket{local=\"%s\",remote=\"%s\",le=\"+Inf\"} %llu\n",
+                st->local, st->remote, st->rtt_samples);
+        fprintf(f, "stcp_rtt_seconds_sum{local=\"%s\",remote=\"%s\"} %g\n", st->local, st->remote, st->rtt_sum * 1e-6);
+        fprintf(f, "stcp_rtt_seconds_count{local=\"%s\",remote=\"%s\"} %llu\n", st->local, st->remote, st->rtt_samples);
+    }
+}
+
+/*
+ * Keep the latest copy of st for the Prometheus file.  Returns the number
+ * of copies to write, or -1 on error.
+ */
+static int statsRegister(stcp_stats *st) {
+    int i;
+    for (i = 0; i < statsCount && statsOwners[i] != st; i++)
+        ;
+    if (i == statsCount) {
+        if (statsCount == statsCap) {
+            int cap = statsCap ? 2 * statsCap : 8;
+            const stcp_stats **owners = realloc(statsOwners, cap * sizeof(*owners));
+            if (owners == NULL)
+                return -1;
+            statsOwners = owners;
+            stcp_stats *copies = realloc(statsCopies, cap * sizeof(*copies));
+            if (copies == NULL)
+                return -1;
+            statsCopies = copies;
+            statsCap = cap;
+        }
+        statsOwners[statsCount++] = st;
+    }
+    statsCopies[i] = *st;
+    return statsCount;
+}
+
+static void statsUnregister(stcp_stats *st) {
+    for (int i = 0; i < statsCount; i++) {
+        if (statsOwners[i] == st) {
+            statsCount--;
+            statsOwners[i] = statsOwners[statsCount];
+            statsCopies[i] = statsCopies[statsCount];
+            return;
+        }
+    }
+}
+
+/* Rewrite the Prometheus file through a temporary, so readers never see half of it */
+static void statsWriteProm(unsigned long now) {
+    char tmp[PATH_MAX];
+    snprintf(tmp, sizeof(tmp), "%s.tmp", statsPromPath);
+    FILE *f = fopen(tmp, "w");
+    if (f == NULL) {
+        logPerror(tmp);
+        return;
+    }
+    statsPrometheus(f, statsCopies, statsCount, now);
+    if (fclose(f) != 0 || rename(tmp, statsPromPath) < 0)
+        logPerror(statsPromPath);
+}
+
+/*
+ * Export st, which the owner has just refreshed: a JSON line to the
+ * STCP_STATS sink and a new STCP_STATS_PROM file.  final is set as the
+ * connection goes away, and it then leaves the Prometheus file on the
+ * next rewrite.  Schedules the next periodic report.
+ */
+void statsPublish(stcp_stats *st, unsigned long now, int final) {
+    if (st->next_report != 0)
+        st->next_report = now + statsInterval * 1000UL;
+    if (statsSink == NULL && statsPromPath == NULL)
+        return;
+
+    pthread_mutex_lock(&statsLock);
+    if (statsSink != NULL) {
+        char line[2048];
+        statsJson(st, now, final, line, sizeof(line));
+        fprintf(statsSink, "%s\n", line);
+        fflush(statsSink);
+    }
+    if (statsPromPath != NULL && statsRegister(st) >= 0) {
+        statsWriteProm(now);
+        if (final)
+            statsUnregister(st);
+    }
+    pthread_mutex_unlock(&statsLock);
+}
@@ -0,0 +1,68 @@
+#ifndef __STATS_H__
+#define __STATS_H__
+
+/*
+ * Per-connection performance counters.
+ *
+ * The sender keeps a stcp_stats in each control block and bumps its
+ * counters where segments are sent, acknowledged, lost and timed; the
+ * state snapshot at the end (window, RTT estimators) is refreshed by the
+ * owner before the stats are read or published.  Counters are plain
+ * integers touched only by the connection's own thread.
+ *
+ * statsPublish() exports a copy: a JSON line to the STCP_STATS sink, and
+ * the whole process's connections in the Prometheus text format to the
+ * STCP_STATS_PROM file, rewritten each time.  The sender publishes every
+ * STCP_STATS_INTERVAL milliseconds while the connection makes progress,
+ * and once more as it is freed.
+ *
+ * RTT samples also go into a histogram on a log2 scale: bucket i counts
+ * the samples below STATS_RTT_BOUND(i) microseconds that did not fit a
+ * lower bucket, and the last bucket takes everything else.
+ */
+
+#include <stdio.h>
+
+#define STATS_RTT_BUCKETS 20
+#define STATS_RTT_SHIFT 7                               /* first bound 128 us */
+#define STATS_RTT_BOUND(i) (1UL << ((i) + STATS_RTT_SHIFT))
+
+typedef struct stcp_stats {
+    char local[16];             /* labels: our port, the peer's host:port */
+    char remote[80];
+    unsigned long start;        /* microseconds, get_current_time() clock */
+    unsigned long next_report;  /* when to publish next, 0 if not periodically */
+
+    unsigned long long bytes_sent;          /* data, first transmissions only */
+    unsigned long long bytes_retransmitted;
+    unsigned long long bytes_acked;         /* sequence space acknowledged */
+    unsigned long long segments_sent;
+    unsigned long long retransmits;         /* segments sent again, for any reason */
+    unsigned long long fast_retransmits;
+    unsigned long long timeouts;
+    unsigned long long acks;
+    unsigned long long dup_acks;
+    unsigned long long checksum_errors;
+
+    unsigned long long rtt_samples;
+    unsigned long long rtt_sum;             /* microseconds */
+    unsigned long long rtt_min;
+    unsigned long long rtt_max;
+    unsigned long long rtt_hist[STATS_RTT_BUCKETS];
+
+    /* Snapshot of the connection, refreshed by the owner */
+    unsigned long long cwnd;
+    unsigned long long ssthresh;
+    unsigned long long mss;
+    unsigned long long srtt;                /* microseconds */
+    unsigned long long rttvar;
+    unsigned long long rto;                 /* milliseconds */
+} stcp_stats;
+
+extern void statsInit(stcp_stats *st, const char *local, const char *remote, unsigned long now);
+extern void statsRtt(stcp_stats *st, long rtt);
+extern int statsJson(const stcp_stats *st, unsigned long now, int final, char *buf, int size);
+extern void statsPrometheus(FILE *f, const stcp_stats *all, int count, unsigned long now);
+extern void statsPublish(stcp_stats *st, unsigned long now, int final);
+
+#endif
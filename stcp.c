@@ -5,6 +5,7 @@
  * Version 1.0
  */
 
+#define _GNU_SOURCE
 #include <unistd.h>
 #include <stdio.h>
 #include <stdlib.h>
@@ -14,92 +15,219 @@
 #include <sys/types.h>
 #include <sys/time.h>
 #include <fcntl.h>
+#include <poll.h>
 #include <sys/socket.h>
 #include <netinet/in.h>
+#include <netinet/udp.h>
 #include <arpa/inet.h>
 
 #include "stcp.h"
+#include "uring.h"
 
+#if defined(__linux__) && defined(UDP_SEGMENT) && defined(UDP_GRO)
+#define STCP_HAVE_OFFLOAD 1
+#endif
 
 /*
  * Convert a DNS name or numeric IP address into an integer value
  * (in network byte order).  This is more general-purpose than
- * inet_addr() which maps dotted pair notation to uint.
+ * inet_addr() which maps dotted pair notation to uint.  getaddrinfo()
+ * is used so that several threads can open connections at once.
  */
 unsigned int hostname_to_ipaddr(const char *s) {
     if (isdigit(*s)) {
         return (unsigned int)inet_addr(s);
     } else {
-        struct hostent *hp = gethostbyname(s);
-        if (hp == 0) {
+        struct addrinfo hints = { .ai_family = AF_INET, .ai_socktype = SOCK_DGRAM };
+        struct addrinfo *res;
+        if (getaddrinfo(s, NULL, &hints, &res) != 0) {
             /* Error */
             return 0;
-        } 
-        return *((unsigned int **)hp->h_addr_list)[0];
+        }
+        unsigned int addr = ((struct sockaddr_in *)res->ai_addr)->sin_addr.s_addr;
+        freeaddrinfo(res);
+        return addr;
     }
 }
 
+/* What dump() logs: the header, in host byte order, and where it went */
+typedef struct dump_record {
+    tcpheader hdr;
+    int len;
+    char dir;
+} dump_record;
+
+static void dumpFormat(char *buf, int size, const void *data, int len) {
+    dump_record rec;
+    char hdrString[TCP_HDR_STRLEN];
+    memcpy(&rec, data, sizeof(rec));
+    snprintf(buf, size, "%c %s payload %d bytes", rec.dir, tcpHdrToString(&rec.hdr, hdrString, sizeof(hdrString)),
+             rec.len - (int)sizeof(tcpheader));
+}
+
 /*
  * Print an STCP packet to standard output. dir is either 's'ent or
- * 'r'eceived packet
+ * 'r'eceived packet.  Only the header is copied here; it is formatted
+ * when the log is written (see logRecord()).
  */
 void dump(char dir, void *pkt, int len) {
-    tcpheader *stcpHeader = (tcpheader *) pkt;
-    // printf("sender dump(): %c %s payload %lu bytes\n", dir, tcpHdrToString(stcpHeader), len - sizeof(tcpheader));
-    logLog("packet", "%c %s payload %d bytes", dir, tcpHdrToString(stcpHeader), len - sizeof(tcpheader));
-    fflush(stdout);
+    dump_record rec;
+    if (!logEnabled(LOG_PACKET))
+        return;
+    memcpy(&rec.hdr, pkt, sizeof(tcpheader));
+    rec.len = len;
+    rec.dir = dir;
+    logRecord(LOG_PACKET, dumpFormat, &rec, sizeof(rec));
 }
 
-// Compute Internet Checksum for "len" bytes beginning at location "data".
-unsigned short ipchecksum(void *data, int len) {
-    register int sum = 0;
+static void put64(unsigned char *buf, unsigned long long value) {
+    for (int i = 7; i >= 0; i--, value >>= 8)
+        buf[i] = value & 0xff;
+}
 
-    while (len > 1)  {
-        sum += * (unsigned short *) data;
-        data += 2;
-        len -= 2;
-    }
+static unsigned long long get64(const unsigned char *buf) {
+    unsigned long long value = 0;
+    for (int i = 0; i < 8; i++)
+        value = value << 8 | buf[i];
+    return value;
+}
 
-    /*  Add left-over byte, if any */
-    if (len > 0) {
-        sum += * (unsigned char *) data;
-    }
-    /*  Fold 32-bit sum to 16 bits */
-    while (sum >> 16) {
-        sum = (sum & 0xffff) + (sum >> 16);
-    }
-    return ~sum;
+/* Write the header for a stripe into buf.  Returns STCP_STRIPE_HDRLEN. */
+int stripeEncode(unsigned char *buf, const stcp_stripe *stripe) {
+    put64(buf, (unsigned long long)STCP_STRIPE_MAGIC << 32 | stripe->index << 16 | stripe->count);
+    put64(buf + 8, stripe->offset);
+    put64(buf + 16, stripe->length);
+    put64(buf + 24, stripe->file_size);
+    return STCP_STRIPE_HDRLEN;
+}
+
+/*
+ * Parse a stripe header from the first len bytes of buf.  Returns
+ * STCP_STRIPE_HDRLEN, or -1 if there is no valid header.
+ */
+int stripeDecode(const unsigned char *buf, int len, stcp_stripe *stripe) {
+    if (len < STCP_STRIPE_HDRLEN)
+        return -1;
+    unsigned long long first = get64(buf);
+    if (first >> 32 != STCP_STRIPE_MAGIC)
+        return -1;
+    stripe->index = (first >> 16) & 0xffff;
+    stripe->count = first & 0xffff;
+    stripe->offset = get64(buf + 8);
+    stripe->length = get64(buf + 16);
+    stripe->file_size = get64(buf + 24);
+    if (stripe->index >= stripe->count || stripe->offset + stripe->length > stripe->file_size)
+        return -1;
+    return STCP_STRIPE_HDRLEN;
 }
 
 /*
  * Helper function to prepare an STCP segment for sending.  Initializes all
- * the fields of the header except the checksum.
+ * the fields of the header except the checksum.  The payload is copied in
+ * after the header; it must fit in STCP_MTU.
  */
 void createSegment(packet *pkt, int flags, unsigned short rwnd, unsigned int seq, unsigned int ack, unsigned char *data, int len) {
-    initPacket(pkt, data, len + sizeof(tcpheader));
-    tcpheader *hdr = pkt->hdr;
+    initPacket(pkt, NULL, 0);
+    pkt->len = writeSegment(pkt->data, flags, rwnd, seq, ack, NULL, data, len);
+}
+
+/*
+ * Build an STCP segment directly in buf, which must hold at least
+ * sizeof(tcpheader) + TCP_MAX_OPTLEN + len bytes.  Like createSegment()
+ * the header is left in host byte order with a zero checksum.  opts may
+ * be NULL.  Returns the segment length.
+ */
+int writeSegment(unsigned char *buf, int flags, unsigned short rwnd, unsigned int seq, unsigned int ack, const tcpoptions *opts, unsigned char *data, int len) {
+    tcpheader *hdr = (tcpheader *)buf;
+    int optlen = opts != NULL ? tcpWriteOptions(buf + sizeof(tcpheader), opts) : 0;
     hdr->srcPort = 0;
     hdr->dstPort = 0;
     hdr->seqNo = seq;
     hdr->ackNo = ack;
+    hdr->dataOffset = 5 + optlen / 4;
+    hdr->flags = flags;
     hdr->windowSize = rwnd;
-    hdr->flags = (5 << 12) | flags;
     hdr->checksum = 0;
+    hdr->urgentPointer = 0;
+    if (len > 0) memcpy(buf + sizeof(tcpheader) + optlen, data, len);
+    return sizeof(tcpheader) + optlen + len;
 }
 
+/*
+ * Write the header and options of a segment into buf in network byte
+ * order and return their length, leaving the checksum as the running sum
+ * of the header.
+ */
+static int segmentHeader(unsigned char *buf, int flags, unsigned short rwnd, unsigned int seq, unsigned int ack, const tcpoptions *opts, unsigned long long *sum) {
+    int hdrlen = writeSegment(buf, flags, rwnd, seq, ack, opts, NULL, 0);
+    htonHdr((tcpheader *)buf);
+    *sum = cksumAdd(0, buf, hdrlen);
+    return hdrlen;
+}
 
+/*
+ * Build a segment ready for the wire in buf: header and options in network
+ * byte order, then the payload, copied and checksummed in the same pass so
+ * it is read only once.  buf must hold sizeof(tcpheader) + TCP_MAX_OPTLEN +
+ * len bytes.  Returns the segment length.
+ */
+int buildSegment(unsigned char *buf, int flags, unsigned short rwnd, unsigned int seq, unsigned int ack, const tcpoptions *opts, const unsigned char *data, int len) {
+    unsigned long long sum;
+    int hdrlen = segmentHeader(buf, flags, rwnd, seq, ack, opts, &sum);
+    if (len > 0)
+        sum = cksumCopy(sum, buf + hdrlen, data, len);
+    ((tcpheader *)buf)->checksum = cksumFinish(sum);
+    return hdrlen + len;
+}
 
 /*
- * Helper function to read a STCP packet from the network.
+ * Build only the header of a segment whose len byte payload at data is
+ * sent from where it is (see txqQueueParts()); the checksum covers both.
+ * Returns the header length.
+ */
+int buildHeader(unsigned char *buf, int flags, unsigned short rwnd, unsigned int seq, unsigned int ack, const tcpoptions *opts, const unsigned char *data, int len) {
+    unsigned long long sum;
+    int hdrlen = segmentHeader(buf, flags, rwnd, seq, ack, opts, &sum);
+    ((tcpheader *)buf)->checksum = cksumFinish(cksumAdd(sum, data, len));
+    return hdrlen;
+}
+
+/*
+ * Replace a 32-bit header field (seqNo or ackNo) of a segment built by
+ * buildSegment() with value, given in host byte order, and patch the
+ * checksum to match (RFC 1624) instead of summing the segment again.
+ */
+void segmentUpdate32(unsigned char *seg, unsigned int *field, unsigned int value) {
+    tcpheader *hdr = (tcpheader *)seg;
+    unsigned int old = *field;
+    *field = htonl(value);
+    hdr->checksum = cksumUpdate32(hdr->checksum, old, *field);
+}
+
+/* dump() a segment whose header is in network byte order */
+void dumpWire(char dir, void *seg, int len) {
+    if (!logEnabled(LOG_PACKET))
+        return;
+    unsigned char hdr[sizeof(tcpheader)];
+    memcpy(hdr, seg, sizeof(hdr));
+    ntohHdr((tcpheader *)hdr);
+    dump(dir, hdr, len);
+}
+
+/*
+ * Helper function to read a STCP packet from the network without
+ * blocking.  Returns STCP_READ_TIMED_OUT if there is none.
  * As a side effect print the packet header to standard output.
  */
 static int readpkt(int fd, void *pkt, int len) {
-    int cc = recv(fd, pkt, len, 0);
+    int cc = recv(fd, pkt, len, MSG_DONTWAIT);
     if (cc > 0) {
         tcpheader *hdr = (tcpheader *)pkt;
         ntohHdr(hdr);
         dump('r', pkt, cc);
         htonHdr(hdr);
+    } else if (cc < 0 && (errno == EAGAIN || errno == EWOULDBLOCK)) {
+        return STCP_READ_TIMED_OUT;
     } else {
         logPerror("readpkt");
         if (errno == ECONNREFUSED) return STCP_READ_PERMANENT_FAILURE;
@@ -107,6 +235,16 @@ static int readpkt(int fd, void *pkt, int len) {
     return cc;
 }
 
+/*
+ * Wait up to ms milliseconds for fd to become readable (or report an
+ * error).  poll() is used rather than select() so that any descriptor
+ * number works.  Returns 1 if it did, 0 otherwise.
+ */
+static int waitReadable(int fd, int ms) {
+    struct pollfd pfd = { .fd = fd, .events = POLLIN };
+    return poll(&pfd, 1, ms) > 0 && pfd.revents != 0;
+}
+
 /*
  * Read a packet from the network or timeout if no packet is received within ms milliseconds.
  * Returns:
@@ -115,26 +253,369 @@ static int readpkt(int fd, void *pkt, int len) {
  *   STCP_READ_PERMANENT_FAILURE if reads will never work again (socket closed)
  */
 int readWithTimeout(int fd, unsigned char *pkt, int ms) {
-    int s;
-    fd_set fds;
-    struct timeval tv;
-  
-    tv.tv_sec = ms / 1000;
-    tv.tv_usec = (ms - tv.tv_sec * 1000) * 1000;
-  
-    FD_ZERO(&fds);
-    FD_SET(fd, &fds);
-    s = select(fd + 1, &fds, 0, 0, &tv);
-    if (s > 0 && FD_ISSET(fd, &fds)) {
-        int res = readpkt(fd, pkt, STCP_MTU);
-        if (res < 0) {
-            logPerror("readWithTimeout");
-            return errno == ECONNREFUSED ? STCP_READ_PERMANENT_FAILURE :  STCP_READ_TIMED_OUT;
+    /* A packet that is already waiting costs no extra system call */
+    int res = readpkt(fd, pkt, STCP_MTU);
+    if (res == STCP_READ_TIMED_OUT && ms > 0 && waitReadable(fd, ms))
+        res = readpkt(fd, pkt, STCP_MTU);
+    if (res < 0 && res != STCP_READ_TIMED_OUT) {
+        logPerror("readWithTimeout");
+        return errno == ECONNREFUSED ? STCP_READ_PERMANENT_FAILURE : STCP_READ_TIMED_OUT;
+    }
+    return res;
+}
+
+/*
+ * Return the integer value of environment variable "name", or def if it
+ * is unset or not a number.  Used for run-time tuning knobs.
+ */
+int stcpEnvInt(const char *name, int def) {
+    char *value = getenv(name);
+    char *end;
+    if (value == NULL || *value == '\0')
+        return def;
+    long v = strtol(value, &end, 10);
+    return *end == '\0' ? (int)v : def;
+}
+
+#ifdef STCP_HAVE_OFFLOAD
+/*
+ * Read one (possibly GRO coalesced) datagram into the batch.  The buffers
+ * are contiguous and a super-packet holds at most STCP_GSO_MAX_SEGS
+ * segments of no more than batch->size bytes, so it is received straight
+ * into the first buffer and each segment is then moved to its own, last
+ * first so nothing is overwritten before it has been moved.
+ */
+static int recvGro(int fd, stcp_rxbatch *batch) {
+    char ctrl[CMSG_SPACE(sizeof(int))];
+    struct iovec iov = { batch->buf, (size_t)STCP_BATCH * batch->size };
+    struct msghdr msg;
+    struct cmsghdr *cmsg;
+    int len, seg, n;
+
+    memset(&msg, 0, sizeof(msg));
+    msg.msg_iov = &iov;
+    msg.msg_iovlen = 1;
+    msg.msg_control = ctrl;
+    msg.msg_controllen = sizeof(ctrl);
+    len = recvmsg(fd, &msg, MSG_DONTWAIT);
+    if (len < 0)
+        return -1;
+
+    seg = len;
+    for (cmsg = CMSG_FIRSTHDR(&msg); cmsg != NULL; cmsg = CMSG_NXTHDR(&msg, cmsg))
+        if (cmsg->cmsg_level == SOL_UDP && cmsg->cmsg_type == UDP_GRO)
+            memcpy(&seg, CMSG_DATA(cmsg), sizeof(seg));
+    if (seg <= 0 || seg > batch->size) {
+        /* Segments too large for the buffers: keep the first like recv() */
+        batch->len[0] = min(len, batch->size);
+        return 1;
+    }
+
+    n = (len + seg - 1) / seg;
+    for (int i = n - 1; i >= 0; i--) {
+        batch->len[i] = min(seg, len - i * seg);
+        memmove(rxData(batch, i), batch->buf + (size_t)i * seg, batch->len[i]);
+    }
+    return n;
+}
+#endif
+
+/*
+ * Read every packet already queued on the socket, up to STCP_BATCH, into
+ * batch without blocking.  Returns the number read, or -1 with errno set.
+ * Sets batch->more if there may be more waiting.
+ */
+static int recvBatch(int fd, stcp_rxbatch *batch) {
+    int n;
+
+#ifdef STCP_HAVE_OFFLOAD
+    if (batch->gro) {
+        /* One super-packet per call: its size is not known in advance */
+        n = recvGro(fd, batch);
+        batch->more = n > 0;
+        return n;
+    }
+#endif
+
+#ifdef __linux__
+    struct mmsghdr msgs[STCP_BATCH];
+    struct iovec iov[STCP_BATCH];
+    memset(msgs, 0, sizeof(msgs));
+    for (int i = 0; i < STCP_BATCH; i++) {
+        iov[i].iov_base = rxData(batch, i);
+        iov[i].iov_len = batch->size;
+        msgs[i].msg_hdr.msg_iov = &iov[i];
+        msgs[i].msg_hdr.msg_iovlen = 1;
+    }
+    n = recvmmsg(fd, msgs, STCP_BATCH, MSG_DONTWAIT, NULL);
+    for (int i = 0; i < n; i++)
+        batch->len[i] = msgs[i].msg_len;
+#else
+    for (n = 0; n < STCP_BATCH; n++) {
+        int cc = recv(fd, rxData(batch, n), batch->size, MSG_DONTWAIT);
+        if (cc < 0)
+            break;
+        batch->len[n] = cc;
+    }
+    if (n == 0)
+        n = -1;
+#endif
+    batch->more = n == STCP_BATCH;
+    return n;
+}
+
+/*
+ * Allocate the buffers of a receive batch, each "size" bytes (the largest
+ * segment expected).  gro says whether the socket has UDP_GRO enabled.
+ * Returns 0, or -1 if the allocation failed.
+ */
+int rxbatchInit(stcp_rxbatch *batch, int size, int gro) {
+    batch->count = 0;
+    batch->more = 0;
+    batch->gro = gro;
+    batch->size = size;
+    batch->buf = malloc((size_t)STCP_BATCH * size);
+    if (batch->buf == NULL) {
+        logPerror("malloc");
+        return -1;
+    }
+    return 0;
+}
+
+void rxbatchFree(stcp_rxbatch *batch) {
+    free(batch->buf);
+    batch->buf = NULL;
+}
+
+/*
+ * Read every packet waiting on the socket (up to STCP_BATCH) with a single
+ * recvmmsg() where available, waiting up to ms milliseconds if there are
+ * none yet.  Each packet is dumped as readpkt() would.  Returns the number
+ * of packets read, or STCP_READ_TIMED_OUT / STCP_READ_PERMANENT_FAILURE
+ * like readWithTimeout().
+ */
+int readBatch(int fd, stcp_rxbatch *batch, int ms) {
+    int n;
+
+    batch->count = 0;
+    batch->more = 0;
+    n = recvBatch(fd, batch);
+    if (n < 0 && (errno == EAGAIN || errno == EWOULDBLOCK) && ms > 0) {
+        if (!waitReadable(fd, ms))
+            return STCP_READ_TIMED_OUT;
+        n = recvBatch(fd, batch);
+    }
+    if (n <= 0) {
+        if (errno == EAGAIN || errno == EWOULDBLOCK)
+            return STCP_READ_TIMED_OUT;
+        logPerror("readBatch");
+        return errno == ECONNREFUSED ? STCP_READ_PERMANENT_FAILURE : STCP_READ_TIMED_OUT;
+    }
+
+    for (int i = 0; i < n; i++) {
+        dumpWire('r', rxData(batch, i), batch->len[i]);
+    }
+    batch->count = n;
+    return n;
+}
+
+void txqInit(stcp_txq *q, int fd, int gso) {
+    q->fd = fd;
+    q->count = 0;
+    q->first[0] = 0;
+    q->gso = gso;
+    q->uring = NULL;
+    q->error = 0;
+}
+
+/*
+ * Queue len bytes at data for transmission as one datagram, flushing
+ * first if the queue is full.  Returns 0, or -1 if a flush failed.
+ */
+int txqQueue(stcp_txq *q, void *data, int len) {
+    return txqQueueParts(q, data, len, NULL, 0);
+}
+
+/*
+ * Queue the hdrlen bytes at hdr followed by the len bytes at payload as
+ * one datagram, without copying either.  Returns 0, or -1 if a flush
+ * failed.
+ */
+int txqQueueParts(stcp_txq *q, void *hdr, int hdrlen, const void *payload, int len) {
+    if (q->count == STCP_BATCH && txqFlush(q) < 0)
+        return -1;
+    int i = q->first[q->count];
+    q->iov[i].iov_base = hdr;
+    q->iov[i++].iov_len = hdrlen;
+    if (len > 0) {
+        q->iov[i].iov_base = (void *)payload;
+        q->iov[i++].iov_len = len;
+    }
+    q->len[q->count++] = hdrlen + len;
+    q->first[q->count] = i;
+    return 0;
+}
+
+#ifdef __linux__
+/*
+ * Fill in one message per queued datagram from index "from" on, or with
+ * GSO one message per run of equal-sized datagrams (the last of a run may
+ * be shorter) carrying a UDP_SEGMENT control message, so the kernel
+ * splits the concatenated iovecs back into datagrams.  start[n] is set to
+ * the first datagram of message n.  Returns the number of messages.
+ */
+static int txqMessages(stcp_txq *q, int from, struct mmsghdr *msgs, char (*ctrl)[CMSG_SPACE(sizeof(uint16_t))], int *start) {
+    int n = 0;
+
+    for (int i = from; i < q->count; n++) {
+        int seg = q->len[i];
+        int j = i + 1;
+
+        memset(&msgs[n], 0, sizeof(msgs[n]));
+        msgs[n].msg_hdr.msg_iov = &q->iov[q->first[i]];
+        start[n] = i;
+#ifdef STCP_HAVE_OFFLOAD
+        size_t bytes = seg;
+        while (q->gso && j < q->count && j - i < STCP_GSO_MAX_SEGS && q->len[j] <= seg &&
+               bytes + q->len[j] <= STCP_MAX_MTU) {
+            bytes += q->len[j];
+            if (q->len[j++] < seg)
+                break;
+        }
+        if (j - i > 1) {
+            struct cmsghdr *cmsg;
+            uint16_t size = seg;
+
+            msgs[n].msg_hdr.msg_control = ctrl[n];
+            msgs[n].msg_hdr.msg_controllen = sizeof(ctrl[n]);
+            cmsg = CMSG_FIRSTHDR(&msgs[n].msg_hdr);
+            cmsg->cmsg_level = SOL_UDP;
+            cmsg->cmsg_type = UDP_SEGMENT;
+            cmsg->cmsg_len = CMSG_LEN(sizeof(size));
+            memcpy(CMSG_DATA(cmsg), &size, sizeof(size));
+        }
+#endif
+        msgs[n].msg_hdr.msg_iovlen = q->first[j] - q->first[i];
+        i = j;
+    }
+    return n;
+}
+#endif
+
+/*
+ * Send every queued datagram, with one sendmmsg() per STCP_BATCH where
+ * available.  Returns 0, or -1 (with errno set) if a send failed; the
+ * queue is emptied either way.  If the kernel rejects a GSO send, GSO is
+ * turned off for this queue and the rest are sent as plain datagrams.
+ */
+int txqFlush(stcp_txq *q) {
+    int sent = 0;
+    int res = 0;
+
+#ifdef STCP_HAVE_URING
+    if (q->uring != NULL)
+        return txqPost(q) < 0 || uringEnter(q->uring, 0) < 0 ? -1 : 0;
+#endif
+#ifdef __linux__
+    struct mmsghdr msgs[STCP_BATCH];
+    char ctrl[STCP_BATCH][CMSG_SPACE(sizeof(uint16_t))];
+    int start[STCP_BATCH];
+    int count = txqMessages(q, 0, msgs, ctrl, start);
+
+    while (sent < count) {
+        int n = sendmmsg(q->fd, msgs + sent, count - sent, 0);
+        if (n < 0 && q->gso && msgs[sent].msg_hdr.msg_controllen > 0 &&
+            (errno == EIO || errno == EINVAL || errno == EOPNOTSUPP)) {
+            logLog(LOG_ERROR, "UDP GSO send failed, disabling segmentation offload");
+            q->gso = 0;
+            count = txqMessages(q, start[sent], msgs, ctrl, start);
+            sent = 0;
+            continue;
+        }
+        if (n < 0) {
+            logPerror("sendmmsg");
+            res = -1;
+            break;
+        }
+        sent += n;
+    }
+#else
+    for (; sent < q->count; sent++) {
+        struct msghdr msg = { 0 };
+        msg.msg_iov = &q->iov[q->first[sent]];
+        msg.msg_iovlen = q->first[sent + 1] - q->first[sent];
+        if (sendmsg(q->fd, &msg, 0) < 0) {
+            logPerror("sendmsg");
+            res = -1;
+            break;
+        }
+    }
+#endif
+    q->count = 0;
+    return res;
+}
+
+/*
+ * Like txqFlush(), but on an io_uring the sends are only prepared, to go
+ * to the kernel with the event loop's next wait and save a system call;
+ * the queued data must then stay valid until that wait.  A ring send that
+ * failed since the last call is reported now, as -1 with errno set.
+ */
+int txqPost(stcp_txq *q) {
+#ifdef STCP_HAVE_URING
+    if (q->uring != NULL) {
+        struct mmsghdr msgs[STCP_BATCH];
+        char ctrl[STCP_BATCH][CMSG_SPACE(sizeof(uint16_t))];
+        int start[STCP_BATCH];
+        int count = txqMessages(q, 0, msgs, ctrl, start);
+        int res = 0;
+
+        for (int i = 0; i < count && res == 0; i++) {
+            if (uringSendmsg(q->uring, q->fd, &msgs[i].msg_hdr, uringTag(q, URING_SEND)) < 0) {
+                logLog(LOG_ERROR, "io_uring submission queue full");
+                errno = ENOBUFS;
+                res = -1;
+            }
+        }
+        q->count = 0;
+        if (q->error != 0) {
+            errno = q->error;
+            q->error = 0;
+            return -1;
         }
         return res;
-    } else {
-        return STCP_READ_TIMED_OUT;
     }
+#endif
+    return txqFlush(q);
+}
+
+/*
+ * A ring send from this queue completed with error err (0: it did not).
+ * A rejected GSO send turns GSO off as in txqFlush(); a full socket buffer
+ * just loses the datagrams; anything else is reported by txqPost().
+ */
+void txqSendFailed(stcp_txq *q, int err) {
+    if (err <= 0 || err == EAGAIN)
+        return;
+    if (q->gso && (err == EIO || err == EINVAL || err == EOPNOTSUPP)) {
+        logLog(LOG_ERROR, "UDP GSO send failed, disabling segmentation offload");
+        q->gso = 0;
+        return;
+    }
+    q->error = err;
+}
+
+/*
+ * Before the queue, or the data it sent, is freed: hand any sends still
+ * on the ring to the kernel and drop completions still to be handled.
+ */
+void txqClose(stcp_txq *q) {
+#ifdef STCP_HAVE_URING
+    if (q->uring != NULL) {
+        uringEnter(q->uring, 0);
+        uringForget(q->uring, uringTag(q, URING_SEND));
+    }
+#endif
 }
 
 /*
@@ -168,7 +649,7 @@ int udp_open(char *remote_IP_str, int remote_port, int local_port) {
     }
 
     /* Bind the local socket to listen at the local_port. */
-    logLog("init", "Binding locally to port %d", local_port);
+    logLog(LOG_INIT, "Binding locally to port %d", local_port);
     memset((char *)&sin, 0, sizeof(sin));
     sin.sin_family = AF_INET;
     sin.sin_port = htons(local_port);
@@ -186,7 +667,7 @@ int udp_open(char *remote_IP_str, int remote_port, int local_port) {
         fprintf(stderr, "Invalid host name: %s\n", remote_IP_str);
         return -4;
     }
-    logLog("init", "Configuring  UDP \"connection\" to <%u.%u.%u.%u, port %d>",
+    logLog(LOG_INIT, "Configuring  UDP \"connection\" to <%u.%u.%u.%u, port %d>",
 	   (ntohl(dst)>>24) & 0xFF, (ntohl(dst)>>16) & 0xFF,
 	   (ntohl(dst)>>8) & 0XFF, ntohl(dst) & 0XFF, remote_port);
 
@@ -198,9 +679,37 @@ int udp_open(char *remote_IP_str, int remote_port, int local_port) {
         logPerror("connect");
         return -1;
     }
-    logLog("init", "UDP \"connection\" to <%u.%u.%u.%u, port %d> configured",
+    logLog(LOG_INIT, "UDP \"connection\" to <%u.%u.%u.%u, port %d> configured",
 	   (ntohl(dst)>>24) & 0xFF, (ntohl(dst)>>16) & 0xFF,
 	   (ntohl(dst)>>8) & 0XFF, ntohl(dst) & 0XFF , remote_port);
 
     return (fd);
 }
+
+/*
+ * Turn on the segmentation offloads in "want" (STCP_OFFLOAD_GSO and/or
+ * STCP_OFFLOAD_GRO) for a socket returned by udp_open().  GSO support is
+ * probed by setting and clearing the socket's default segment size, since
+ * the actual size is given with each send.  Returns the offloads that are
+ * enabled, which is 0 where the kernel or platform has none.
+ */
+int udpSetOffload(int fd, int want) {
+    int enabled = 0;
+
+#ifdef STCP_HAVE_OFFLOAD
+    int on = 1, off = 0, size = STCP_MTU;
+
+    if ((want & STCP_OFFLOAD_GSO) &&
+        setsockopt(fd, SOL_UDP, UDP_SEGMENT, &size, sizeof(size)) == 0 &&
+        setsockopt(fd, SOL_UDP, UDP_SEGMENT, &off, sizeof(off)) == 0)
+        enabled |= STCP_OFFLOAD_GSO;
+    if ((want & STCP_OFFLOAD_GRO) &&
+        setsockopt(fd, SOL_UDP, UDP_GRO, &on, sizeof(on)) == 0)
+        enabled |= STCP_OFFLOAD_GRO;
+#endif
+    if (want)
+        logLog(LOG_INIT, "UDP offload: GSO %s, GRO %s",
+               enabled & STCP_OFFLOAD_GSO ? "on" : "off",
+               enabled & STCP_OFFLOAD_GRO ? "on" : "off");
+    return enabled;
+}
@@ -9,16 +9,19 @@
 #include <string.h>
 #include <stdlib.h>
 #include <sys/socket.h>
+#include <sys/uio.h>
 #include "tcp.h"
+#include "cksum.h"
 #include "log.h"
 
-#define STCP_MAXWIN    65535 
-#define STCP_MTU       300     /* MTU size */
+#define STCP_MAXWIN    65535   /* largest unscaled window */
+#define STCP_MTU       300     /* default MTU, until the peer advertises an MSS */
 #define STCP_MSS       (STCP_MTU - sizeof(tcpheader)) /* MSS Size */
+#define STCP_MAX_MTU   65507   /* largest UDP payload, the limit for STCP_MAX_MTU env */
 #define STCP_READ_TIMED_OUT (-3)
 #define STCP_READ_PERMANENT_FAILURE (-4)
 #define STCP_INITIAL_TIMEOUT 1000
-#define STCP_MIN_TIMEOUT 1000
+#define STCP_MIN_TIMEOUT 200   /* default RTO floor, STCP_MIN_RTO env overrides */
 #define STCP_MAX_TIMEOUT 4000
 #define STCP_INFINITE_TIMEOUT 10000
 #define STCP_TIME_WAIT_DURATION 2000
@@ -44,6 +47,73 @@ typedef struct packet {
     int len;
 } packet;
 
+/*
+ * Batched datagram I/O.  Outgoing segments are queued on a stcp_txq and
+ * handed to the kernel together by txqFlush(); readBatch() returns every
+ * packet already waiting on the socket in one call.  Queued data is not
+ * copied, so it must stay valid until the queue is flushed.  A datagram
+ * may be queued in two parts, a header and a payload that lives elsewhere
+ * (such as a mapped file), which the kernel gathers as it sends.
+ */
+#define STCP_BATCH 64
+
+/*
+ * Optional segmentation offload (Linux UDP_SEGMENT / UDP_GRO), see
+ * udpSetOffload().  With GSO a run of equal-sized queued segments goes to
+ * the kernel as one large send; with GRO a coalesced super-packet is split
+ * back into segments by readBatch().
+ */
+#define STCP_OFFLOAD_GSO 1
+#define STCP_OFFLOAD_GRO 2
+#define STCP_GSO_MAX_SEGS 64      /* kernel limit per GSO send */
+
+struct stcp_uring;
+
+typedef struct stcp_txq {
+    int fd;
+    int count;                    /* datagrams queued */
+    int gso;                      /* coalesce runs with UDP_SEGMENT */
+    struct stcp_uring *uring;     /* send through the event loop's io_uring */
+    int error;                    /* errno of a ring send that failed since txqPost() */
+    int len[STCP_BATCH];          /* bytes in each datagram */
+    int first[STCP_BATCH + 1];    /* iov index of each datagram's first part */
+    struct iovec iov[2 * STCP_BATCH];
+} stcp_txq;
+
+typedef struct stcp_rxbatch {
+    int count;
+    int more;                     /* more packets may be waiting */
+    int gro;                      /* socket has UDP_GRO enabled */
+    int size;                     /* bytes per packet buffer */
+    int len[STCP_BATCH];
+    unsigned char *buf;           /* STCP_BATCH contiguous buffers */
+} stcp_rxbatch;
+
+static inline unsigned char *rxData(stcp_rxbatch *batch, int i) {
+    return batch->buf + (size_t)i * batch->size;
+}
+
+/*
+ * Striped transfers.  A file can be split into byte ranges that are sent
+ * over separate connections at the same time.  Each connection's data
+ * then begins with a stripe header giving the range's place in the file,
+ * so the receiver can write every stream straight to its offset.  On the
+ * wire the header is STCP_STRIPE_HDRLEN bytes, fields big-endian: the
+ * magic number, the stripe index and count (16 bits each), then the
+ * offset, length and file size (64 bits each).
+ */
+#define STCP_STRIPE_MAGIC  0x53545250  /* "STRP" */
+#define STCP_STRIPE_HDRLEN 32
+#define STCP_MAX_STRIPES   64
+
+typedef struct stcp_stripe {
+    unsigned int index;
+    unsigned int count;
+    unsigned long long offset;    /* where the range starts in the file */
+    unsigned long long length;    /* bytes of the file that follow the header */
+    unsigned long long file_size;
+} stcp_stripe;
+
 static inline int payloadSize(packet *pkt) {
     return pkt->len - sizeof(tcpheader);
 }
@@ -57,13 +127,30 @@ static inline void initPacket(packet *pkt, unsigned char *data, int len) {
 /* Declarations for STCP.C */
 
 extern void createSegment(packet *pkt, int flags, unsigned short rwnd, unsigned int seq, unsigned int ack, unsigned char *data, int len);
-void createDataSegment(packet *pkt, int flags, unsigned short rwnd, unsigned int seq, unsigned int ack, unsigned char *data, int len);
+extern int writeSegment(unsigned char *buf, int flags, unsigned short rwnd, unsigned int seq, unsigned int ack, const tcpoptions *opts, unsigned char *data, int len);
+extern int buildHeader(unsigned char *buf, int flags, unsigned short rwnd, unsigned int seq, unsigned int ack, const tcpoptions *opts, const unsigned char *data, int len);
+extern int buildSegment(unsigned char *buf, int flags, unsigned short rwnd, unsigned int seq, unsigned int ack, const tcpoptions *opts, const unsigned char *data, int len);
+extern void segmentUpdate32(unsigned char *seg, unsigned int *field, unsigned int value);
 extern void dump(char dir, void* pkt, int len);
+extern void dumpWire(char dir, void *seg, int len);
 extern unsigned int hostname_to_ipaddr(const char *s);
 extern int readWithTimeout(int fd, unsigned char *pkt, int ms);
-extern unsigned short ipchecksum(void *data, int len);
+extern int rxbatchInit(stcp_rxbatch *batch, int size, int gro);
+extern void rxbatchFree(stcp_rxbatch *batch);
+extern int readBatch(int fd, stcp_rxbatch *batch, int ms);
+extern void txqInit(stcp_txq *q, int fd, int gso);
+extern int txqQueue(stcp_txq *q, void *data, int len);
+extern int txqQueueParts(stcp_txq *q, void *hdr, int hdrlen, const void *payload, int len);
+extern int txqFlush(stcp_txq *q);
+extern int txqPost(stcp_txq *q);
+extern void txqSendFailed(stcp_txq *q, int err);
+extern void txqClose(stcp_txq *q);
 extern int udp_open(char *remote_IP_str, int remote_port, int local_port);
+extern int udpSetOffload(int fd, int want);
 void nonblock(int fd);
+extern int stcpEnvInt(const char *name, int def);
+extern int stripeEncode(unsigned char *buf, const stcp_stripe *stripe);
+extern int stripeDecode(const unsigned char *buf, int len, stcp_stripe *stripe);
 
 #include "wraparound.h"
 
@@ -1,17 +1,17 @@
 #include <arpa/inet.h>
 #include <stdio.h>
+#include <string.h>
 #include "tcp.h"
 
-#define MAXLENGTH 128
-#define NBUFFERS   20
+static inline int min(int a, int b) { return a < b ? a : b; }
 
-char *tcpHdrToString(tcpheader *hdr) {
-    static char buff[NBUFFERS][MAXLENGTH];
-    static int next = 0;
-    char *buf = &buff[next][0];
-    next = (next + 1) % NBUFFERS;
-    
-    snprintf(buf, MAXLENGTH, "%s%s%s%s%d->%d CkSum: 0x%04x Seq: %d (%08x) Ack: %d (%08x) Win: %d",
+/*
+ * Format hdr into buf (size bytes, TCP_HDR_STRLEN is enough) and return
+ * buf.  The caller owns the buffer, so any number of connections can
+ * format headers at once.
+ */
+char *tcpHdrToString(tcpheader *hdr, char *buf, int size) {
+    snprintf(buf, size, "%s%s%s%s%d->%d CkSum: 0x%04x Seq: %d (%08x) Ack: %d (%08x) Win: %d",
 	     getSyn(hdr) ? "SYN " : "", 
 	     getAck(hdr) ? "ACK " : "", 
 	     getFin(hdr) ? "FIN " : "", 
@@ -38,4 +38,110 @@ void htonHdr(tcpheader *hdr) {
     hdr->checksum = htons(hdr->checksum);
     hdr->urgentPointer = htons(hdr->urgentPointer);
 }
-    
+
+static void put32(unsigned char *buf, unsigned int value) {
+    buf[0] = value >> 24;
+    buf[1] = value >> 16;
+    buf[2] = value >> 8;
+    buf[3] = value;
+}
+
+static unsigned int get32(unsigned char *buf) {
+    return (unsigned int)buf[0] << 24 | buf[1] << 16 | buf[2] << 8 | buf[3];
+}
+
+static int putOption16(unsigned char *buf, int kind, unsigned short value) {
+    buf[0] = kind;
+    buf[1] = 4;
+    buf[2] = value >> 8;
+    buf[3] = value & 0xff;
+    return 4;
+}
+
+/*
+ * Encode the options that are set in opts into buf (at least
+ * TCP_MAX_OPTLEN bytes), padded with EOL to a multiple of four.  SACK
+ * blocks come last and only as many as still fit are written.  Returns the
+ * number of bytes written.
+ */
+int tcpWriteOptions(unsigned char *buf, const tcpoptions *opts) {
+    int len = 0;
+
+    if (opts->mss)
+        len += putOption16(buf + len, TCPOPT_MSS, opts->mss);
+    if (opts->has_wscale) {
+        buf[len++] = TCPOPT_NOP;
+        buf[len++] = TCPOPT_WSCALE;
+        buf[len++] = 3;
+        buf[len++] = opts->wscale;
+    }
+    if (opts->probe)
+        len += putOption16(buf + len, TCPOPT_PROBE, opts->probe);
+    if (opts->probe_ack)
+        len += putOption16(buf + len, TCPOPT_PROBE_ACK, opts->probe_ack);
+    if (opts->sack_permitted) {
+        buf[len++] = TCPOPT_NOP;
+        buf[len++] = TCPOPT_NOP;
+        buf[len++] = TCPOPT_SACK_PERM;
+        buf[len++] = 2;
+    }
+    int nsack = min((TCP_MAX_OPTLEN - len - 4) / 8, opts->nsack);
+    if (nsack > 0) {
+        buf[len++] = TCPOPT_NOP;
+        buf[len++] = TCPOPT_NOP;
+        buf[len++] = TCPOPT_SACK;
+        buf[len++] = 2 + 8 * nsack;
+        for (int b = 0; b < nsack; b++, len += 8) {
+            put32(buf + len, opts->sack[b][0]);
+            put32(buf + len + 4, opts->sack[b][1]);
+        }
+    }
+    while (len % 4)
+        buf[len++] = TCPOPT_EOL;
+    return len;
+}
+
+/*
+ * Decode the options of the len byte segment at seg (header in host
+ * order) into opts.  Unknown options are skipped.  Returns the number of
+ * option bytes, or 0 if there are none or dataOffset claims more than the
+ * segment holds.
+ */
+int tcpParseOptions(unsigned char *seg, int len, tcpoptions *opts) {
+    int end = tcpHdrLen((tcpheader *)seg);
+    int i = sizeof(tcpheader);
+
+    memset(opts, 0, sizeof(*opts));
+    if (end > len)
+        return 0;
+    while (i < end && seg[i] != TCPOPT_EOL) {
+        if (seg[i] == TCPOPT_NOP) {
+            i++;
+            continue;
+        }
+        if (i + 1 >= end || seg[i + 1] < 2 || i + seg[i + 1] > end)
+            break;
+        if (seg[i] == TCPOPT_WSCALE && seg[i + 1] == 3) {
+            opts->has_wscale = 1;
+            opts->wscale = seg[i + 2];
+        } else if (seg[i] == TCPOPT_SACK_PERM && seg[i + 1] == 2) {
+            opts->sack_permitted = 1;
+        } else if (seg[i] == TCPOPT_SACK && (seg[i + 1] - 2) % 8 == 0) {
+            for (int b = 0; b < (seg[i + 1] - 2) / 8 && opts->nsack < TCP_MAX_SACK; b++) {
+                opts->sack[opts->nsack][0] = get32(seg + i + 2 + 8 * b);
+                opts->sack[opts->nsack][1] = get32(seg + i + 6 + 8 * b);
+                opts->nsack++;
+            }
+        } else if (seg[i + 1] == 4) {
+            unsigned short value = seg[i + 2] << 8 | seg[i + 3];
+            switch (seg[i]) {
+            case TCPOPT_MSS:       opts->mss = value; break;
+            case TCPOPT_PROBE:     opts->probe = value; break;
+            case TCPOPT_PROBE_ACK: opts->probe_ack = value; break;
+            }
+        }
+        i += seg[i + 1];
+    }
+    return end - sizeof(tcpheader);
+}
+
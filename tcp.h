@@ -28,7 +28,45 @@ static inline int getSyn(tcpheader *hdr) { return (hdr->flags & SYN) >> 1; }
 static inline int getRst(tcpheader *hdr) { return (hdr->flags & RST) >> 2; }
 static inline int getAck(tcpheader *hdr) { return (hdr->flags & ACK) >> 4; }
 
-extern char *tcpHdrToString(tcpheader *hdr);
+/*
+ * Header options, carried between the base header and the payload in
+ * dataOffset 32-bit words as in TCP.  The kinds above 250 are private to
+ * STCP.  A peer that sends no options in its SYN-ACK does not understand
+ * them, so options are then only ever put on the SYN.
+ */
+#define TCPOPT_EOL        0
+#define TCPOPT_NOP        1
+#define TCPOPT_MSS        2
+#define TCPOPT_WSCALE     3
+#define TCPOPT_SACK_PERM  4
+#define TCPOPT_SACK       5
+#define TCPOPT_PROBE    253     /* path MTU probe of the given size, padding only */
+#define TCPOPT_PROBE_ACK 254    /* a probe of the given size arrived */
+#define TCP_MAX_OPTLEN   40
+
+#define TCP_MAX_WSCALE   14     /* RFC 7323 limit on the shift count */
+#define TCP_MAX_SACK      4     /* SACK blocks that fit in the option space */
+
+typedef struct tcpoptions {
+    unsigned short mss;         /* 0 if absent */
+    unsigned char has_wscale;
+    unsigned char wscale;       /* window shift count */
+    unsigned char sack_permitted;
+    unsigned char nsack;        /* SACK blocks in sack[], first is the newest */
+    unsigned int sack[TCP_MAX_SACK][2];     /* [left, right) sequence edges */
+    unsigned short probe;
+    unsigned short probe_ack;
+} tcpoptions;
+
+/* Header length including options, 20 if dataOffset is not set up */
+static inline int tcpHdrLen(tcpheader *hdr) {
+    return hdr->dataOffset > 5 ? hdr->dataOffset * 4 : (int)sizeof(tcpheader);
+}
+
+#define TCP_HDR_STRLEN 128
+extern char *tcpHdrToString(tcpheader *hdr, char *buf, int size);
+extern int tcpWriteOptions(unsigned char *buf, const tcpoptions *opts);
+extern int tcpParseOptions(unsigned char *seg, int len, tcpoptions *opts);
 extern void ntohHdr(tcpheader *hdr);
 extern void htonHdr(tcpheader *hdr);
 #endif
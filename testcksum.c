@@ -0,0 +1,134 @@
+#include <assert.h>
+#include <stdio.h>
+#include <stdlib.h>
+#include <string.h>
+#include <time.h>
+#include "cksum.h"
+
+/*
+ * Check every checksum kernel the CPU supports against the scalar one for
+ * all lengths up to a few KiB at every alignment, both summing and
+ * copying, and the RFC 1624 incremental update against a full sum.  Then
+ * time the kernels on MTU and jumbo sized buffers.  "testcksum -q" skips
+ * the timing.
+ */
+
+#define MAXLEN 65536
+
+static double seconds(void) {
+    struct timespec ts;
+    clock_gettime(CLOCK_MONOTONIC, &ts);
+    return ts.tv_sec + ts.tv_nsec / 1e9;
+}
+
+static const cksum_kernel *scalar(void) {
+    const cksum_kernel **k = cksumKernels;
+    while (k[1] != NULL)
+        k++;
+    return *k;
+}
+
+static int supported(const cksum_kernel *k) {
+    return k->supported == NULL || k->supported();
+}
+
+static unsigned short sum(const cksum_kernel *k, const void *data, int len) {
+    return cksumFinish(k->add(0, data, len));
+}
+
+int main(int argc, char **argv) {
+    unsigned char *buf = malloc(MAXLEN + 64);
+    unsigned char *copy = malloc(MAXLEN + 64);
+    const cksum_kernel *ref = scalar();
+    int sizes[] = { 288, 300, 1500, 1520, 9000, 65507 };
+    volatile unsigned short sink = 0;
+
+    assert(buf != NULL && copy != NULL);
+    srand(317);
+    for (int i = 0; i < MAXLEN + 64; i++)
+        buf[i] = rand();
+
+    printf("selected kernel: %s\n", cksumSelected()->name);
+    for (const cksum_kernel **k = cksumKernels; *k != ref; k++) {
+        if (!supported(*k)) {
+            printf("%-6s not supported by this CPU\n", (*k)->name);
+            continue;
+        }
+        for (int off = 0; off < 8; off++) {
+            for (int len = 0; len <= 4096; len++) {
+                unsigned short want = sum(ref, buf + off, len);
+                assert(sum(*k, buf + off, len) == want);
+                memset(copy, 0, len + 8);
+                assert(cksumFinish((*k)->copy(0, copy + 7 - off, buf + off, len)) == want);
+                assert(memcmp(copy + 7 - off, buf + off, len) == 0);
+            }
+        }
+        for (int i = 0; i < (int)(sizeof(sizes) / sizeof(sizes[0])); i++)
+            assert(sum(*k, buf + 1, sizes[i]) == sum(ref, buf + 1, sizes[i]));
+        /* All ones: every partial sum carries */
+        memset(copy, 0xff, MAXLEN);
+        assert(sum(*k, copy, MAXLEN) == sum(ref, copy, MAXLEN));
+        assert(sum(*k, copy, MAXLEN - 1) == sum(ref, copy, MAXLEN - 1));
+        printf("%-6s matches scalar\n", (*k)->name);
+    }
+
+    /* A header summed apart from its payload, then fields patched in place */
+    for (int trial = 0; trial < 100000; trial++) {
+        unsigned char seg[64];
+        int len = 20 + 2 * (rand() % 22);
+        for (int i = 0; i < len; i++)
+            seg[i] = rand();
+        unsigned short check = cksumFinish(cksumAdd(cksumAdd(0, seg, 20), seg + 20, len - 20));
+        assert(check == ipchecksum(seg, len));
+
+        unsigned int old32, new32 = rand();
+        memcpy(&old32, seg + 4, 4);
+        memcpy(seg + 4, &new32, 4);
+        check = cksumUpdate32(check, old32, new32);
+        assert(check == ipchecksum(seg, len));
+
+        unsigned short old16, new16 = rand();
+        memcpy(&old16, seg + 14, 2);
+        memcpy(seg + 14, &new16, 2);
+        check = cksumUpdate16(check, old16, new16);
+        assert(check == ipchecksum(seg, len));
+    }
+    printf("incremental update matches full sum\n");
+    if (argc > 1 && argv[1][0] == '-' && argv[1][1] == 'q')
+        return 0;
+
+    printf("%6s %-6s %10s %8s %8s %12s\n", "bytes", "kernel", "ns/call", "GB/s", "speedup", "copy+sum ns");
+    for (int i = 0; i < (int)(sizeof(sizes) / sizeof(sizes[0])); i++) {
+        int len = sizes[i];
+        int iterations = (256 << 20) / len;
+        double ns[8], copyNs[8];
+        int n = 0;
+        for (const cksum_kernel **k = cksumKernels; *k != NULL; k++, n++) {
+            ns[n] = 0;
+            if (!supported(*k))
+                continue;
+            double start = seconds();
+            for (int j = 0; j < iterations; j++)
+                sink += sum(*k, buf, len);
+            ns[n] = (seconds() - start) * 1e9 / iterations;
+            start = seconds();
+            for (int j = 0; j < iterations; j++)
+                sink += (*k)->copy(0, copy, buf, len);
+            copyNs[n] = (seconds() - start) * 1e9 / iterations;
+        }
+        /* The scalar kernel is last; the others are reported against it */
+        for (int j = 0; j < n; j++) {
+            if (ns[j] > 0)
+                printf("%6d %-6s %10.1f %8.2f %7.1fx %12.1f\n", len, cksumKernels[j]->name, ns[j], len / ns[j], ns[n - 1] / ns[j], copyNs[j]);
+        }
+        double start = seconds();
+        for (int j = 0; j < iterations; j++) {
+            memcpy(copy, buf, len);
+            sink += ipchecksum(copy, len);
+        }
+        printf("%6d memcpy, then %-6s %32.1f\n", len, cksumSelected()->name, (seconds() - start) * 1e9 / iterations);
+    }
+    free(buf);
+    free(copy);
+    return 0;
+}
@@ -4,6 +4,7 @@
 
 int main(int argc, char **argv) {
     tcpheader hdr;
+    char str[TCP_HDR_STRLEN];
     bzero(&hdr, sizeof(hdr));
     hdr.srcPort = 513;
     hdr.dstPort = 1027;
@@ -12,14 +13,32 @@ int main(int argc, char **argv) {
     hdr.ackNo = 7;
     hdr.seqNo = 23;
     setSyn(&hdr);
-    printf("%s\n", tcpHdrToString(&hdr));
+    printf("%s\n", tcpHdrToString(&hdr, str, sizeof(str)));
     setFin(&hdr);
     setRst(&hdr);
     setAck(&hdr);
-    printf("%s\n", tcpHdrToString(&hdr));
+    printf("%s\n", tcpHdrToString(&hdr, str, sizeof(str)));
     ntohHdr(&hdr);
-    printf("%s\n", tcpHdrToString(&hdr));
+    printf("%s\n", tcpHdrToString(&hdr, str, sizeof(str)));
     ntohHdr(&hdr);
-    printf("%s\n", tcpHdrToString(&hdr));
+    printf("%s\n", tcpHdrToString(&hdr, str, sizeof(str)));
+
+    unsigned char seg[sizeof(tcpheader) + TCP_MAX_OPTLEN];
+    tcpoptions opts = { .mss = 1460, .has_wscale = 1, .wscale = 7, .probe_ack = 9000 };
+    tcpoptions parsed;
+    bzero(seg, sizeof(seg));
+    ((tcpheader *)seg)->dataOffset = 5 + tcpWriteOptions(seg + sizeof(tcpheader), &opts) / 4;
+    printf("options: %d bytes", tcpParseOptions(seg, sizeof(seg), &parsed));
+    printf(" mss %d wscale %d/%d probe %d probe_ack %d\n", parsed.mss, parsed.has_wscale, parsed.wscale,
+           parsed.probe, parsed.probe_ack);
+    printf("truncated: %d bytes\n", tcpParseOptions(seg, sizeof(tcpheader), &parsed));
+
+    tcpoptions sack = { .nsack = 4, .sack = { { 100, 200 }, { 300, 400 }, { 500, 600 }, { 700, 800 } } };
+    bzero(seg, sizeof(seg));
+    ((tcpheader *)seg)->dataOffset = 5 + tcpWriteOptions(seg + sizeof(tcpheader), &sack) / 4;
+    printf("sack: %d bytes", tcpParseOptions(seg, sizeof(seg), &parsed));
+    for (int b = 0; b < parsed.nsack; b++)
+        printf(" [%u, %u)", parsed.sack[b][0], parsed.sack[b][1]);
+    printf("\n");
     return 0;
 }
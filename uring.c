@@ -0,0 +1,293 @@
+/*
+ * Minimal io_uring support, see uring.h.
+ */
+
+#include "uring.h"
+
+#ifdef STCP_HAVE_URING
+
+#include <errno.h>
+#include <poll.h>
+#include <string.h>
+#include <unistd.h>
+#include <sys/mman.h>
+#include <sys/syscall.h>
+#include "stcp.h"
+
+static int sysSetup(unsigned entries, struct io_uring_params *p) {
+    return syscall(__NR_io_uring_setup, entries, p);
+}
+
+static int sysEnter(int fd, unsigned submit, unsigned wait, unsigned flags) {
+    return syscall(__NR_io_uring_enter, fd, submit, wait, flags, NULL, 0);
+}
+
+static int sysRegister(int fd, unsigned op, void *arg, unsigned count) {
+    return syscall(__NR_io_uring_register, fd, op, arg, count);
+}
+
+/*
+ * Create a ring of at least "entries" submission entries and map its
+ * queues.  Returns -1 if io_uring is unavailable (old kernel, disabled
+ * by sysctl or seccomp), leaving u unusable.
+ */
+int uringInit(stcp_uring *u, unsigned entries) {
+    struct io_uring_params p;
+
+    memset(&p, 0, sizeof(p));
+    memset(u, 0, sizeof(*u));
+    u->fd = sysSetup(entries, &p);
+    if (u->fd < 0) {
+        logPerror("io_uring_setup");
+        return -1;
+    }
+
+    u->sq_map_size = p.sq_off.array + p.sq_entries * sizeof(unsigned);
+    u->cq_map_size = p.cq_off.cqes + p.cq_entries * sizeof(struct io_uring_cqe);
+    if (p.features & IORING_FEAT_SINGLE_MMAP) {
+        if (u->cq_map_size > u->sq_map_size)
+            u->sq_map_size = u->cq_map_size;
+        u->cq_map_size = 0;
+    }
+    u->sqes_size = p.sq_entries * sizeof(struct io_uring_sqe);
+    u->sq_map = mmap(NULL, u->sq_map_size, PROT_READ | PROT_WRITE, MAP_SHARED | MAP_POPULATE, u->fd, IORING_OFF_SQ_RING);
+    u->cq_map = u->cq_map_size == 0 ? u->sq_map :
+        mmap(NULL, u->cq_map_size, PROT_READ | PROT_WRITE, MAP_SHARED | MAP_POPULATE, u->fd, IORING_OFF_CQ_RING);
+    u->sqes = mmap(NULL, u->sqes_size, PROT_READ | PROT_WRITE, MAP_SHARED | MAP_POPULATE, u->fd, IORING_OFF_SQES);
+    u->msgs = calloc(p.sq_entries, sizeof(stcp_uring_msg));
+    if (u->sq_map == MAP_FAILED || u->cq_map == MAP_FAILED || u->sqes == MAP_FAILED || u->msgs == NULL) {
+        logPerror("io_uring mmap");
+        if (u->sq_map == MAP_FAILED)
+            u->sq_map = NULL;
+        if (u->cq_map == MAP_FAILED)
+            u->cq_map = NULL;
+        if (u->sqes == MAP_FAILED)
+            u->sqes = NULL;
+        uringFree(u);
+        return -1;
+    }
+
+    unsigned char *sq = u->sq_map, *cq = u->cq_map;
+    u->sq_head = (unsigned *)(sq + p.sq_off.head);
+    u->sq_tail = (unsigned *)(sq + p.sq_off.tail);
+    u->sq_mask = (unsigned *)(sq + p.sq_off.ring_mask);
+    u->sq_array = (unsigned *)(sq + p.sq_off.array);
+    u->cq_head = (unsigned *)(cq + p.cq_off.head);
+    u->cq_tail = (unsigned *)(cq + p.cq_off.tail);
+    u->cq_mask = (unsigned *)(cq + p.cq_off.ring_mask);
+    u->cqes = (struct io_uring_cqe *)(cq + p.cq_off.cqes);
+    u->sq_next = *u->sq_tail;
+    u->skip_success = (p.features & IORING_FEAT_CQE_SKIP) != 0;
+    u->multishot = 1;
+    /* No feature bit of its own; it came with the extended enter arguments */
+    u->timeout_update = (p.features & IORING_FEAT_EXT_ARG) != 0;
+    return 0;
+}
+
+void uringFree(stcp_uring *u) {
+    if (u->sqes != NULL)
+        munmap(u->sqes, u->sqes_size);
+    if (u->cq_map != NULL && u->cq_map != u->sq_map)
+        munmap(u->cq_map, u->cq_map_size);
+    if (u->sq_map != NULL)
+        munmap(u->sq_map, u->sq_map_size);
+    free(u->msgs);
+    if (u->fd >= 0)
+        close(u->fd);
+    memset(u, 0, sizeof(*u));
+    u->fd = -1;
+}
+
+/*
+ * Return a cleared submission entry to fill in, submitting what is
+ * already prepared if the queue is full.  Returns NULL on error.
+ */
+struct io_uring_sqe *uringSqe(stcp_uring *u) {
+    if (u->sq_next - __atomic_load_n(u->sq_head, __ATOMIC_ACQUIRE) > *u->sq_mask &&
+        (uringEnter(u, 0) < 0 || u->sq_next - __atomic_load_n(u->sq_head, __ATOMIC_ACQUIRE) > *u->sq_mask))
+        return NULL;
+    unsigned idx = u->sq_next++ & *u->sq_mask;
+    struct io_uring_sqe *sqe = &u->sqes[idx];
+    memset(sqe, 0, sizeof(*sqe));
+    u->sq_array[idx] = idx;
+    return sqe;
+}
+
+/*
+ * Submit every prepared entry and, if wait is non-zero, wait until that
+ * many completions are available.  An interrupted wait is not an error.
+ * Returns 0, or -1 on error.
+ */
+int uringEnter(stcp_uring *u, unsigned wait) {
+    unsigned submit = u->sq_next - __atomic_load_n(u->sq_head, __ATOMIC_ACQUIRE);
+    if (submit == 0 && wait == 0)
+        return 0;
+    __atomic_store_n(u->sq_tail, u->sq_next, __ATOMIC_RELEASE);
+    if (sysEnter(u->fd, submit, wait, wait ? IORING_ENTER_GETEVENTS : 0) < 0 && errno != EINTR) {
+        logPerror("io_uring_enter");
+        return -1;
+    }
+    return 0;
+}
+
+/* The oldest completion not yet consumed, or NULL */
+struct io_uring_cqe *uringPeek(stcp_uring *u) {
+    unsigned head = *u->cq_head;
+    if (head == __atomic_load_n(u->cq_tail, __ATOMIC_ACQUIRE))
+        return NULL;
+    return &u->cqes[head & *u->cq_mask];
+}
+
+/* Consume the completion uringPeek() returned */
+void uringAdvance(stcp_uring *u) {
+    __atomic_store_n(u->cq_head, *u->cq_head + 1, __ATOMIC_RELEASE);
+}
+
+/*
+ * Turn every completion already posted for the operations tagged "data"
+ * into one that needs nothing done, so that whatever the tag points to
+ * can be freed.
+ */
+void uringForget(stcp_uring *u, uint64_t data) {
+    unsigned tail = __atomic_load_n(u->cq_tail, __ATOMIC_ACQUIRE);
+    for (unsigned head = *u->cq_head; head != tail; head++) {
+        struct io_uring_cqe *cqe = &u->cqes[head & *u->cq_mask];
+        if (cqe->user_data == data)
+            cqe->user_data = URING_IGNORE;
+    }
+}
+
+/*
+ * Register buffers for uringRead(): the kernel pins them once instead of
+ * mapping them on every read.  Returns -1 on error, when reads simply
+ * fall back to unregistered buffers.
+ */
+int uringRegisterBuffers(stcp_uring *u, struct iovec *iov, int count) {
+    if (sysRegister(u->fd, IORING_REGISTER_BUFFERS, iov, count) < 0) {
+        logPerror("io_uring_register");
+        return -1;
+    }
+    return 0;
+}
+
+/*
+ * Prepare a sendmsg of msg.  The header, its iovecs and control message
+ * are copied, as the caller's may be reused before the entry is
+ * submitted; the data must stay valid until then.  Only a failure
+ * completes, if the kernel can skip successful ones.  Returns -1 if no
+ * entry is free or the message has too many parts.
+ */
+int uringSendmsg(stcp_uring *u, int fd, struct msghdr *msg, uint64_t data) {
+    if (msg->msg_iovlen > STCP_URING_MAX_IOV || msg->msg_controllen > sizeof(u->msgs[0].ctrl))
+        return -1;
+    struct io_uring_sqe *sqe = uringSqe(u);
+    if (sqe == NULL)
+        return -1;
+    stcp_uring_msg *m = &u->msgs[sqe - u->sqes];
+    memcpy(m->iov, msg->msg_iov, msg->msg_iovlen * sizeof(struct iovec));
+    memcpy(m->ctrl, msg->msg_control, msg->msg_controllen);
+    m->msg = *msg;
+    m->msg.msg_iov = m->iov;
+    m->msg.msg_control = msg->msg_controllen > 0 ? m->ctrl : NULL;
+
+    sqe->opcode = IORING_OP_SENDMSG;
+    sqe->fd = fd;
+    sqe->addr = (uintptr_t)&m->msg;
+    sqe->len = 1;
+    sqe->flags = u->skip_success ? IOSQE_CQE_SKIP_SUCCESS : 0;
+    sqe->user_data = data;
+    return 0;
+}
+
+/*
+ * Prepare a multishot poll: a completion each time fd becomes readable.
+ * Once multishot is cleared (kernels before 5.13 reject it) the poll ends
+ * after one completion and has to be prepared again.
+ */
+int uringPoll(stcp_uring *u, int fd, uint64_t data) {
+    struct io_uring_sqe *sqe = uringSqe(u);
+    if (sqe == NULL)
+        return -1;
+    sqe->opcode = IORING_OP_POLL_ADD;
+    sqe->fd = fd;
+    sqe->poll32_events = POLLIN;
+    sqe->len = u->multishot ? IORING_POLL_ADD_MULTI : 0;
+    sqe->user_data = data;
+    return 0;
+}
+
+int uringPollRemove(stcp_uring *u, uint64_t data) {
+    struct io_uring_sqe *sqe = uringSqe(u);
+    if (sqe == NULL)
+        return -1;
+    sqe->opcode = IORING_OP_POLL_REMOVE;
+    sqe->fd = -1;
+    sqe->addr = data;
+    sqe->user_data = URING_IGNORE;
+    return 0;
+}
+
+/* Prepare a timeout that completes (with -ETIME) after *ts; ts is copied */
+int uringTimeout(stcp_uring *u, struct __kernel_timespec *ts, uint64_t data) {
+    struct io_uring_sqe *sqe = uringSqe(u);
+    if (sqe == NULL)
+        return -1;
+    sqe->opcode = IORING_OP_TIMEOUT;
+    sqe->fd = -1;
+    sqe->addr = (uintptr_t)ts;
+    sqe->len = 1;
+    sqe->user_data = data;
+    return 0;
+}
+
+/*
+ * Prepare to restart the pending timeout tagged "data" to complete after
+ * *ts instead, which takes neither a new timeout nor the completion of a
+ * cancelled one.  Needs u->timeout_update.
+ */
+int uringTimeoutUpdate(stcp_uring *u, struct __kernel_timespec *ts, uint64_t data) {
+    struct io_uring_sqe *sqe = uringSqe(u);
+    if (sqe == NULL)
+        return -1;
+    sqe->opcode = IORING_OP_TIMEOUT_REMOVE;
+    sqe->fd = -1;
+    sqe->addr = data;
+    sqe->addr2 = (uintptr_t)ts;
+    sqe->timeout_flags = IORING_TIMEOUT_UPDATE;
+    sqe->flags = u->skip_success ? IOSQE_CQE_SKIP_SUCCESS : 0;
+    sqe->user_data = URING_IGNORE;
+    return 0;
+}
+
+int uringTimeoutRemove(stcp_uring *u, uint64_t data) {
+    struct io_uring_sqe *sqe = uringSqe(u);
+    if (sqe == NULL)
+        return -1;
+    sqe->opcode = IORING_OP_TIMEOUT_REMOVE;
+    sqe->fd = -1;
+    sqe->addr = data;
+    sqe->flags = u->skip_success ? IOSQE_CQE_SKIP_SUCCESS : 0;
+    sqe->user_data = URING_IGNORE;
+    return 0;
+}
+
+/*
+ * Prepare a read of up to len bytes at the file's current position into
+ * buf, which lies in registered buffer buf_index, or in no registered
+ * buffer if buf_index is negative.
+ */
+int uringRead(stcp_uring *u, int fd, void *buf, int len, int buf_index, uint64_t data) {
+    struct io_uring_sqe *sqe = uringSqe(u);
+    if (sqe == NULL)
+        return -1;
+    sqe->opcode = buf_index >= 0 ? IORING_OP_READ_FIXED : IORING_OP_READ;
+    sqe->fd = fd;
+    sqe->off = (uint64_t)-1;
+    sqe->addr = (uintptr_t)buf;
+    sqe->len = len;
+    sqe->buf_index = buf_index >= 0 ? buf_index : 0;
+    sqe->user_data = data;
+    return 0;
+}
+
+#endif
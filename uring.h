@@ -0,0 +1,88 @@
+#ifndef __URING_H__
+#define __URING_H__
+
+/*
+ * io_uring through the raw system calls, without liburing.
+ *
+ * A stcp_uring is a submission and a completion ring shared with the
+ * kernel.  Operations are written into submission entries taken with
+ * uringSqe() and handed to the kernel, any number at a time, by one
+ * uringEnter(), which can also wait for completions: the event loop
+ * submits the sends queued since its last wait, the poll that wakes it
+ * for ACKs and the timeout that bounds the wait all in the same call.
+ *
+ * Every operation carries a tag in its user_data: a pointer to the object
+ * its completion is for, with the kind of operation in the low bits.
+ * Compiled in on Linux when the kernel headers have io_uring; used only
+ * when STCP_URING=1 (see event.c).
+ */
+
+#if defined(__linux__) && defined(__has_include)
+#if __has_include(<linux/io_uring.h>)
+#define STCP_HAVE_URING 1
+#endif
+#endif
+
+#ifdef STCP_HAVE_URING
+
+#include <stdint.h>
+#include <sys/socket.h>
+#include <sys/uio.h>
+#include <linux/io_uring.h>
+
+#define STCP_URING_ENTRIES 256
+#define STCP_URING_MAX_IOV 128      /* iovecs of one sendmsg: a GSO run of split segments */
+
+/* Operation kinds, in the low bits of user_data */
+#define URING_IGNORE  0             /* nothing to do on completion */
+#define URING_POLL    1             /* a socket is readable: stcp_event */
+#define URING_SEND    2             /* a failed send: stcp_txq */
+#define URING_DONE    3             /* a read finished: stcp_event, result in ev->result */
+#define URING_KIND(data) ((int)((data) & 3))
+#define URING_PTR(data)  ((void *)(uintptr_t)((data) & ~(uint64_t)3))
+
+static inline uint64_t uringTag(void *ptr, int kind) {
+    return (uintptr_t)ptr | kind;
+}
+
+/* What a sendmsg needs until it has been submitted, one per submission entry */
+typedef struct stcp_uring_msg {
+    struct msghdr msg;
+    struct iovec iov[STCP_URING_MAX_IOV];
+    char ctrl[CMSG_SPACE(sizeof(uint16_t))];
+} stcp_uring_msg;
+
+typedef struct stcp_uring {
+    int fd;
+    int skip_success;               /* sends can skip their completion unless they fail */
+    int multishot;                  /* polls are multishot (cleared if the kernel refuses) */
+    int timeout_update;             /* a pending timeout can be moved (Linux 5.11) */
+    unsigned *sq_head, *sq_tail, *sq_mask, *sq_array;
+    unsigned *cq_head, *cq_tail, *cq_mask;
+    unsigned sq_next;               /* our tail: entries prepared so far */
+    struct io_uring_sqe *sqes;
+    struct io_uring_cqe *cqes;
+    void *sq_map, *cq_map;
+    size_t sq_map_size, cq_map_size, sqes_size;
+    stcp_uring_msg *msgs;
+} stcp_uring;
+
+extern int uringInit(stcp_uring *u, unsigned entries);
+extern void uringFree(stcp_uring *u);
+extern struct io_uring_sqe *uringSqe(stcp_uring *u);
+extern int uringEnter(stcp_uring *u, unsigned wait);
+extern struct io_uring_cqe *uringPeek(stcp_uring *u);
+extern void uringAdvance(stcp_uring *u);
+extern void uringForget(stcp_uring *u, uint64_t data);
+extern int uringRegisterBuffers(stcp_uring *u, struct iovec *iov, int count);
+extern int uringSendmsg(stcp_uring *u, int fd, struct msghdr *msg, uint64_t data);
+extern int uringPoll(stcp_uring *u, int fd, uint64_t data);
+extern int uringPollRemove(stcp_uring *u, uint64_t data);
+extern int uringTimeout(stcp_uring *u, struct __kernel_timespec *ts, uint64_t data);
+extern int uringTimeoutUpdate(stcp_uring *u, struct __kernel_timespec *ts, uint64_t data);
+extern int uringTimeoutRemove(stcp_uring *u, uint64_t data);
+extern int uringRead(stcp_uring *u, int fd, void *buf, int len, int buf_index, uint64_t data);
+
+#endif
+
+#endif